@@ -10,27 +10,26 @@
 #include <asm/hardware.h>
 #include <asm/gpio.h>
 #include <linux/interrupt.h>
+#include <linux/mm.h> /* remap_pfn_range() */
+#include <linux/poll.h> /* poll_wait() */
+#include <linux/sched.h> /* wait queues */
+#include <linux/proc_fs.h> /* ISR statistics */
+#include <linux/bitops.h> /* fls(), set_bit() */
+#include <linux/hrtimer.h> /* ktime_get_ts() */
+#include <linux/mutex.h> /* write_lock */
 #include <asm/arch/pxa-regs.h>
+#include "DMGturret.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
 #define WRITE_BUFFER_SIZE (64)
-#define READ_BUFFER_SIZE (128)
+#define EVENT_BUFFER_COUNT (32) /* Must be a power of two */
 #define DEV_NAME "DMGturret"
+#define PROC_ISR_NAME "DMGturret_isr"
 #define PWM_PERIOD 20000 /* 20 ms in us */
-#define PRIME_TIME_MS 20000
-
-/* GPIO Pins */
-#define STEP_MOTOR_DRIVE 16
-#define STEP_MOTOR_DIRECTION 113
-#define STEP_MOTOR_ENABLE 9  
-#define STEP_MOTOR_FEEDBACK 28
-#define PAN_SERVO 29
-#define TILT_SERVO 30
-#define SOLENOID_ENABLE 31
 
 /*
- * OS Timer 4 enable
+ * OS Timer 4 enable, for the servos. The turrets' timers carry their own.
  * pxa-regs.h only gives us OIER_E0 - 3
  */
 #define OIER_E4 (1 << 4)
@@ -40,24 +39,68 @@ static int DMGturret_init(void);
 static int DMGturret_open(struct inode *inode, struct file *filp);
 static ssize_t DMGturret_read(struct file *filp, char *buf, size_t count, loff_t *f_pos);
 static ssize_t DMGturret_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos); 
+static unsigned int DMGturret_poll(struct file *filp, poll_table *wait);
+static int DMGturret_mmap(struct file *filp, struct vm_area_struct *vma);
 static int DMGturret_release(struct inode *inode, struct file *filp);
 static void DMGturret_exit(void);
 
 /* Declare Function Prototypes - Auxiliary Operations */
+struct turret;
+struct trajectory;
+struct pwm_edge;
+struct pwm_edge_list;
+struct step_profile;
+static int turret_setup(struct turret *turret, unsigned int minor);
+static void turret_teardown(struct turret *turret);
+static bool step_profile_valid(uint32_t start_hz, uint32_t cruise_hz, uint32_t accel);
+static void step_profile_build(struct step_profile *profile);
+static void step_pwm_write(unsigned gpio, uint32_t prescale, uint32_t period, uint32_t duty);
 static int step_motor_pwm_setup(unsigned gpio);
-static void step_motor_release(unsigned gpio);
+static void step_motor_release(struct turret *turret);
+static int step_motor_set_rate(struct turret *turret, uint32_t rate_hz);
+static void step_motor_start(struct turret *turret);
+static void step_motor_stop(struct turret *turret);
+static irqreturn_t handle_step_ramp(int irq, void *dev_id);
 static bool GPIO_OUTPUT_ON(uint8_t servo);
 static bool GPIO_OUTPUT_OFF(uint8_t servo);
+static void pwm_build_edges(struct pwm_edge_list *list);
+static void pwm_apply_edge(const struct pwm_edge *edge);
+static void pwm_wake(void);
 static irqreturn_t handle_ost(int irq, void *dev_id);
+static void pwm_frame_task(unsigned long data);
 static bool parse_uint(const char *buf, uint32_t* num);
-static bool set_pulse_width(uint32_t width, char servo);
-static void hardware_timer_callback(unsigned long data);
+static struct trajectory *servo_trajectory(struct turret *turret, char servo);
+static uint32_t target_pulse_width(struct turret *turret, char servo);
+static bool set_pulse_width(struct turret *turret, uint32_t width, char servo, bool append);
+static bool step_pulse_width(struct turret *turret, char servo, int32_t steps);
+static void step_trajectory(struct trajectory *traj, uint32_t *pulse);
+static bool apply_command(struct turret *turret, char command, uint8_t axis, uint32_t value);
+static void publish_status(struct turret *turret);
+static void post_event(struct turret *turret, uint8_t type, uint8_t detail);
+static uint32_t trace_now_us(void);
+static void trace_command(struct turret *turret, uint8_t type, uint32_t rx_us, uint32_t write_us);
+static void log_frame_traces(struct turret *turret, uint32_t frame_us);
+static int isr_stats_read(char *page, char **start, off_t off, int count, int *eof, void *data);
+static int isr_stats_write(struct file *file, const char *buffer, unsigned long count, void *data);
+static ssize_t write_binary_commands(struct turret *turret, const char *buf, size_t count);
+static ssize_t write_ascii_command(struct turret *turret, const char *buf, size_t count);
+static void turret_timer_start(struct turret *turret, uint32_t us);
+static void turret_timer_cancel(struct turret *turret);
+static irqreturn_t handle_turret_timer(int irq, void *dev_id);
 static irqreturn_t turret_prime_stop(int irq, void *dev_id);
+static void turret_task(unsigned long data);
+static bool program_load(struct turret *turret, const struct dmg_command *steps, unsigned int count);
+static bool program_run(struct turret *turret);
+static void program_stop(struct turret *turret, uint8_t result);
+static irqreturn_t handle_program_timer(int irq, void *dev_id);
+static void program_task(unsigned long data);
 
 /* Set File Access Functions */
 struct file_operations DMGturret_fops = {
 	read: DMGturret_read,
 	write: DMGturret_write,
+	poll: DMGturret_poll,
+	mmap: DMGturret_mmap,
 	open: DMGturret_open,
 	release: DMGturret_release
 };
@@ -68,32 +111,91 @@ module_exit(DMGturret_exit);
 
 /* Declare Global Variables */
 /* Major Number */
-static int DMGturret_major = 61;
-
-/* Read/Write Storage Buffers */
-static char *write_buffer;
-static char *read_buffer;
+static unsigned int DMGturret_major;
+module_param_named(major, DMGturret_major, uint, 0444);
+MODULE_PARM_DESC(major, "Character device major number, or 0 to have one picked");
 
-/* Record Current Message Length */
-static int write_len;
-static int read_len;
+/* Each open file reads events from its own position in its turret's event_buffer */
+struct event_reader {
+	struct turret *turret;
+	unsigned int next;
+};
 
-/* Holds External Hardware State */
-static bool pan_servo_state = false;
-static bool tilt_servo_state = false;
-static bool step_motor_state = false;
-static bool solenoid_state = false;
+/* Command traces, in the status page. See DMG_CMD_TRACE. */
+#define TRACE_PENDING_MAX 8
 
-/* Holds Servo Pulse Width */
-static uint32_t pan_servo_pulse;
-static uint32_t tilt_servo_pulse;
+/*
+ * Stepper drive. At a nonzero cruise rate, the turret's PWM generates the
+ * steps in hardware, ramping up from the start rate on ticks of its ramp
+ * timer. At 0, pwm_frame_task toggles the pin once per servo frame instead,
+ * which is limited to 25 steps/s. The parameters are where every turret
+ * starts.
+ */
+#define DEFAULT_STEP_START_HZ 250u
+#define DEFAULT_STEP_RATE_HZ 2000u
+#define DEFAULT_STEP_ACCEL 10000u /* Hz per second */
+#define MAX_STEP_ACCEL 1000000u
+#define MAX_PRIME_STEPS 1000000u
+#define PWM_CLOCK_HZ 13000000u
+#define PWM_PRESCALE_MAX 0x3f
+#define PWM_PERVAL_MAX 0x3ff
+#define MIN_STEP_RATE_HZ (PWM_CLOCK_HZ / ((PWM_PRESCALE_MAX + 1) * (PWM_PERVAL_MAX + 1)) + 1)
+#define MAX_STEP_RATE_HZ 20000u
+#define STEP_RAMP_TICK_MS 2
+#define STEP_RAMP_MAX 128
+static unsigned int step_rate_hz = DEFAULT_STEP_RATE_HZ;
+module_param(step_rate_hz, uint, 0444);
+MODULE_PARM_DESC(step_rate_hz, "Stepper cruise rate in Hz using PWM0 or PWM1, or 0 to step once per servo frame");
+static unsigned int step_start_hz = DEFAULT_STEP_START_HZ;
+module_param(step_start_hz, uint, 0444);
+MODULE_PARM_DESC(step_start_hz, "Stepper rate in Hz that it can start and stop at without stalling");
+static unsigned int step_accel = DEFAULT_STEP_ACCEL;
+module_param(step_accel, uint, 0444);
+MODULE_PARM_DESC(step_accel, "Stepper acceleration in Hz per second, or 0 to start at the cruise rate");
+static unsigned int prime_steps;
+module_param(prime_steps, uint, 0444);
+MODULE_PARM_DESC(prime_steps, "Steps from the start of priming to the feedback switch, to slow down before it (0 if unknown)");
 
-/* Holds PWM timer remaining time */
-static uint32_t pwm_pulse_remain = 0;
-static uint32_t pwm_period_remain = PWM_PERIOD;
+/*
+ * Trapezoidal speed profile for a stepper on a PWM pin. rates is rebuilt
+ * whenever the profile changes, so each ramp tick only has to copy the next
+ * entry to the PWM registers.
+ */
+struct step_rate {
+	uint32_t hz;
+	uint16_t prescale; /* PWM_CTRL */
+	uint16_t period; /* PWM_PERVAL */
+	uint16_t duty; /* PWM_PWDUTY */
+	uint32_t stop_msteps; /* Steps x 1000 it takes to ramp down to the start rate from here */
+};
+struct step_profile {
+	unsigned int gpio;
+	uint32_t start_hz;
+	uint32_t cruise_hz; /* 0 for the software path */
+	uint32_t accel; /* Hz per second */
+	uint32_t distance; /* Steps to the end of travel, 0 if unknown */
+	struct step_rate rates[STEP_RAMP_MAX];
+	unsigned int rate_count;
+	/* Where a running ramp is */
+	unsigned int index;
+	uint32_t msteps; /* Steps x 1000 since it started */
+};
 
-/* Holds the timer for the solenoid & stepper motor */
-static struct timer_list hardware_timer;
+/*
+ * Firing and priming times, run on an OS timer in one-shot mode so they are
+ * accurate to the microsecond instead of the 10 ms jiffy.
+ */
+#define DEFAULT_FIRE_TIME_US 2000000u
+#define DEFAULT_PRIME_TIMEOUT_US 20000000u
+#define MIN_TURRET_TIME_US 100u
+#define MAX_TURRET_TIME_US 60000000u
+static unsigned int fire_time_us = DEFAULT_FIRE_TIME_US;
+module_param(fire_time_us, uint, 0444);
+MODULE_PARM_DESC(fire_time_us, "How long each shot holds the solenoid, in us");
+static unsigned int prime_timeout_us = DEFAULT_PRIME_TIMEOUT_US;
+module_param(prime_timeout_us, uint, 0444);
+MODULE_PARM_DESC(prime_timeout_us, "How long priming waits for the feedback switch, in us");
+#define TURRET_TIME_VALID(us) ((us) >= MIN_TURRET_TIME_US && (us) <= MAX_TURRET_TIME_US)
 
 /* Holds the Pulse Width */
 #define PULSE_COUNT 10
@@ -107,25 +209,272 @@ static struct timer_list hardware_timer;
 #define PAN_PULSE_LENGTH(index) ((index) * PAN_PULSE_GRANULARITY + MIN_PAN_PULSE)
 #define TILT_PULSE_LENGTH(index) ((index) * TILT_PULSE_GRANULARITY + MIN_TILT_PULSE)
 
-/* Holds PWM State */
-typedef enum {
-	PWM_STATE_ALL_OFF,
-	PWM_STATE_EQUAL_ON,
-	PWM_STATE_PAN_TO_TILT,
-	PWM_STATE_TILT_ONLY,
-	PWM_STATE_TILT_TO_PAN,
-	PWM_STATE_PAN_ONLY
-} pwm_state;
-static pwm_state current_pwm_state = PWM_STATE_ALL_OFF;
-
-/* Holds Turret Firing State */
+/* Holds the planned motion of each servo */
+#define TRAJECTORY_QUEUE_SIZE 8 /* Must be a power of two */
+#define TRAJECTORY_QUEUE_MASK (TRAJECTORY_QUEUE_SIZE - 1)
+#define DEFAULT_MAX_VELOCITY 25u /* us of pulse width per PWM frame */
+#define DEFAULT_MAX_ACCEL 5u /* us per PWM frame, per PWM frame */
+struct trajectory {
+	uint32_t min_pulse;
+	uint32_t max_pulse;
+	int32_t velocity; /* us per PWM frame */
+	uint32_t max_velocity; /* 0 jumps straight to the target */
+	uint32_t max_accel; /* 0 changes velocity instantly */
+	uint32_t targets[TRAJECTORY_QUEUE_SIZE];
+	/* Free-running indices; head is advanced by writers, tail by pwm_frame_task */
+	unsigned int head;
+	unsigned int tail;
+};
+
+/*
+ * Servo PWM channels of every turret, all driven from OS timer 4. Every
+ * channel rises at the start of a frame and falls after its pulse width.
+ * turret_setup adds its turret's servos.
+ */
+#define PWM_MAX_CHANNELS 8
+#define PWM_GPIO_BANKS 4 /* GPIO 0-120 */
+struct pwm_channel {
+	unsigned int gpio;
+	uint32_t *pulse; /* us */
+	struct trajectory *traj;
+};
+static struct pwm_channel pwm_channels[PWM_MAX_CHANNELS];
+static unsigned int pwm_channel_count;
+static uint32_t pwm_frames; /* For the status pages */
+
+/*
+ * One timer match in a PWM frame: the GPIO bits to set and clear, and how
+ * long until the next edge. Channels whose edges coincide share an entry.
+ * Edge 0 starts the frame.
+ */
+struct pwm_edge {
+	uint32_t set[PWM_GPIO_BANKS];
+	uint32_t clear[PWM_GPIO_BANKS];
+	uint32_t delay; /* us */
+};
+struct pwm_edge_list {
+	struct pwm_edge edges[PWM_MAX_CHANNELS + 1];
+	unsigned int edge_count;
+	uint32_t pulses[PWM_MAX_CHANNELS]; /* The widths the edges were built for */
+};
+
+/*
+ * handle_ost plays the active list while pwm_frame_task builds the next
+ * frame in the other one. handle_ost swaps them at the start of a frame
+ * once pwm_spare_ready says the spare is complete.
+ */
+static struct pwm_edge_list pwm_lists[2];
+static unsigned int pwm_active;
+static bool pwm_spare_ready;
+static unsigned int pwm_next_edge; /* 0 at the start of a frame */
+static DECLARE_TASKLET(pwm_tasklet, pwm_frame_task, 0);
+static bool pwm_irq_claimed; /* handle_ost is installed */
+
+/*
+ * Once no servo of any turret has moved for idle_settle_ms, frames stop
+ * after the current one, or only one in every idle_hold_frames is sent to
+ * keep the servos holding. Queuing a target wakes them at the next frame
+ * boundary.
+ */
+#define DEFAULT_IDLE_SETTLE_MS 2000u
+#define MAX_IDLE_HOLD_FRAMES 1000u
+#define PWM_WAKE_SLACK 50u /* us */
+/*
+ * Where the idle counter wraps. Whole frames, so the grid survives the wrap,
+ * with room for pwm_wake to add two more without overflowing.
+ */
+#define PWM_IDLE_MATCH ((~0u / PWM_PERIOD - 3) * PWM_PERIOD)
+static unsigned int idle_settle_ms = DEFAULT_IDLE_SETTLE_MS;
+module_param(idle_settle_ms, uint, 0444);
+MODULE_PARM_DESC(idle_settle_ms, "Stop the servo pulses after this long without moving, or 0 to never stop");
+static unsigned int idle_hold_frames;
+module_param(idle_hold_frames, uint, 0444);
+MODULE_PARM_DESC(idle_hold_frames, "While idle, send one servo frame in this many to hold position, or 0 to release the servos");
+static uint32_t idle_settle_frames; /* idle_settle_ms rounded up to whole frames */
+static bool pwm_idle;
+static uint32_t pwm_still_frames; /* Frames in a row without any servo moving */
+
+/* Turret Firing States */
 typedef enum {
-	TURRET_STANDBY,
-	TURRET_PRIMING,
-	TURRET_READY,
-	TURRET_FIRING
+	TURRET_STANDBY = DMG_TURRET_STANDBY,
+	TURRET_PRIMING = DMG_TURRET_PRIMING,
+	TURRET_READY = DMG_TURRET_READY,
+	TURRET_FIRING = DMG_TURRET_FIRING
 } turret_state;
-static turret_state current_turret_state = TURRET_STANDBY;
+
+/*
+ * Work the turret interrupts leave for turret_task. Closings of the
+ * feedback switch within FEEDBACK_DEBOUNCE_MS of the last one it accepted
+ * are bounces.
+ */
+#define TURRET_WORK_TIMER 0 /* The fire timer matched */
+#define TURRET_WORK_FEEDBACK 1 /* The feedback switch closed */
+#define FEEDBACK_DEBOUNCE_MS 20
+
+/* A LOOP must wait at least this long per pass */
+#define PROGRAM_MIN_LOOP_WAIT_US 1000u
+
+/*
+ * One of OS timers 5-11, in the mode timer 4 uses: 1 us ticks, reset on a
+ * match. All of them interrupt on IRQ_OST_4_11.
+ */
+struct ost_timer {
+	volatile u32 *match; /* OSMRn */
+	volatile u32 *count; /* OSCRn */
+	volatile u32 *mode; /* OMCRn */
+	uint32_t bit; /* In OIER and OSSR */
+};
+#define OST_TIMER(n) { &OSMR##n, &OSCR##n, &OMCR##n, 1 << (n) }
+
+/*
+ * What each minor drives. Only GPIO16 and GPIO17 can carry PWM0 and PWM1,
+ * and each turret takes three of the OS timers left over from the servos,
+ * so there is room for DMG_MAX_TURRETS.
+ */
+struct turret_config {
+	unsigned int pan_servo;
+	unsigned int tilt_servo;
+	unsigned int solenoid;
+	unsigned int step_drive;
+	unsigned int step_direction;
+	unsigned int step_enable; /* Assert low to activate */
+	unsigned int step_feedback;
+	struct ost_timer ramp_timer; /* Stepper ramp ticks */
+	struct ost_timer fire_timer; /* Firing and priming times */
+	struct ost_timer program_timer; /* Sequence program waits */
+};
+static const struct turret_config turret_configs[DMG_MAX_TURRETS] = {
+	{
+		.pan_servo = 29,
+		.tilt_servo = 30,
+		.solenoid = 31,
+		.step_drive = GPIO16_PWM0,
+		.step_direction = 113,
+		.step_enable = 9,
+		.step_feedback = 28,
+		.ramp_timer = OST_TIMER(5),
+		.fire_timer = OST_TIMER(6),
+		.program_timer = OST_TIMER(7),
+	},
+	{
+		.pan_servo = 58,
+		.tilt_servo = 59,
+		.solenoid = 60,
+		.step_drive = GPIO17_PWM1,
+		.step_direction = 61,
+		.step_enable = 62,
+		.step_feedback = 63,
+		.ramp_timer = OST_TIMER(8),
+		.fire_timer = OST_TIMER(9),
+		.program_timer = OST_TIMER(10),
+	},
+};
+
+/*
+ * The pins turret_setup claims, in order. turret_teardown releases the
+ * first pins_claimed of them.
+ */
+static const struct turret_pin {
+	size_t offset; /* Of the pin number in struct turret_config */
+	const char *label;
+} turret_pins[] = {
+	{ offsetof(struct turret_config, pan_servo), "PAN_SERVO" },
+	{ offsetof(struct turret_config, tilt_servo), "TILT_SERVO" },
+	{ offsetof(struct turret_config, step_drive), "STEP_MOTOR_DRIVE" },
+	{ offsetof(struct turret_config, step_direction), "STEP_MOTOR_DIRECTION" },
+	{ offsetof(struct turret_config, step_enable), "STEP_MOTOR_ENABLE" },
+	{ offsetof(struct turret_config, step_feedback), "STEP_MOTOR_FEEDBACK" },
+	{ offsetof(struct turret_config, solenoid), "SOLENOID_ENABLE" },
+};
+#define TURRET_PIN(config, i) (*(const unsigned int *)((const char *)(config) + turret_pins[i].offset))
+
+/* The interrupts turret_setup has claimed, as bits of irqs_claimed */
+#define TURRET_IRQ_FEEDBACK 0
+#define TURRET_IRQ_RAMP 1
+#define TURRET_IRQ_FIRE 2
+#define TURRET_IRQ_PROGRAM 3
+
+/*
+ * Everything one turret needs. The minor a file was opened with picks the
+ * turret; the servo PWM and the ISR statistics are shared by all of them.
+ */
+struct turret {
+	const struct turret_config *config; /* NULL until turret_setup */
+	unsigned int pins_claimed; /* The first this many of turret_pins */
+	unsigned long irqs_claimed; /* TURRET_IRQ_* bits */
+
+	/* Read/Write Storage Buffers. Every file on the minor writes through write_buffer. */
+	struct mutex write_lock; /* Held across the copy from userspace and the apply */
+	char *write_buffer;
+	struct dmg_event *event_buffer;
+	unsigned int event_head; /* Sequence number of the next event */
+	wait_queue_head_t event_wait; /* Readers sleep here until an event is posted */
+
+	/* Status page shared read-only with userspace through mmap */
+	struct dmg_status *status_page;
+	struct dmg_trace_log *trace_log;
+	struct dmg_trace pending_traces[TRACE_PENDING_MAX]; /* Waiting for the next PWM frame */
+	unsigned int pending_trace_count;
+	uint32_t commands_applied;
+	uint32_t commands_rejected;
+
+	/* Holds External Hardware State */
+	bool step_motor_state;
+	bool solenoid_state;
+	bool step_drive_level; /* Software drive pin level */
+	struct step_profile stepper;
+
+	/* Holds Servo Pulse Width */
+	uint32_t pan_servo_pulse;
+	uint32_t tilt_servo_pulse;
+	struct trajectory pan_trajectory;
+	struct trajectory tilt_trajectory;
+
+	/* Holds Turret Firing State */
+	turret_state state;
+	uint32_t fire_time_us;
+	uint32_t prime_timeout_us;
+	unsigned long work; /* TURRET_WORK_* bits */
+	unsigned long feedback_jiffies; /* When the switch last closed */
+	unsigned long feedback_accepted;
+	bool feedback_seen;
+	struct tasklet_struct tasklet;
+
+	/*
+	 * The loaded sequence program. Each wait ends its length after the
+	 * last one ended, so waits never drift however late program_task runs.
+	 * program_loops holds the passes left for each LOOP.
+	 */
+	struct dmg_command program[DMG_PROGRAM_MAX_STEPS];
+	struct dmg_command program_staging[DMG_PROGRAM_MAX_STEPS]; /* Being written */
+	uint32_t program_loops[DMG_PROGRAM_MAX_STEPS];
+	unsigned int program_length;
+	unsigned int program_pc;
+	bool program_running;
+	bool program_holding; /* Waiting at a HOLD for the turret state */
+	struct tasklet_struct program_tasklet;
+};
+static struct turret turrets[DMG_MAX_TURRETS];
+static unsigned int turret_count = 1;
+module_param_named(turrets, turret_count, uint, 0444);
+MODULE_PARM_DESC(turrets, "How many turrets to drive, one per device minor");
+
+/*
+ * Holds OS timer 4 interrupt timing, read from OSCR4 (1 us ticks, reset on
+ * match). Latency is how long after the match handle_ost started; duration
+ * is how long it ran. Bucket 0 counts 0 us and bucket n counts
+ * [2^(n-1), 2^n) us, with the last bucket holding everything longer.
+ */
+#define ISR_HIST_BUCKETS 16
+struct isr_histogram {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t buckets[ISR_HIST_BUCKETS];
+};
+static struct isr_histogram ost_latency = { .min = ~0u };
+static struct isr_histogram ost_duration = { .min = ~0u };
+static struct proc_dir_entry *isr_proc_entry;
 
 /* Holds the debug counter (SIMULATION ONLY)*/
 #ifdef SIM_MODE
@@ -133,39 +482,251 @@ static uint32_t debug_counter = 0;
 #endif
 
 /* Auxiliary Function Definitions */
+
+/* Can a profile with these rates be built? */
+static bool
+step_profile_valid(uint32_t start_hz, uint32_t cruise_hz, uint32_t accel)
+{
+	uint32_t ticks;
+
+	if (!cruise_hz)
+		return true;
+	if (start_hz > cruise_hz)
+		start_hz = cruise_hz;
+	if (start_hz < MIN_STEP_RATE_HZ || cruise_hz > MAX_STEP_RATE_HZ || accel > MAX_STEP_ACCEL)
+		return false;
+	if (!accel)
+		return true;
+
+	/* Every rate on the way to cruise_hz must fit in the table */
+	ticks = ((cruise_hz - start_hz) * 1000 + accel * STEP_RAMP_TICK_MS - 1) / (accel * STEP_RAMP_TICK_MS);
+	return ticks < STEP_RAMP_MAX;
+}
+
+/*
+ * Fill in the PWM settings for each ramp tick, from the start rate up to
+ * the cruise rate. The output is 13 MHz / ((PRESCALE + 1) * (PERVAL + 1)),
+ * so use the smallest prescaler that fits the period in PERVAL. Call with
+ * interrupts disabled, after step_profile_valid.
+ */
+static void
+step_profile_build(struct step_profile *profile)
+{
+	uint32_t start_hz = min(profile->start_hz, profile->cruise_hz);
+	uint32_t hz = start_hz;
+	uint32_t stop_msteps = 0;
+	uint32_t cycles;
+	uint32_t prescale;
+	uint32_t period;
+	unsigned int i;
+
+	profile->rate_count = 0;
+	for (i = 0; profile->cruise_hz && i < STEP_RAMP_MAX; i++)
+	{
+		cycles = PWM_CLOCK_HZ / hz;
+		prescale = (cycles + PWM_PERVAL_MAX) / (PWM_PERVAL_MAX + 1);
+		period = cycles / prescale;
+		profile->rates[i].hz = hz;
+		profile->rates[i].prescale = prescale - 1;
+		profile->rates[i].period = period - 1;
+		profile->rates[i].duty = period / 2;
+		profile->rates[i].stop_msteps = stop_msteps;
+		profile->rate_count = i + 1;
+		if (hz == profile->cruise_hz)
+			break;
+
+		stop_msteps += hz * STEP_RAMP_TICK_MS;
+		hz = profile->accel ? start_hz + profile->accel * (i + 1) * STEP_RAMP_TICK_MS / 1000 : profile->cruise_hz;
+		if (hz > profile->cruise_hz)
+			hz = profile->cruise_hz;
+	}
+}
+
+static void
+step_pwm_write(unsigned gpio, uint32_t prescale, uint32_t period, uint32_t duty)
+{
+#ifndef SIM_MODE
+	if (gpio == GPIO16_PWM0) {
+		PWM_CTRL0 = prescale;
+		PWM_PERVAL0 = period;
+		PWM_PWDUTY0 = duty;
+	} else if (gpio == GPIO17_PWM1) {
+		PWM_CTRL1 = prescale;
+		PWM_PERVAL1 = period;
+		PWM_PWDUTY1 = duty;
+	}
+#endif
+}
+
+/* Hand a PWM pin to its PWM, stopped until step_motor_start */
 static int
 step_motor_pwm_setup(unsigned gpio)
 {
+#ifndef SIM_MODE
 	// Check gpio to verify if it is PWM compatible
 	// Set up PWM if valid
 	if (gpio == GPIO16_PWM0) {
 		CKEN |= CKEN0_PWM0;
+		PWM_PWDUTY0 = 0;
 		pxa_gpio_mode(GPIO16_PWM0_MD);
-		PWM_CTRL0 |= 0x3f;
-		PWM_PERVAL0 |= 0x3ff;
-		PWM_PWDUTY0 |= 0x1ff;
 	} else if (gpio == GPIO17_PWM1) {
 		CKEN |= CKEN1_PWM1;
+		PWM_PWDUTY1 = 0;
 		pxa_gpio_mode(GPIO17_PWM1_MD);
-		PWM_CTRL1 |= 0x3f;
-	        PWM_PERVAL1 |= 0x3ff;
-		PWM_PWDUTY1 |= 0x1ff;
 	} else {
 		return -EINVAL;
 	}
+#endif
 
 	return 0;
 }
 
+/* Stop a turret's PWM pin and hand it back as a low GPIO output */
 static void
-step_motor_release(unsigned gpio)
+step_motor_release(struct turret *turret)
 {
+	unsigned gpio = turret->stepper.gpio;
+
+#ifndef SIM_MODE
 	// Check gpio to verify it is PWM compatible
 	// Set PWM_PWDUTY to zero so output is disabled
-	if (gpio == GPIO16_PWM0)
+	if (gpio == GPIO16_PWM0) {
 		PWM_PWDUTY0 = 0;
-	else if (gpio == GPIO17_PWM1)
+		CKEN &= ~CKEN0_PWM0;
+	} else if (gpio == GPIO17_PWM1) {
 		PWM_PWDUTY1 = 0;
+		CKEN &= ~CKEN1_PWM1;
+	} else {
+		return;
+	}
+	pxa_gpio_mode(gpio | GPIO_OUT);
+#endif
+	turret->step_drive_level = GPIO_OUTPUT_OFF(gpio);
+}
+
+/* Change the cruise rate, switching between PWM (rate_hz > 0) and pwm_frame_task (0) */
+static int
+step_motor_set_rate(struct turret *turret, uint32_t rate_hz)
+{
+	struct step_profile *profile = &turret->stepper;
+	unsigned long flags;
+	int result = 0;
+
+	if (!step_profile_valid(profile->start_hz, rate_hz, profile->accel))
+		return -EINVAL;
+
+	local_irq_save(flags);
+	step_motor_stop(turret);
+	if (rate_hz && !profile->cruise_hz)
+		result = step_motor_pwm_setup(profile->gpio);
+	else if (!rate_hz && profile->cruise_hz)
+		step_motor_release(turret);
+	if (result == 0)
+	{
+		profile->cruise_hz = rate_hz;
+		step_profile_build(profile);
+	}
+	if (turret->step_motor_state)
+		step_motor_start(turret);
+	local_irq_restore(flags);
+	return result;
+}
+
+/* Start stepping from the start rate; the driver must also be enabled */
+static void
+step_motor_start(struct turret *turret)
+{
+	struct step_profile *profile = &turret->stepper;
+	const struct ost_timer *timer = &turret->config->ramp_timer;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if (!profile->cruise_hz)
+	{
+		/* pwm_frame_task steps it, so the frames must keep running */
+		pwm_wake();
+		local_irq_restore(flags);
+		return;
+	}
+
+	profile->index = 0;
+	profile->msteps = 0;
+	step_pwm_write(profile->gpio, profile->rates[0].prescale, profile->rates[0].period,
+	               profile->rates[0].duty);
+	if (profile->rate_count > 1)
+	{
+		*timer->match = STEP_RAMP_TICK_MS * 1000;
+		OSSR = timer->bit; /* A match left over from the last run */
+		OIER |= timer->bit;
+		*timer->count = 0; /* Start the counter */
+	}
+	local_irq_restore(flags);
+}
+
+static void
+step_motor_stop(struct turret *turret)
+{
+	struct step_profile *profile = &turret->stepper;
+	const struct ost_timer *timer = &turret->config->ramp_timer;
+	unsigned long flags;
+
+	if (!profile->cruise_hz)
+		return;
+
+	/* Without a restart from handle_step_ramp, the counter stops at its next match */
+	local_irq_save(flags);
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+	step_pwm_write(profile->gpio, profile->rates[0].prescale, profile->rates[0].period, 0);
+	local_irq_restore(flags);
+}
+
+/*
+ * Move a running stepper one tick along its ramp. It speeds up to the
+ * cruise rate, and if the distance is known, slows back down in time to
+ * reach the end at the start rate.
+ */
+static irqreturn_t
+handle_step_ramp(int irq, void *dev_id)
+{
+	struct step_profile *profile = dev_id;
+	const struct ost_timer *timer = &container_of(profile, struct turret, stepper)->config->ramp_timer;
+	const struct step_rate *rate;
+	uint32_t end_msteps;
+	uint32_t remaining;
+
+	/* The counter matches with the interrupt off too */
+	if (!(OSSR & OIER & timer->bit))
+	{
+		return IRQ_NONE;
+	}
+
+	profile->msteps += profile->rates[profile->index].hz * STEP_RAMP_TICK_MS;
+	end_msteps = profile->distance * 1000;
+	remaining = (profile->msteps < end_msteps) ? end_msteps - profile->msteps : 0;
+
+	if (profile->distance && remaining <= profile->rates[profile->index].stop_msteps)
+	{
+		if (profile->index > 0)
+			profile->index--;
+	}
+	else if (profile->index + 1 < profile->rate_count)
+	{
+		profile->index++;
+	}
+	else if (!profile->distance)
+	{
+		/* Cruising with nothing to slow down for */
+		OIER &= ~timer->bit;
+	}
+
+	rate = &profile->rates[profile->index];
+	step_pwm_write(profile->gpio, rate->prescale, rate->period, rate->duty);
+
+	OSSR = timer->bit;
+	if (OIER & timer->bit)
+		*timer->count = 0; /* Restart the counter for the next tick */
+	return IRQ_HANDLED;
 }
 
 static bool
@@ -186,72 +747,258 @@ GPIO_OUTPUT_OFF(uint8_t servo)
 	return false;
 }
 
+static inline void
+isr_histogram_add(struct isr_histogram *hist, uint32_t us)
+{
+	unsigned int bucket = fls(us);
+
+	if (bucket >= ISR_HIST_BUCKETS)
+		bucket = ISR_HIST_BUCKETS - 1;
+	hist->buckets[bucket]++;
+	hist->count++;
+	if (us < hist->min)
+		hist->min = us;
+	if (us > hist->max)
+		hist->max = us;
+}
+
+/*
+ * Sort the channels by pulse width into an edge list. Only runs when a
+ * width changes, so the per-edge work in handle_ost stays the same however
+ * many channels there are.
+ */
+static void
+pwm_build_edges(struct pwm_edge_list *list)
+{
+	unsigned int order[PWM_MAX_CHANNELS];
+	struct pwm_edge *edge = &list->edges[0];
+	uint32_t elapsed = 0;
+	uint32_t pulse;
+	unsigned int gpio;
+	unsigned int i, j;
+
+	memset(list->edges, 0, sizeof(list->edges));
+	for (i = 0; i < pwm_channel_count; i++)
+	{
+		list->pulses[i] = *pwm_channels[i].pulse;
+		gpio = pwm_channels[i].gpio;
+		edge->set[gpio >> 5] |= GPIO_bit(gpio);
+
+		/* Insertion sort; there are only a few channels */
+		for (j = i; j > 0 && list->pulses[order[j - 1]] > list->pulses[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (i = 0; i < pwm_channel_count; i++)
+	{
+		pulse = list->pulses[order[i]];
+		if (pulse != elapsed)
+		{
+			edge->delay = pulse - elapsed;
+			edge++;
+			elapsed = pulse;
+		}
+		gpio = pwm_channels[order[i]].gpio;
+		edge->clear[gpio >> 5] |= GPIO_bit(gpio);
+	}
+	edge->delay = PWM_PERIOD - elapsed;
+	list->edge_count = edge - list->edges + 1;
+}
+
+static void
+pwm_apply_edge(const struct pwm_edge *edge)
+{
+#ifndef SIM_MODE
+	unsigned int bank;
+
+	for (bank = 0; bank < PWM_GPIO_BANKS; bank++)
+	{
+		if (edge->set[bank])
+			GPSR(bank << 5) = edge->set[bank];
+		if (edge->clear[bank])
+			GPCR(bank << 5) = edge->clear[bank];
+	}
+#endif
+}
+
+/*
+ * Leave idle mode. If the frames have stopped, start the next one on the
+ * next PWM_PERIOD boundary of the old frames, so that no pulse starts less
+ * than a period after the last. Call with interrupts disabled.
+ */
+static void
+pwm_wake(void)
+{
+	const struct pwm_edge_list *list = &pwm_lists[pwm_active];
+	uint32_t last_edge_at;
+	uint32_t since_frame;
+	uint32_t next_frame;
+
+	pwm_still_frames = 0;
+	if (!pwm_idle)
+		return;
+	pwm_idle = false;
+	if (pwm_next_edge != 0)
+		return; /* Still in the last frame, which carries on as usual */
+
+	/* OSCR4 has counted from the last edge of the last frame */
+	last_edge_at = PWM_PERIOD - list->edges[list->edge_count - 1].delay;
+	since_frame = last_edge_at + OSCR4;
+	next_frame = (since_frame / PWM_PERIOD + 1) * PWM_PERIOD;
+	/* Leave time to program the match before the counter gets there */
+	if (next_frame - since_frame < PWM_WAKE_SLACK)
+		next_frame += PWM_PERIOD;
+	OSMR4 = next_frame - last_edge_at;
+	OSSR = OIER_E4;
+	OIER |= OIER_E4;
+}
+
+/*
+ * Top half of the servo PWM: play the next edge and program the match for
+ * the one after. Everything else happens in pwm_frame_task, scheduled after
+ * the last edge of the frame, which leaves it the rest of the frame to run.
+ */
 static irqreturn_t
 handle_ost(int irq, void *dev_id)
 {
-	/* All OS timers 4-11 are handled here. Check which one ticked. */
-	if (!(OSSR & OIER_E4))
+	const struct pwm_edge_list *list;
+	const struct pwm_edge *edge;
+	uint32_t entry_ticks;
+
+	/*
+	 * All OS timers 4-11 are handled here. Check which one ticked; timer 4
+	 * still matches while idle, with its interrupt off.
+	 */
+	if (!(OSSR & OIER & OIER_E4))
 	{
 		return IRQ_NONE;
 	}
+	/* The counter restarted from 0 at the match */
+	entry_ticks = OSCR4;
 	
 	/*
 	 * Handle PWM Signals
-	 * Align them to start at the same time. Trigger each followup OST tick
-	 * to happen when the next-soonest PWM falling edge is until none remain.
-	 * Then schedule the next rising edge.
+	 * All channels rise together at the start of a frame. Each following
+	 * OST tick is the next-soonest group of falling edges, until none
+	 * remain and the next frame is scheduled.
 	 */
-	switch (current_pwm_state) {
-		case PWM_STATE_ALL_OFF: 
+	if (pwm_next_edge == 0 && pwm_spare_ready)
+	{
+		pwm_active = !pwm_active;
+		pwm_spare_ready = false;
+	}
+	list = &pwm_lists[pwm_active];
+	edge = &list->edges[pwm_next_edge];
+	pwm_apply_edge(edge);
+	OSMR4 = edge->delay;
+	if (++pwm_next_edge == list->edge_count)
+	{
+		pwm_next_edge = 0;
+		if (pwm_idle && idle_hold_frames)
+		{
+			OSMR4 += (idle_hold_frames - 1) * PWM_PERIOD;
+		}
+		else if (pwm_idle)
+		{
+			/* Keep counting from this edge so pwm_wake can find the frame grid */
+			OIER &= ~OIER_E4;
+			OSMR4 = PWM_IDLE_MATCH;
+		}
+		tasklet_schedule(&pwm_tasklet);
+	}
+
+	isr_histogram_add(&ost_latency, entry_ticks);
+	isr_histogram_add(&ost_duration, OSCR4 - entry_ticks);
+
+	/* Mark the tick as handled by writing a 1 in this timer's status. */
+	OSSR = OIER_E4;
+	OSCR4 = 0; /* Reset the counter. */
+	return IRQ_HANDLED;
+}
+
+/*
+ * Bottom half of handle_ost, run once the last edge of a frame has passed.
+ * Moves each servo one step along its trajectory, builds the next frame's
+ * edges in the spare list if a width changed, and does the per-frame
+ * bookkeeping. A frame that starts before it finishes repeats the last
+ * widths.
+ */
+static void
+pwm_frame_task(unsigned long data)
+{
+	const struct pwm_edge_list *active;
+	struct pwm_edge_list *spare;
+	struct turret *turret;
+	uint32_t until_frame = 0;
+	unsigned long flags;
+	bool changed = false;
+	unsigned int i;
+
+	/* Keep handle_ost off the spare list while it is rebuilt */
+	local_irq_save(flags);
+	pwm_spare_ready = false;
+	active = &pwm_lists[pwm_active];
+	spare = &pwm_lists[!pwm_active];
+	if (pwm_next_edge == 0 && (OIER & OIER_E4) && OSMR4 > OSCR4)
+		until_frame = OSMR4 - OSCR4;
+	local_irq_restore(flags);
+
 #ifdef SIM_MODE
-			debug_counter++;
+	debug_counter++;
 #endif
-			pwm_pulse_remain = (pan_servo_pulse < tilt_servo_pulse) ? tilt_servo_pulse - pan_servo_pulse : pan_servo_pulse - tilt_servo_pulse;
-			pwm_period_remain = (pan_servo_pulse < tilt_servo_pulse) ? PWM_PERIOD - tilt_servo_pulse : PWM_PERIOD - pan_servo_pulse;
-			current_pwm_state = (pan_servo_pulse < tilt_servo_pulse) ? PWM_STATE_PAN_TO_TILT :
-				    (pan_servo_pulse > tilt_servo_pulse) ? PWM_STATE_TILT_TO_PAN : PWM_STATE_EQUAL_ON;
-			pan_servo_state = GPIO_OUTPUT_ON(PAN_SERVO);
-			tilt_servo_state = GPIO_OUTPUT_ON(TILT_SERVO);
-			step_motor_state = (step_motor_state) ? GPIO_OUTPUT_OFF(STEP_MOTOR_DRIVE) : GPIO_OUTPUT_ON(STEP_MOTOR_DRIVE);
-			OSMR4 = (pan_servo_pulse < tilt_servo_pulse) ? pan_servo_pulse : tilt_servo_pulse;
-			break;
-		case PWM_STATE_EQUAL_ON: 
-			pan_servo_state = GPIO_OUTPUT_OFF(PAN_SERVO);
-			tilt_servo_state = GPIO_OUTPUT_OFF(TILT_SERVO);
-			current_pwm_state = PWM_STATE_ALL_OFF;
-			OSMR4 = pwm_period_remain;
-			break;
-		case PWM_STATE_PAN_TO_TILT:
-			pan_servo_state = GPIO_OUTPUT_OFF(PAN_SERVO);
-			current_pwm_state = PWM_STATE_TILT_ONLY;
-			OSMR4 = pwm_pulse_remain;
-			break;
-		case PWM_STATE_TILT_ONLY:
-			tilt_servo_state = GPIO_OUTPUT_OFF(TILT_SERVO);
-			current_pwm_state = PWM_STATE_ALL_OFF;
-			OSMR4 = pwm_period_remain;
-			break;
-		case PWM_STATE_TILT_TO_PAN:
-			tilt_servo_state = GPIO_OUTPUT_OFF(TILT_SERVO);
-			current_pwm_state = PWM_STATE_PAN_ONLY;
-			OSMR4 = pwm_pulse_remain;
-			break;
-		case PWM_STATE_PAN_ONLY:
-			pan_servo_state = GPIO_OUTPUT_OFF(PAN_SERVO);
-			current_pwm_state = PWM_STATE_ALL_OFF;
-			OSMR4 = pwm_period_remain;
-			break;
+	for (i = 0; i < pwm_channel_count; i++)
+	{
+		step_trajectory(pwm_channels[i].traj, pwm_channels[i].pulse);
+		if (*pwm_channels[i].pulse != active->pulses[i])
+			changed = true;
+	}
+	if (changed)
+	{
+		pwm_build_edges(spare);
+		smp_wmb();
+		pwm_spare_ready = true;
+	}
+
+	for (i = 0; i < pwm_channel_count; i++)
+	{
+		if (pwm_channels[i].traj->head != pwm_channels[i].traj->tail)
+			changed = true;
+	}
+	for (i = 0; i < turret_count; i++)
+	{
+		turret = &turrets[i];
+		if (turret->pending_trace_count || (!turret->stepper.cruise_hz && turret->step_motor_state))
+			changed = true;
+	}
+	if (changed)
+		pwm_still_frames = 0;
+	else if (pwm_still_frames < ~0u)
+		pwm_still_frames++;
+	/* Play the frame just built, then go idle */
+	if (idle_settle_frames && pwm_still_frames >= idle_settle_frames)
+		pwm_idle = true;
+
+	pwm_frames++;
+	for (i = 0; i < turret_count; i++)
+	{
+		turret = &turrets[i];
+		publish_status(turret);
+		if (turret->pending_trace_count)
+			log_frame_traces(turret, trace_now_us() + until_frame);
+		if (!turret->stepper.cruise_hz && turret->step_motor_state)
+			turret->step_drive_level = turret->step_drive_level ?
+				GPIO_OUTPUT_OFF(turret->stepper.gpio) : GPIO_OUTPUT_ON(turret->stepper.gpio);
 	}
+
 #ifdef SIM_MODE
 	if (debug_counter == 1000) {
-		printk(KERN_INFO "Twenty seconds of cycles; Pan Pulse Width = %u | Tilt Pulse Width = %u\n", pan_servo_pulse, tilt_servo_pulse);
+		for (i = 0; i < turret_count; i++)
+			printk(KERN_INFO "Twenty seconds of cycles; Turret %u Pan Pulse Width = %u | Tilt Pulse Width = %u\n",
+			       i, turrets[i].pan_servo_pulse, turrets[i].tilt_servo_pulse);
 		debug_counter = 1;
 	}
 #endif
-	/* Mark the tick as handled by writing a 1 in this timer's status. */
-	OSSR = OIER_E4;
-	OSCR4 = 0; /* Reset the counter. */
-	return IRQ_HANDLED;
 }
 
 static bool
@@ -266,137 +1013,935 @@ parse_uint(const char* buf, uint32_t* num)
 	return false;
 }
 
-static bool
-set_pulse_width(uint32_t width, char servo)
+static struct trajectory *
+servo_trajectory(struct turret *turret, char servo)
 {
-	if (servo == 'p' && width >= MIN_PAN_PULSE && width <= MAX_PAN_PULSE)
-	{
-		width = min(MAX_PAN_PULSE, max(MIN_PAN_PULSE, width));
-		pan_servo_pulse = width;
-	}
-	else if (servo == 't' && width >= MIN_TILT_PULSE && width <= MAX_TILT_PULSE)
-	{
-		width = min(MAX_TILT_PULSE, max(MIN_TILT_PULSE, width));
-		tilt_servo_pulse = width;
-	}
-	else
-	{
-		return false;
-	}
-
-#ifdef SIM_MODE
-	printk(KERN_INFO "Set %c: %d\n", servo, width);
-#endif
-
-	return true;
+	if (servo == 'p')
+		return &turret->pan_trajectory;
+	if (servo == 't')
+		return &turret->tilt_trajectory;
+	return NULL;
 }
 
-static void
-hardware_timer_callback(unsigned long data)
+/*
+ * Where the servo will be once it finishes its queued moves. Call with
+ * interrupts disabled.
+ */
+static uint32_t
+target_pulse_width(struct turret *turret, char servo)
+{
+	struct trajectory *traj = servo_trajectory(turret, servo);
+
+	if (traj->head != traj->tail)
+		return traj->targets[(traj->head - 1) & TRAJECTORY_QUEUE_MASK];
+	return (servo == 'p') ? turret->pan_servo_pulse : turret->tilt_servo_pulse;
+}
+
+/*
+ * Step a servo's target along the grid, stopping at the end of its range, so
+ * that a merged run of moves ends where the moves one at a time would have.
+ */
+static bool
+step_pulse_width(struct turret *turret, char servo, int32_t steps)
+{
+	struct trajectory *traj = servo_trajectory(turret, servo);
+	int32_t granularity = (servo == 'p') ? PAN_PULSE_GRANULARITY : TILT_PULSE_GRANULARITY;
+	int32_t width;
+
+	if (!traj)
+		return false;
+	width = (int32_t)target_pulse_width(turret, servo) + steps * granularity;
+	width = max_t(int32_t, min_t(int32_t, width, traj->max_pulse), traj->min_pulse);
+	return set_pulse_width(turret, width, servo, false);
+}
+
+/*
+ * Aim a servo at a pulse width. With append, the servo stops at its
+ * currently queued targets first. Otherwise the last queued target is
+ * replaced, so repeated relative moves never fill the queue.
+ */
+static bool
+set_pulse_width(struct turret *turret, uint32_t width, char servo, bool append)
 {
-	if (current_turret_state == TURRET_FIRING) {
+	struct trajectory *traj = servo_trajectory(turret, servo);
+	unsigned long flags;
+
+	if (!traj || width < traj->min_pulse || width > traj->max_pulse)
+	{
+		return false;
+	}
+
+	local_irq_save(flags);
+	if (!append && traj->head != traj->tail)
+	{
+		traj->targets[(traj->head - 1) & TRAJECTORY_QUEUE_MASK] = width;
+	}
+	else if (traj->head - traj->tail < TRAJECTORY_QUEUE_SIZE)
+	{
+		traj->targets[traj->head & TRAJECTORY_QUEUE_MASK] = width;
+		traj->head++;
+	}
+	else
+	{
+		local_irq_restore(flags);
+		return false;
+	}
+	pwm_wake();
+	local_irq_restore(flags);
+
 #ifdef SIM_MODE
-		printk(KERN_INFO "...solenoid now off after 2 seconds\n");
+	printk(KERN_INFO "Set %c: %d\n", servo, width);
 #endif
-		solenoid_state = !(GPIO_OUTPUT_OFF(SOLENOID_ENABLE));
-		current_turret_state = TURRET_STANDBY;
+
+	return true;
+}
+
+/*
+ * Move one PWM frame along a trajectory. Speed is limited so the servo can
+ * still slow down to a stop at the target with max_accel:
+ * v <= sqrt(2 * a * distance).
+ */
+static void
+step_trajectory(struct trajectory *traj, uint32_t *pulse)
+{
+	int32_t distance;
+	int32_t speed;
+	int32_t desired;
+	int32_t accel = traj->max_accel;
+
+	if (traj->head == traj->tail)
+		return;
+
+	distance = traj->targets[traj->tail & TRAJECTORY_QUEUE_MASK] - *pulse;
+	speed = traj->max_velocity ? traj->max_velocity : abs(distance);
+	if (accel)
+		speed = min_t(int32_t, speed, int_sqrt(2 * accel * abs(distance)));
+	desired = (distance < 0) ? -speed : speed;
+
+	if (accel && desired > traj->velocity + accel)
+		traj->velocity += accel;
+	else if (accel && desired < traj->velocity - accel)
+		traj->velocity -= accel;
+	else
+		traj->velocity = desired;
+
+	/* Never overshoot the target */
+	if ((distance >= 0 && traj->velocity > distance) ||
+	    (distance <= 0 && traj->velocity < distance))
+		traj->velocity = distance;
+
+	*pulse += traj->velocity;
+	if (*pulse == traj->targets[traj->tail & TRAJECTORY_QUEUE_MASK])
+	{
+		/* Stop at every target before heading to the next */
+		traj->velocity = 0;
+		traj->tail++;
+	}
+}
+
+/*
+ * Copy the turret state to the status page. The generation is odd while
+ * the copy is in progress so readers can retry instead of seeing a torn
+ * update.
+ */
+static void
+publish_status(struct turret *turret)
+{
+	struct dmg_status *status_page = turret->status_page;
+	unsigned long flags;
+
+	if (!status_page)
+		return;
+
+	local_irq_save(flags);
+	status_page->generation++;
+	smp_wmb();
+	status_page->turret_state = turret->state;
+	status_page->pan_pulse = turret->pan_servo_pulse;
+	status_page->tilt_pulse = turret->tilt_servo_pulse;
+	status_page->solenoid_state = turret->solenoid_state;
+	status_page->step_motor_state = turret->step_motor_state;
+	status_page->commands_applied = turret->commands_applied;
+	status_page->commands_rejected = turret->commands_rejected;
+	status_page->pwm_frames = pwm_frames;
+	status_page->servos_idle = pwm_idle;
+	status_page->program_running = turret->program_running;
+	smp_wmb();
+	status_page->generation++;
+	local_irq_restore(flags);
+}
+
+/*
+ * Record an event for every reader and wake them. When the buffer wraps,
+ * readers that fell behind lose the oldest events. Safe from any context.
+ */
+static void
+post_event(struct turret *turret, uint8_t type, uint8_t detail)
+{
+	struct dmg_event *event;
+	unsigned long flags;
+
+	if (!turret->event_buffer)
+		return;
+
+	local_irq_save(flags);
+	event = &turret->event_buffer[turret->event_head & (EVENT_BUFFER_COUNT - 1)];
+	event->type = type;
+	event->detail = detail;
+	event->lost = 0;
+	event->time_ms = jiffies_to_msecs(jiffies);
+	turret->event_head++;
+	local_irq_restore(flags);
+
+	wake_up_interruptible(&turret->event_wait);
+
+	/* A program may be holding for this state */
+	if (type == DMG_EVENT_STATE && turret->program_holding)
+		tasklet_schedule(&turret->program_tasklet);
+}
+
+/* CLOCK_MONOTONIC in microseconds, truncated to 32 bits like userspace does */
+static uint32_t
+trace_now_us(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return (uint32_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* Call with interrupts disabled */
+static void
+log_trace(struct dmg_trace_log *trace_log, const struct dmg_trace *trace)
+{
+	trace_log->traces[trace_log->head & (DMG_TRACE_COUNT - 1)] = *trace;
+	smp_wmb();
+	trace_log->head++;
+}
+
+/*
+ * Log a traced command once it has been applied. Moves only reach the
+ * servos in the next PWM frame, so their traces wait for pwm_frame_task.
+ */
+static void
+trace_command(struct turret *turret, uint8_t type, uint32_t rx_us, uint32_t write_us)
+{
+	struct dmg_trace trace = {
+		.type = type,
+		.rx_us = rx_us,
+		.write_us = write_us,
+		.frame_us = write_us,
+	};
+	unsigned long flags;
+
+	if (!turret->trace_log)
+		return;
+
+	local_irq_save(flags);
+	if (type == DMG_CMD_FIRE || type == DMG_CMD_PRIME)
+		log_trace(turret->trace_log, &trace);
+	else if (turret->pending_trace_count < TRACE_PENDING_MAX)
+		turret->pending_traces[turret->pending_trace_count++] = trace;
+	else
+		turret->trace_log->dropped++;
+	local_irq_restore(flags);
+}
+
+/* Called from pwm_frame_task with when the frame it built starts */
+static void
+log_frame_traces(struct turret *turret, uint32_t frame_us)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	local_irq_save(flags);
+	for (i = 0; i < turret->pending_trace_count; i++)
+	{
+		turret->pending_traces[i].frame_us = frame_us;
+		log_trace(turret->trace_log, &turret->pending_traces[i]);
+	}
+	turret->pending_trace_count = 0;
+	local_irq_restore(flags);
+}
+
+static int
+isr_histogram_print(char *page, int size, const char *name, const struct isr_histogram *hist)
+{
+	int len;
+	int i;
+
+	len = snprintf(page, size, "%s_us count %u min %u max %u\n", name,
+	               hist->count, hist->count ? hist->min : 0, hist->max);
+	for (i = 0; i < ISR_HIST_BUCKETS && len < size; i++)
+	{
+		if (i == 0)
+			len += snprintf(page + len, size - len, "  0: %u\n", hist->buckets[i]);
+		else if (i == ISR_HIST_BUCKETS - 1)
+			len += snprintf(page + len, size - len, "  %u+: %u\n", 1u << (i - 1), hist->buckets[i]);
+		else
+			len += snprintf(page + len, size - len, "  %u-%u: %u\n", 1u << (i - 1), (1u << i) - 1, hist->buckets[i]);
+	}
+	return min(len, size);
+}
+
+/* Report the ISR timing histograms in /proc */
+static int
+isr_stats_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct isr_histogram latency;
+	struct isr_histogram duration;
+	unsigned long flags;
+	int len;
+
+	/* Everything fits in the first read */
+	if (off > 0)
+	{
+		*eof = 1;
+		return 0;
+	}
+
+	local_irq_save(flags);
+	latency = ost_latency;
+	duration = ost_duration;
+	local_irq_restore(flags);
+
+	len = isr_histogram_print(page, count, "latency", &latency);
+	len += isr_histogram_print(page + len, count - len, "duration", &duration);
+	*eof = 1;
+	return len;
+}
+
+/* Any write to the /proc file resets the ISR timing histograms */
+static int
+isr_stats_write(struct file *file, const char *buffer, unsigned long count, void *data)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	memset(&ost_latency, 0, sizeof(ost_latency));
+	memset(&ost_duration, 0, sizeof(ost_duration));
+	ost_latency.min = ~0u;
+	ost_duration.min = ~0u;
+	local_irq_restore(flags);
+	return count;
+}
+
+/* Time the current shot or prime on the fire timer, replacing any running time */
+static void
+turret_timer_start(struct turret *turret, uint32_t us)
+{
+	const struct ost_timer *timer = &turret->config->fire_timer;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	*timer->match = us;
+	OSSR = timer->bit;
+	OIER |= timer->bit;
+	*timer->count = 0; /* Start the counter */
+	local_irq_restore(flags);
+}
+
+static void
+turret_timer_cancel(struct turret *turret)
+{
+	const struct ost_timer *timer = &turret->config->fire_timer;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+	local_irq_restore(flags);
+}
+
+/*
+ * The fire time or prime timeout is up. The solenoid pulse ends here, on the
+ * microsecond; the state change waits for turret_task.
+ */
+static irqreturn_t
+handle_turret_timer(int irq, void *dev_id)
+{
+	struct turret *turret = container_of(dev_id, struct turret, fire_time_us);
+	const struct ost_timer *timer = &turret->config->fire_timer;
+
+	/* A cancelled time still matches, but with the interrupt off */
+	if (!(OSSR & OIER & timer->bit))
+	{
+		return IRQ_NONE;
+	}
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+
+	if (turret->solenoid_state)
+		GPIO_OUTPUT_OFF(turret->config->solenoid);
+	set_bit(TURRET_WORK_TIMER, &turret->work);
+	tasklet_schedule(&turret->tasklet);
+	return IRQ_HANDLED;
+}
+
+/* The priming feedback switch closed */
+static irqreturn_t
+turret_prime_stop(int irq, void *dev_id)
+{
+	struct turret *turret = dev_id;
+
+	turret->feedback_jiffies = jiffies;
+	set_bit(TURRET_WORK_FEEDBACK, &turret->work);
+	tasklet_schedule(&turret->tasklet);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Bottom half of the turret interrupts: debounce the feedback switch and
+ * move the firing state machine along.
+ */
+static void
+turret_task(unsigned long data)
+{
+	struct turret *turret = (struct turret *)data;
+	bool changed = false;
+
+	if (test_and_clear_bit(TURRET_WORK_FEEDBACK, &turret->work) &&
+	    (!turret->feedback_seen ||
+	     turret->feedback_jiffies - turret->feedback_accepted >= msecs_to_jiffies(FEEDBACK_DEBOUNCE_MS))) {
+		turret->feedback_seen = true;
+		turret->feedback_accepted = turret->feedback_jiffies;
+		post_event(turret, DMG_EVENT_FEEDBACK, 0);
+		if (turret->state == TURRET_PRIMING) {
+			turret_timer_cancel(turret);
+			step_motor_stop(turret);
+			turret->step_motor_state = !(GPIO_OUTPUT_ON(turret->config->step_enable));
+			turret->state = TURRET_READY;
+			post_event(turret, DMG_EVENT_STATE, turret->state);
+			changed = true;
+		}
 	}
-	else if (current_turret_state == TURRET_PRIMING) {
+
+	/* After the feedback, which may have ended priming first */
+	if (test_and_clear_bit(TURRET_WORK_TIMER, &turret->work)) {
+		if (turret->state == TURRET_FIRING) {
+#ifdef SIM_MODE
+			printk(KERN_INFO "...solenoid now off after %u us\n", turret->fire_time_us);
+#endif
+			turret->solenoid_state = false;
+			turret->state = TURRET_STANDBY;
+			post_event(turret, DMG_EVENT_STATE, turret->state);
+			changed = true;
+		}
+		else if (turret->state == TURRET_PRIMING) {
 #ifdef SIM_MODE
-		printk(KERN_INFO "...stepper motor now off after 10 seconds\n");
+			printk(KERN_INFO "...stepper motor now off after %u us\n", turret->prime_timeout_us);
 #endif
-		step_motor_state = !(GPIO_OUTPUT_ON(STEP_MOTOR_ENABLE));
-		current_turret_state = TURRET_READY;
+			step_motor_stop(turret);
+			turret->step_motor_state = !(GPIO_OUTPUT_ON(turret->config->step_enable));
+			turret->state = TURRET_READY;
+			post_event(turret, DMG_EVENT_STATE, turret->state);
+			changed = true;
+		}
+	}
+
+	if (changed)
+		publish_status(turret);
+}
+
+/* Whether a program step is allowed, given the steps before it */
+static bool
+program_step_valid(const struct dmg_command *steps, unsigned int i)
+{
+	const struct dmg_command *step = &steps[i];
+	uint32_t wait_us = 0;
+	unsigned int j;
+
+	switch (step->type)
+	{
+	case DMG_CMD_UP:
+	case DMG_CMD_DOWN:
+	case DMG_CMD_LEFT:
+	case DMG_CMD_RIGHT:
+	case DMG_CMD_MOVE_TO:
+	case DMG_CMD_AIM:
+	case DMG_CMD_SET_VELOCITY:
+	case DMG_CMD_SET_ACCEL:
+	case DMG_CMD_FIRE:
+	case DMG_CMD_PRIME:
+		return true;
+	case DMG_CMD_WAIT:
+		return step->axis == 0 && step->value <= MAX_TURRET_TIME_US;
+	case DMG_CMD_HOLD:
+		return step->axis == 0 && step->value <= DMG_TURRET_FIRING;
+	case DMG_CMD_LOOP:
+		if (step->axis >= i)
+			return false;
+		/* A pass that never waits would keep program_task running forever */
+		for (j = step->axis; j < i; j++)
+		{
+			if (steps[j].type == DMG_CMD_WAIT)
+				wait_us += steps[j].value;
+		}
+		return wait_us >= PROGRAM_MIN_LOOP_WAIT_US;
+	default:
+		return false;
+	}
+}
+
+/* Replace the loaded program. Fails if a step is invalid or a program is running. */
+static bool
+program_load(struct turret *turret, const struct dmg_command *steps, unsigned int count)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!program_step_valid(steps, i))
+			return false;
+	}
+
+	local_irq_save(flags);
+	if (turret->program_running)
+	{
+		local_irq_restore(flags);
+		return false;
+	}
+	memcpy(turret->program, steps, count * sizeof(*steps));
+	turret->program_length = count;
+	local_irq_restore(flags);
+	return true;
+}
+
+static bool
+program_run(struct turret *turret)
+{
+	const struct ost_timer *timer = &turret->config->program_timer;
+	unsigned long flags;
+	unsigned int i;
+
+	local_irq_save(flags);
+	if (turret->program_running || !turret->program_length)
+	{
+		local_irq_restore(flags);
+		return false;
 	}
+	for (i = 0; i < turret->program_length; i++)
+		turret->program_loops[i] = turret->program[i].value;
+	turret->program_pc = 0;
+	turret->program_holding = false;
+	turret->program_running = true;
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+	*timer->count = 0; /* Start the counter; the first wait counts from here */
+	local_irq_restore(flags);
+
+	tasklet_schedule(&turret->program_tasklet);
+	return true;
+}
+
+static void
+program_stop(struct turret *turret, uint8_t result)
+{
+	const struct ost_timer *timer = &turret->config->program_timer;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+	turret->program_running = false;
+	turret->program_holding = false;
+	local_irq_restore(flags);
+
+	post_event(turret, DMG_EVENT_PROGRAM, result);
+}
+
+/*
+ * Arm the program timer to end a wait us after the last one ended. Returns
+ * false if that time has already passed, moving the counter on as if the
+ * wait had ended on time.
+ */
+static bool
+program_wait(struct turret *turret, uint32_t us)
+{
+	const struct ost_timer *timer = &turret->config->program_timer;
+	unsigned long flags;
+	uint32_t elapsed;
+	bool armed;
+
+	local_irq_save(flags);
+	OSSR = timer->bit;
+	*timer->match = us;
+	elapsed = *timer->count;
+	/* A match since OSSR was cleared has already reset the counter */
+	armed = elapsed < us || (OSSR & timer->bit);
+	if (armed)
+		OIER |= timer->bit;
+	else
+		*timer->count = elapsed - us;
+	local_irq_restore(flags);
+	return armed;
 }
 
+/* A program wait is over */
 static irqreturn_t
-turret_prime_stop(int irq, void *dev_id)
+handle_program_timer(int irq, void *dev_id)
 {
-	if (current_turret_state == TURRET_PRIMING) {
-		step_motor_state = !(GPIO_OUTPUT_ON(STEP_MOTOR_ENABLE));
-		current_turret_state = TURRET_READY;
+	struct turret *turret = container_of(dev_id, struct turret, program);
+	const struct ost_timer *timer = &turret->config->program_timer;
+
+	/* The counter runs on through a HOLD, matching with the interrupt off */
+	if (!(OSSR & OIER & timer->bit))
+	{
+		return IRQ_NONE;
 	}
+	OIER &= ~timer->bit;
+	OSSR = timer->bit;
+	tasklet_schedule(&turret->program_tasklet);
 	return IRQ_HANDLED;
 }
-		
+
+/* Bottom half of the program timer: run steps up to the next wait */
+static void
+program_task(unsigned long data)
+{
+	struct turret *turret = (struct turret *)data;
+	const struct dmg_command *step;
+	unsigned long flags;
+
+	/* Stopped, or still waiting */
+	if (!turret->program_running || (OIER & turret->config->program_timer.bit))
+		return;
+
+	while (turret->program_pc < turret->program_length)
+	{
+		step = &turret->program[turret->program_pc];
+		switch (step->type)
+		{
+		case DMG_CMD_WAIT:
+			turret->program_pc++;
+			if (program_wait(turret, step->value))
+				return;
+			break;
+		case DMG_CMD_HOLD:
+			if (turret->state != step->value)
+			{
+				/* post_event runs us again when the state changes */
+				turret->program_holding = true;
+				return;
+			}
+			if (turret->program_holding)
+			{
+				/* The next wait counts from the end of this one */
+				turret->program_holding = false;
+				local_irq_save(flags);
+				*turret->config->program_timer.count = 0;
+				local_irq_restore(flags);
+			}
+			turret->program_pc++;
+			break;
+		case DMG_CMD_LOOP:
+			if (!step->value || --turret->program_loops[turret->program_pc] > 0)
+			{
+				turret->program_pc = step->axis;
+			}
+			else
+			{
+				/* Ready for an enclosing loop to run this one again */
+				turret->program_loops[turret->program_pc] = step->value;
+				turret->program_pc++;
+			}
+			break;
+		default:
+			if (!apply_command(turret, step->type, step->axis, step->value))
+			{
+				program_stop(turret, DMG_PROGRAM_FAILED);
+				publish_status(turret);
+				return;
+			}
+			turret->program_pc++;
+			break;
+		}
+	}
+	program_stop(turret, DMG_PROGRAM_DONE);
+	publish_status(turret);
+}
+
+/*
+ * Claim a turret's pins and timers and start it in standby with its servos
+ * centered. It drives nothing until DMGturret_init starts the servo PWM.
+ * Each pin and interrupt is recorded as it is claimed, so turret_teardown
+ * releases just those if setup fails part way. Its servos join the PWM
+ * frames last, so a failed setup leaves none behind.
+ */
+static int
+turret_setup(struct turret *turret, unsigned int minor)
+{
+	const struct turret_config *config = &turret_configs[minor];
+	unsigned int i;
+	int result;
+
+	memset(turret, 0, sizeof(*turret));
+	turret->config = config;
+	tasklet_init(&turret->tasklet, turret_task, (unsigned long)turret);
+	tasklet_init(&turret->program_tasklet, program_task, (unsigned long)turret);
+	init_waitqueue_head(&turret->event_wait);
+
+	/* Initialize GPIO Settings */
+	for (i = 0; i < ARRAY_SIZE(turret_pins); i++)
+	{
+		if (gpio_request(TURRET_PIN(config, i), turret_pins[i].label) != 0)
+		{
+			printk("Turret %u GPIO %u (%s) not acquired \n", minor, TURRET_PIN(config, i), turret_pins[i].label);
+			return -EBUSY;
+		}
+		turret->pins_claimed++;
+	}
+	result = gpio_direction_output(config->pan_servo, 0)
+		|| gpio_direction_output(config->tilt_servo, 0)
+		|| gpio_direction_output(config->step_enable, 1) /* Enable is assert low to activate */
+		|| gpio_direction_output(config->step_direction, 0)
+		|| gpio_direction_input(config->step_feedback)
+		|| gpio_direction_output(config->step_drive, 0)
+		|| gpio_direction_output(config->solenoid, 0);
+	if (result != 0)
+	{
+		printk("Turret %u GPIO direction not set \n", minor);
+		return -EBUSY;
+	}
+	turret->step_motor_state = !(GPIO_OUTPUT_ON(config->step_enable)); /*XXX: Should be taken care of with gpio_direction_output...*/
+	turret->solenoid_state = false;
+	turret->state = TURRET_STANDBY;
+	turret->fire_time_us = fire_time_us;
+	turret->prime_timeout_us = prime_timeout_us;
+	turret->stepper.gpio = config->step_drive;
+	turret->stepper.start_hz = step_start_hz;
+	turret->stepper.accel = step_accel;
+	turret->stepper.distance = prime_steps;
+	result = step_motor_set_rate(turret, step_rate_hz);
+	if (result != 0)
+	{
+		return result;
+	}
+	if (request_irq(IRQ_GPIO(config->step_feedback), &turret_prime_stop, SA_INTERRUPT | SA_TRIGGER_RISING,
+	                DEV_NAME, turret) != 0) {
+		printk("Turret %u feedback irq not acquired \n", minor);
+		return -EBUSY;
+	}
+	set_bit(TURRET_IRQ_FEEDBACK, &turret->irqs_claimed);
+
+	/* Allocate Write Buffer Memory */
+	mutex_init(&turret->write_lock);
+	turret->write_buffer = kmalloc(WRITE_BUFFER_SIZE, GFP_KERNEL);
+	if (!turret->write_buffer)
+	{
+		return -ENOMEM;
+	}
+	memset(turret->write_buffer, 0, WRITE_BUFFER_SIZE);
+
+	/* Allocate Event Buffer Memory */
+	turret->event_buffer = kmalloc(EVENT_BUFFER_COUNT * sizeof(*turret->event_buffer), GFP_KERNEL);
+	if (!turret->event_buffer)
+	{
+		return -ENOMEM;
+	}
+	memset(turret->event_buffer, 0, EVENT_BUFFER_COUNT * sizeof(*turret->event_buffer));
+	turret->event_head = 0;
+
+	/* Allocate the Status Page. Reserved so it can be mapped to userspace. */
+	turret->status_page = (struct dmg_status *)get_zeroed_page(GFP_KERNEL);
+	if (!turret->status_page)
+	{
+		return -ENOMEM;
+	}
+	SetPageReserved(virt_to_page(turret->status_page));
+	turret->trace_log = (struct dmg_trace_log *)((char *)turret->status_page + DMG_TRACE_LOG_OFFSET);
+
+	/* Center the servos */
+	turret->pan_servo_pulse = PAN_PULSE_LENGTH(DEFAULT_PULSE_INDEX);
+	turret->tilt_servo_pulse = TILT_PULSE_LENGTH(DEFAULT_PULSE_INDEX);
+	turret->pan_trajectory.min_pulse = MIN_PAN_PULSE;
+	turret->pan_trajectory.max_pulse = MAX_PAN_PULSE;
+	turret->tilt_trajectory.min_pulse = MIN_TILT_PULSE;
+	turret->tilt_trajectory.max_pulse = MAX_TILT_PULSE;
+	turret->pan_trajectory.max_velocity = turret->tilt_trajectory.max_velocity = DEFAULT_MAX_VELOCITY;
+	turret->pan_trajectory.max_accel = turret->tilt_trajectory.max_accel = DEFAULT_MAX_ACCEL;
+	publish_status(turret);
+
+	/* Stepper ramp timer, stopping at each match until handle_step_ramp restarts it */
+	if (request_irq(IRQ_OST_4_11, &handle_step_ramp, SA_SHIRQ, DEV_NAME, &turret->stepper) != 0) {
+		printk("Turret %u stepper ramp irq not acquired \n", minor);
+		return -EBUSY;
+	}
+	set_bit(TURRET_IRQ_RAMP, &turret->irqs_claimed);
+	*config->ramp_timer.mode = 0x8c; /* As timer 4, but the counter stops at the match */
+
+	/* Timer for firing and priming times */
+	if (request_irq(IRQ_OST_4_11, &handle_turret_timer, SA_SHIRQ, DEV_NAME, &turret->fire_time_us) != 0) {
+		printk("Turret %u timer irq not acquired \n", minor);
+		return -EBUSY;
+	}
+	set_bit(TURRET_IRQ_FIRE, &turret->irqs_claimed);
+	*config->fire_timer.mode = 0x8c; /* As timer 4, but the counter stops at the match */
+
+	/* Timer for sequence programs, in the same mode as timer 4 */
+	if (request_irq(IRQ_OST_4_11, &handle_program_timer, SA_SHIRQ, DEV_NAME, turret->program) != 0) {
+		printk("Turret %u program timer irq not acquired \n", minor);
+		return -EBUSY;
+	}
+	set_bit(TURRET_IRQ_PROGRAM, &turret->irqs_claimed);
+	*config->program_timer.mode = 0xcc;
+
+	/* Add its servos to the PWM frames once nothing else can fail */
+	pwm_channels[pwm_channel_count].gpio = config->pan_servo;
+	pwm_channels[pwm_channel_count].pulse = &turret->pan_servo_pulse;
+	pwm_channels[pwm_channel_count].traj = &turret->pan_trajectory;
+	pwm_channel_count++;
+	pwm_channels[pwm_channel_count].gpio = config->tilt_servo;
+	pwm_channels[pwm_channel_count].pulse = &turret->tilt_servo_pulse;
+	pwm_channels[pwm_channel_count].traj = &turret->tilt_trajectory;
+	pwm_channel_count++;
+
+	return 0;
+}
+
+/* Stop and release a turret. Call once the servo PWM has stopped. */
+static void
+turret_teardown(struct turret *turret)
+{
+	const struct turret_config *config = turret->config;
+
+	if (!config)
+		return;
+
+	/* Release its OS Timers */
+	OIER &= ~(config->ramp_timer.bit | config->fire_timer.bit | config->program_timer.bit);
+	if (test_and_clear_bit(TURRET_IRQ_PROGRAM, &turret->irqs_claimed))
+		free_irq(IRQ_OST_4_11, turret->program);
+	if (test_and_clear_bit(TURRET_IRQ_FIRE, &turret->irqs_claimed))
+		free_irq(IRQ_OST_4_11, &turret->fire_time_us);
+	if (test_and_clear_bit(TURRET_IRQ_RAMP, &turret->irqs_claimed))
+		free_irq(IRQ_OST_4_11, &turret->stepper);
+
+	/* Turn Off & Release GPIO, if it got them all */
+	if (turret->pins_claimed == ARRAY_SIZE(turret_pins))
+	{
+		GPIO_OUTPUT_OFF(config->pan_servo);
+		GPIO_OUTPUT_OFF(config->tilt_servo);
+		if (turret->stepper.cruise_hz)
+		{
+			step_motor_stop(turret);
+			step_motor_release(turret);
+		}
+		GPIO_OUTPUT_OFF(config->step_drive);
+		GPIO_OUTPUT_OFF(config->step_direction);
+		GPIO_OUTPUT_OFF(config->step_enable);
+		GPIO_OUTPUT_OFF(config->solenoid);
+	}
+	if (test_and_clear_bit(TURRET_IRQ_FEEDBACK, &turret->irqs_claimed))
+		free_irq(IRQ_GPIO(config->step_feedback), turret);
+	while (turret->pins_claimed > 0)
+	{
+		turret->pins_claimed--;
+		gpio_free(TURRET_PIN(config, turret->pins_claimed));
+	}
+	tasklet_kill(&turret->tasklet);
+	tasklet_kill(&turret->program_tasklet);
+
+	/* Free Event Buffer Memory */
+	if (turret->event_buffer)
+	{
+		kfree(turret->event_buffer);
+		turret->event_buffer = NULL;
+	}
+
+	/* Free Write Buffer Memory */
+	if (turret->write_buffer)
+	{
+		kfree(turret->write_buffer);
+		turret->write_buffer = NULL;
+	}
+
+	/* Free the Status Page once nothing can publish to it */
+	if (turret->status_page)
+	{
+		ClearPageReserved(virt_to_page(turret->status_page));
+		free_page((unsigned long)turret->status_page);
+		turret->status_page = NULL;
+		turret->trace_log = NULL;
+	}
+	turret->config = NULL;
+}
+
 /* Module File Operation Definitions */
 static int DMGturret_init(void)
 {
 	int result;
-	int feedback_irq;
+	unsigned int i;
 
 	printk(KERN_INFO "Installing module...\n");
 
-	/* Register Device */
+	if (turret_count < 1 || turret_count > DMG_MAX_TURRETS)
+	{
+		printk("turrets must be 1-%u\n", DMG_MAX_TURRETS);
+		return -EINVAL;
+	}
+
+	/* Register Device, with a major picked for us unless one was given */
 	result = register_chrdev(DMGturret_major, DEV_NAME, &DMGturret_fops);
 	if (result < 0)
 	{
 		return result;
 	}
+	if (DMGturret_major == 0)
+	{
+		DMGturret_major = result;
+	}
+	printk(KERN_INFO "Device major %u, minors 0-%u\n", DMGturret_major, turret_count - 1);
 
-	/* Initialize GPIO Settings */
-	result = gpio_request(PAN_SERVO, "PAN_SERVO")
-		|| gpio_request(TILT_SERVO, "TILT_SERVO")
-		|| gpio_request(STEP_MOTOR_DRIVE, "STEP_MOTOR_DRIVE")
-		|| gpio_request(STEP_MOTOR_DIRECTION, "STEP_MOTOR_DIRECTION")
-		|| gpio_request(STEP_MOTOR_ENABLE, "STEP_MOTOR_ENABLE")
-		|| gpio_request(STEP_MOTOR_FEEDBACK, "STEP_MOTOR_FEEDBACK")
-		|| gpio_request(SOLENOID_ENABLE, "SOLENOID_ENABLE")
-                || gpio_direction_output(PAN_SERVO, 0)
-		|| gpio_direction_output(TILT_SERVO, 0)
-		|| gpio_direction_output(STEP_MOTOR_ENABLE, 1) /* Enable is assert low to activate */
-		|| gpio_direction_output(STEP_MOTOR_DIRECTION, 0)
-		|| gpio_direction_input(STEP_MOTOR_FEEDBACK)
-//		|| step_motor_pwm_setup(STEP_MOTOR_DRIVE)
-		|| gpio_direction_output(STEP_MOTOR_DRIVE, 0)
-		|| gpio_direction_output(SOLENOID_ENABLE, 0);
-	if (result != 0)
+	if (!step_profile_valid(step_start_hz, step_rate_hz, step_accel) || prime_steps > MAX_PRIME_STEPS)
 	{
+		printk("Stepper rates must be 0 or %u-%u Hz, reachable in %u ms\n",
+		       MIN_STEP_RATE_HZ, MAX_STEP_RATE_HZ, STEP_RAMP_MAX * STEP_RAMP_TICK_MS);
+		result = -EINVAL;
 		goto fail;
 	}
-	step_motor_state = !(GPIO_OUTPUT_ON(STEP_MOTOR_ENABLE)); /*XXX: Should be taken care of with gpio_direction_output...*/
-	feedback_irq = IRQ_GPIO(STEP_MOTOR_FEEDBACK);
-	if (request_irq(feedback_irq, &turret_prime_stop, SA_INTERRUPT | SA_TRIGGER_RISING, DEV_NAME, NULL) != 0) {
-		printk("Feedback irq not acquired \n");
+	if (idle_hold_frames > MAX_IDLE_HOLD_FRAMES)
+	{
+		printk("idle_hold_frames must be at most %u\n", MAX_IDLE_HOLD_FRAMES);
+		result = -EINVAL;
 		goto fail;
 	}
-	else
+	idle_settle_frames = idle_settle_ms / (PWM_PERIOD / 1000) + (idle_settle_ms % (PWM_PERIOD / 1000) != 0);
+	if (!TURRET_TIME_VALID(fire_time_us) || !TURRET_TIME_VALID(prime_timeout_us))
 	{
-		printk("Feedback irq %d acquired successfully \n", feedback_irq);
-	}	
-
-	/* Allocate Write Buffer Memory */
-	write_buffer = kmalloc(WRITE_BUFFER_SIZE, GFP_KERNEL);
-	if (!write_buffer)
-	{
-		result = -ENOMEM;
+		printk("Fire and prime times must be %u-%u us\n", MIN_TURRET_TIME_US, MAX_TURRET_TIME_US);
+		result = -EINVAL;
 		goto fail;
 	}
-	memset(write_buffer, 0, WRITE_BUFFER_SIZE);
-	write_len = 0;
 
-	/* Allocate Read Buffer Memory */
-	read_buffer = kmalloc(READ_BUFFER_SIZE, GFP_KERNEL);
-	if (!read_buffer)
+	/* Set up each Turret, and the status page layout they share */
+	BUILD_BUG_ON(sizeof(struct dmg_status) > DMG_TRACE_LOG_OFFSET);
+	BUILD_BUG_ON(DMG_TRACE_LOG_OFFSET + sizeof(struct dmg_trace_log) > PAGE_SIZE);
+	BUILD_BUG_ON(DMG_MAX_TURRETS * 2 > PWM_MAX_CHANNELS);
+	BUILD_BUG_ON(DMG_AIM_STEPS != PULSE_COUNT);
+	pwm_channel_count = 0;
+	for (i = 0; i < turret_count; i++)
 	{
-		result = -ENOMEM;
-		goto fail;
+		result = turret_setup(&turrets[i], i);
+		if (result != 0)
+		{
+			goto fail;
+		}
 	}
-	memset(read_buffer, 0, READ_BUFFER_SIZE);
-	read_len = 0;
-
-	/* Center the servos */
-	pan_servo_pulse = PAN_PULSE_LENGTH(DEFAULT_PULSE_INDEX);
-	tilt_servo_pulse = TILT_PULSE_LENGTH(DEFAULT_PULSE_INDEX);
+	pwm_build_edges(&pwm_lists[0]);
+	pwm_active = 0;
+	pwm_next_edge = 0;
 
-	/* Initialize OS Timer for Pulse Width Modulation */
-	if (request_irq(IRQ_OST_4_11, &handle_ost, 0, DEV_NAME, NULL) != 0) {
+	/* Initialize OS Timer 4 for every turret's Pulse Width Modulation. Their own timers share the IRQ. */
+	if (request_irq(IRQ_OST_4_11, &handle_ost, SA_SHIRQ, DEV_NAME, pwm_lists) != 0) {
 		printk("OST irq not acquired \n");
+		result = -EBUSY;
 		goto fail;
 	}
        	else
 	{
+		pwm_irq_claimed = true;
                 printk("OST irq %d acquired successfully \n", IRQ_OST_4_11);
 
 		OMCR4 = 0xcc;
@@ -419,8 +1964,17 @@ static int DMGturret_init(void)
 		OSCR4 = 0; /* Initialize the counter value (and start the counter) */
 	}
 
-	/* Setup hardware timer */
-	setup_timer(&hardware_timer, hardware_timer_callback, 0); 
+	/* Export ISR timing statistics. The driver works without them. */
+	isr_proc_entry = create_proc_entry(PROC_ISR_NAME, S_IFREG | S_IRUGO | S_IWUSR, NULL);
+	if (isr_proc_entry)
+	{
+		isr_proc_entry->read_proc = isr_stats_read;
+		isr_proc_entry->write_proc = isr_stats_write;
+	}
+	else
+	{
+		printk(KERN_WARNING "Unable to create /proc/" PROC_ISR_NAME "\n");
+	}
 
 	return 0;
 
@@ -429,130 +1983,454 @@ fail:
 	return result;
 }
 
+/* Each minor opens its own turret */
 static int
 DMGturret_open(struct inode *inode, struct file *filp)
 {
+	struct event_reader *reader;
+	unsigned int minor = iminor(inode);
+
+	if (minor >= turret_count)
+		return -ENODEV;
+
+	/* Start with the next event; earlier ones are of no use to a new reader */
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->turret = &turrets[minor];
+	reader->next = turrets[minor].event_head;
+	filp->private_data = reader;
 	return 0;
 }
 
+/*
+ * Read whole struct dmg_event records. Blocks until at least one event is
+ * available unless the file is non-blocking.
+ */
 static ssize_t
 DMGturret_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
 {
-	return 0;
+	struct event_reader *reader = filp->private_data;
+	struct turret *turret = reader->turret;
+	struct dmg_event events[8];
+	unsigned int lost;
+	unsigned long flags;
+	size_t copied = 0;
+	size_t n;
+
+	if (count < sizeof(struct dmg_event))
+		return -EINVAL;
+
+	if (reader->next == turret->event_head)
+	{
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(turret->event_wait, reader->next != turret->event_head))
+			return -ERESTARTSYS;
+	}
+
+	while (copied + sizeof(struct dmg_event) <= count)
+	{
+		local_irq_save(flags);
+		lost = turret->event_head - reader->next;
+		if (lost > EVENT_BUFFER_COUNT)
+		{
+			lost -= EVENT_BUFFER_COUNT;
+			reader->next += lost;
+		}
+		else
+		{
+			lost = 0;
+		}
+		for (n = 0; n < ARRAY_SIZE(events) && reader->next != turret->event_head &&
+		            copied + (n + 1) * sizeof(struct dmg_event) <= count; n++)
+		{
+			events[n] = turret->event_buffer[reader->next & (EVENT_BUFFER_COUNT - 1)];
+			reader->next++;
+		}
+		local_irq_restore(flags);
+
+		if (n == 0)
+			break;
+		events[0].lost = min(lost, 0xffffu);
+		if (copy_to_user(buf + copied, events, n * sizeof(struct dmg_event)))
+			return copied ? copied : -EFAULT;
+		copied += n * sizeof(struct dmg_event);
+	}
+
+	return copied;
+}
+
+static unsigned int
+DMGturret_poll(struct file *filp, poll_table *wait)
+{
+	struct event_reader *reader = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM; /* Writes never block */
+
+	poll_wait(filp, &reader->turret->event_wait, wait);
+	if (reader->next != reader->turret->event_head)
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+static bool
+apply_command(struct turret *turret, char command, uint8_t axis, uint32_t value)
+{
+	const struct turret_config *config = turret->config;
+	bool success = true;
+	unsigned long flags;
+
+	switch (command)
+	{
+	case DMG_CMD_FIRE:
+		if (!turret->solenoid_state && turret->state == TURRET_READY) {
+#ifdef SIM_MODE
+			printk(KERN_INFO "Solenoid Activated...\n");
+#endif
+			turret->solenoid_state = !(GPIO_OUTPUT_OFF(config->solenoid));
+			turret->state = TURRET_FIRING;
+			post_event(turret, DMG_EVENT_STATE, turret->state);
+			/* Last, as a short time can be up before this returns */
+			turret_timer_start(turret, turret->fire_time_us);
+		}
+		break;
+	case DMG_CMD_PRIME:
+		if (turret->state == TURRET_STANDBY) {
+#ifdef SIM_MODE
+			printk(KERN_INFO "Stepper Motor Activated...\n");
+#endif
+			turret->solenoid_state = !(GPIO_OUTPUT_ON(config->solenoid));
+			turret->step_motor_state = !(GPIO_OUTPUT_OFF(config->step_enable));
+			step_motor_start(turret);
+			turret->state = TURRET_PRIMING;
+			post_event(turret, DMG_EVENT_STATE, turret->state);
+			turret_timer_start(turret, turret->prime_timeout_us); /* Added for safety */
+		}
+		break;
+	/* A step past the whole range could wrap around to a width in range */
+	case DMG_CMD_DOWN:
+		success = value <= PULSE_COUNT && step_pulse_width(turret, 't', -(int32_t)value);
+		break;
+	case DMG_CMD_UP:
+		success = value <= PULSE_COUNT && step_pulse_width(turret, 't', value);
+		break;
+	case DMG_CMD_LEFT:
+		success = value <= PULSE_COUNT && step_pulse_width(turret, 'p', value);
+		break;
+	case DMG_CMD_RIGHT:
+		success = value <= PULSE_COUNT && step_pulse_width(turret, 'p', -(int32_t)value);
+		break;
+	case DMG_CMD_AIM:
+		if (axis != 0 || value > 0xffff ||
+		    (value >> 8) > PULSE_COUNT || (value & 0xff) > PULSE_COUNT)
+		{
+			success = false;
+			break;
+		}
+		/* Drop the queued targets. Both widths are in range and an empty queue never fills. */
+		local_irq_save(flags);
+		turret->pan_trajectory.tail = turret->pan_trajectory.head;
+		turret->tilt_trajectory.tail = turret->tilt_trajectory.head;
+		set_pulse_width(turret, PAN_PULSE_LENGTH(value >> 8), 'p', false);
+		set_pulse_width(turret, TILT_PULSE_LENGTH(value & 0xff), 't', false);
+		local_irq_restore(flags);
+		break;
+	case DMG_CMD_MOVE_TO:
+		if (axis == DMG_AXIS_PAN)
+			success = set_pulse_width(turret, value, 'p', true);
+		else if (axis == DMG_AXIS_TILT)
+			success = set_pulse_width(turret, value, 't', true);
+		else
+			success = false;
+		break;
+	case DMG_CMD_SET_VELOCITY:
+	case DMG_CMD_SET_ACCEL:
+		if (axis == 0 || (axis & ~(DMG_AXIS_PAN | DMG_AXIS_TILT)) || value > PWM_PERIOD)
+		{
+			success = false;
+			break;
+		}
+		local_irq_save(flags);
+		if (axis & DMG_AXIS_PAN)
+		{
+			if (command == DMG_CMD_SET_VELOCITY)
+				turret->pan_trajectory.max_velocity = value;
+			else
+				turret->pan_trajectory.max_accel = value;
+		}
+		if (axis & DMG_AXIS_TILT)
+		{
+			if (command == DMG_CMD_SET_VELOCITY)
+				turret->tilt_trajectory.max_velocity = value;
+			else
+				turret->tilt_trajectory.max_accel = value;
+		}
+		local_irq_restore(flags);
+		break;
+	case DMG_CMD_SET_STEP_RATE:
+		success = axis == 0 && step_motor_set_rate(turret, value) == 0;
+		break;
+	case DMG_CMD_RUN:
+		success = axis == 0 && value == 0 && program_run(turret);
+		break;
+	case DMG_CMD_ABORT:
+		success = axis == 0 && value == 0;
+		if (success && turret->program_running)
+			program_stop(turret, DMG_PROGRAM_ABORTED);
+		break;
+	case DMG_CMD_SET_FIRE_TIME:
+	case DMG_CMD_SET_PRIME_TIMEOUT:
+		if (axis != 0 || !TURRET_TIME_VALID(value))
+		{
+			success = false;
+			break;
+		}
+		if (command == DMG_CMD_SET_FIRE_TIME)
+			turret->fire_time_us = value;
+		else
+			turret->prime_timeout_us = value;
+		break;
+	default:
+		success = false;
+		break;
+	}
+
+	if (success)
+	{
+		turret->commands_applied++;
+	}
+	else
+	{
+		turret->commands_rejected++;
+		post_event(turret, DMG_EVENT_REJECTED, command);
+	}
+	publish_status(turret);
+
+	return success;
 }
 
+/*
+ * Apply an array of struct dmg_command in order, stopping at the first one
+ * that fails. Returns the size of the commands that were applied. A
+ * PROGRAM and the steps it loads count as one command.
+ */
 static ssize_t
-DMGturret_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+write_binary_commands(struct turret *turret, const char *buf, size_t count)
 {
+	char *write_buffer = turret->write_buffer;
+	const struct dmg_command *cmd;
+	size_t applied = 0;
+	size_t chunk;
+	size_t i;
+	bool traced = false;
+	uint32_t rx_us = 0;
+	uint32_t write_us = 0;
+	size_t program_at = 0; /* Where the PROGRAM being loaded starts */
+	unsigned int program_steps = 0; /* Steps it has yet to load */
+	unsigned int staged = 0;
+
+	if (count % sizeof(struct dmg_command) != 0)
+		return -EINVAL;
+
+	while (applied < count)
+	{
+		chunk = min(count - applied,
+		            (size_t)(WRITE_BUFFER_SIZE / sizeof(struct dmg_command)) * sizeof(struct dmg_command));
+		if (copy_from_user(write_buffer, buf + applied, chunk))
+		{
+			if (program_steps)
+				applied = program_at;
+			return applied ? applied : -EFAULT;
+		}
+
+		for (i = 0; i < chunk; i += sizeof(struct dmg_command))
+		{
+			cmd = (const struct dmg_command *)(write_buffer + i);
+			if (cmd->version != DMG_COMMAND_VERSION || cmd->reserved != 0 ||
+			    (!program_steps && cmd->type == DMG_CMD_PROGRAM &&
+			     (cmd->axis != 0 || cmd->value == 0 || cmd->value > DMG_PROGRAM_MAX_STEPS)))
+			{
+				if (program_steps)
+					applied = program_at;
+				turret->commands_rejected++;
+				post_event(turret, DMG_EVENT_REJECTED, cmd->type);
+				publish_status(turret);
+				return applied ? applied : -EINVAL;
+			}
+			if (program_steps)
+			{
+				turret->program_staging[staged++] = *cmd;
+				applied += sizeof(struct dmg_command);
+				if (--program_steps)
+					continue;
+				if (!program_load(turret, turret->program_staging, staged))
+				{
+					turret->commands_rejected++;
+					post_event(turret, DMG_EVENT_REJECTED, DMG_CMD_PROGRAM);
+					publish_status(turret);
+					return program_at ? program_at : -EINVAL;
+				}
+				turret->commands_applied++;
+				publish_status(turret);
+				continue;
+			}
+			if (cmd->type == DMG_CMD_PROGRAM)
+			{
+				/* The steps that follow are loaded, not applied */
+				traced = false;
+				program_at = applied;
+				program_steps = cmd->value;
+				staged = 0;
+				applied += sizeof(struct dmg_command);
+				continue;
+			}
+			if (cmd->type == DMG_CMD_TRACE)
+			{
+				/* Applies to the next command */
+				traced = true;
+				rx_us = cmd->value;
+				if (!write_us)
+					write_us = trace_now_us();
+				applied += sizeof(struct dmg_command);
+				continue;
+			}
+			if (!apply_command(turret, cmd->type, cmd->axis, cmd->value))
+			{
+				return applied ? applied : -EINVAL;
+			}
+			if (traced)
+			{
+				trace_command(turret, cmd->type, rx_us, write_us);
+				traced = false;
+			}
+			applied += sizeof(struct dmg_command);
+		}
+	}
+
+	if (program_steps)
+	{
+		/* The write ended partway through the program */
+		turret->commands_rejected++;
+		post_event(turret, DMG_EVENT_REJECTED, DMG_CMD_PROGRAM);
+		publish_status(turret);
+		return program_at ? program_at : -EINVAL;
+	}
+	return applied;
+}
+
+/* Apply a legacy ASCII record: a command letter followed by a decimal value */
+static ssize_t
+write_ascii_command(struct turret *turret, const char *buf, size_t count)
+{
+	char *write_buffer = turret->write_buffer;
 	uint32_t value; /* First argument for any command */
-	bool success = true;
-	if (count > WRITE_BUFFER_SIZE)
-		count = WRITE_BUFFER_SIZE;
+
+	if (count > WRITE_BUFFER_SIZE - 1)
+		count = WRITE_BUFFER_SIZE - 1;
 	if (copy_from_user(write_buffer, buf, count))
 		return -EINVAL;
-	if (count - 1 != 2)
+	write_buffer[count] = '\0';
+	if (count < 2)
 		return -EINVAL;
 	if (write_buffer[0] == 'L' || write_buffer[0] == 'R' ||
 	    write_buffer[0] == 'U' || write_buffer[0] == 'D' ||
-	    write_buffer[0] == 'F' || write_buffer[0] == 'P')
+	    write_buffer[0] == 'F' || write_buffer[0] == 'P' ||
+	    write_buffer[0] == DMG_CMD_AIM)
 	{
 		if (!parse_uint(write_buffer + 1, &value))
 		{
 			return -EINVAL;
 		}
 
-		switch (write_buffer[0])
-		{
-		case 'F':
-			if (!solenoid_state && current_turret_state == TURRET_READY) {
-#ifdef SIM_MODE
-				printk(KERN_INFO "Solenoid Activated...\n");			
-#endif
-				solenoid_state = !(GPIO_OUTPUT_OFF(SOLENOID_ENABLE));
-				mod_timer(&hardware_timer, jiffies + msecs_to_jiffies(2000));
-				current_turret_state = TURRET_FIRING;
-				success = true;
-			}
-			break;
-		case 'P':
-			if (current_turret_state == TURRET_STANDBY) {
-#ifdef SIM_MODE
-				printk(KERN_INFO "Stepper Motor Activated...\n");
-#endif
-				solenoid_state = !(GPIO_OUTPUT_ON(SOLENOID_ENABLE));
-				step_motor_state = !(GPIO_OUTPUT_OFF(STEP_MOTOR_ENABLE));
-				mod_timer(&hardware_timer, jiffies + msecs_to_jiffies(PRIME_TIME_MS)); /* Added for safety */
-				current_turret_state = TURRET_PRIMING;
-				success = true;
-			}
-			break;
-		case 'D':
-			success = set_pulse_width(tilt_servo_pulse - value * TILT_PULSE_GRANULARITY, 't');
-			break;
-		case 'U':
-			success = set_pulse_width(tilt_servo_pulse + value * TILT_PULSE_GRANULARITY, 't');
-			break;
-		case 'L':
-			success = set_pulse_width(pan_servo_pulse + value * PAN_PULSE_GRANULARITY, 'p');
-			break;
-		case 'R':
-			success = set_pulse_width(pan_servo_pulse - value * PAN_PULSE_GRANULARITY, 'p');
-			break;
-		}
-		if (!success)
+		if (!apply_command(turret, write_buffer[0], 0, value))
 		{
 			return -EINVAL;
 		}
 	}
 	return count;
 }
+
+static ssize_t
+DMGturret_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+{
+	struct event_reader *reader = filp->private_data;
+	struct turret *turret = reader->turret;
+	ssize_t result;
+	char command;
+
+	if (count == 0)
+		return 0;
+	if (get_user(command, buf))
+		return -EFAULT;
+
+	/* copy_from_user can sleep, so keep other writers out of the buffers until applied */
+	if (mutex_lock_interruptible(&turret->write_lock))
+		return -ERESTARTSYS;
+	if ((unsigned char)command == DMG_COMMAND_VERSION)
+		result = write_binary_commands(turret, buf, count);
+	else
+		result = write_ascii_command(turret, buf, count);
+	mutex_unlock(&turret->write_lock);
+	return result;
+}
+/*
+ * Map the status page read-only. Readers should copy it with
+ * dmg_status_read from DMGturret.h.
+ */
+static int
+DMGturret_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct event_reader *reader = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	/* Don't let mprotect make it writable later */
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(reader->turret->status_page) >> PAGE_SHIFT,
+	                       size, vma->vm_page_prot);
+}
+
 static int
 DMGturret_release(struct inode *inode, struct file *filp)
 {
+	kfree(filp->private_data);
 	return 0;
 }
 
 static void
 DMGturret_exit(void)
 {
+	unsigned int i;
+
 	/* Free Major Number */
 	unregister_chrdev(DMGturret_major, DEV_NAME);
 
-	/* Free Read Buffer Memory */
-	if (read_buffer)
+	/* Remove ISR timing statistics */
+	if (isr_proc_entry)
 	{
-		kfree(read_buffer);
+		remove_proc_entry(PROC_ISR_NAME, NULL);
+		isr_proc_entry = NULL;
 	}
-	
-	/* Free Write Buffer Memory */
-	if (write_buffer)
+
+	/* Stop the servo PWM before the turrets it drives go */
+	OIER &= ~OIER_E4;
+	if (pwm_irq_claimed)
 	{
-		kfree(write_buffer);
+		free_irq(IRQ_OST_4_11, pwm_lists);
+		pwm_irq_claimed = false;
+	}
+	tasklet_kill(&pwm_tasklet);
+	pwm_channel_count = 0;
+
+	for (i = 0; i < DMG_MAX_TURRETS; i++)
+	{
+		turret_teardown(&turrets[i]);
 	}
-	
-	/* Turn Off & Release GPIO */
-	GPIO_OUTPUT_OFF(PAN_SERVO);
-	GPIO_OUTPUT_OFF(TILT_SERVO);
-//	step_motor_release(STEP_MOTOR_DRIVE);
-	GPIO_OUTPUT_OFF(STEP_MOTOR_DRIVE);
-	GPIO_OUTPUT_OFF(STEP_MOTOR_DIRECTION);
-	GPIO_OUTPUT_OFF(STEP_MOTOR_ENABLE);
-	GPIO_OUTPUT_OFF(SOLENOID_ENABLE);
-	free_irq(IRQ_GPIO(STEP_MOTOR_FEEDBACK), NULL);
-	gpio_free(PAN_SERVO);
-	gpio_free(TILT_SERVO);
-	gpio_free(STEP_MOTOR_DRIVE);
-	gpio_free(STEP_MOTOR_DIRECTION);
-	gpio_free(STEP_MOTOR_ENABLE);
-	gpio_free(STEP_MOTOR_FEEDBACK);
-	gpio_free(SOLENOID_ENABLE);
-
-	/* Release OS Timer */
-	OIER &= ~OIER_E4;
-	free_irq(IRQ_OST_4_11, NULL);
-	
-	/* Release hardware timer */
-	del_timer(&hardware_timer);
 
 	printk(KERN_INFO "...module removed!\n");
 }
@@ -0,0 +1,219 @@
+/*
+ * Userspace interface to the DMGturret device (/dev/motor_control).
+ *
+ * Each minor of the device drives its own turret, up to DMG_MAX_TURRETS as
+ * loaded with the module's turrets parameter. Everything below applies to
+ * the turret of the minor the device was opened with.
+ *
+ * The device accepts two write formats:
+ *  - Legacy ASCII: one record per write, e.g. "L16\n".
+ *  - Binary: an array of struct dmg_command. Commands are applied in order
+ *    until one fails. The write returns the number of bytes belonging to
+ *    commands that were applied, so applied = ret / sizeof(struct dmg_command).
+ *    If the first command fails, the write returns -EINVAL.
+ *
+ * The device can also be mapped read-only with mmap to watch a struct
+ * dmg_status that the module keeps up to date, and the struct dmg_trace_log
+ * of commands sent with DMG_CMD_TRACE.
+ *
+ * Reads return whole struct dmg_event records, starting with the first event
+ * after the device was opened. Reads block until an event arrives unless the
+ * device is opened with O_NONBLOCK, and poll/select report POLLIN when one
+ * is waiting.
+ */
+#ifndef DMGTURRET_H
+#define DMGTURRET_H
+#include <linux/types.h>
+
+/* Minors 0 to DMG_MAX_TURRETS - 1 */
+#define DMG_MAX_TURRETS 2
+
+/* First byte of every binary command. Never a printable ASCII command. */
+#define DMG_COMMAND_VERSION (0x81)
+
+/*
+ * Command types. These match the legacy ASCII command letters. U, D, L and R
+ * step the target up to DMG_AIM_STEPS grid steps, stopping at the end of the
+ * axis' range.
+ */
+#define DMG_CMD_FIRE 'F'
+#define DMG_CMD_PRIME 'P'
+#define DMG_CMD_UP 'U'
+#define DMG_CMD_DOWN 'D'
+#define DMG_CMD_LEFT 'L'
+#define DMG_CMD_RIGHT 'R'
+
+/*
+ * Binary-only motion commands. Servos move toward their targets at up to
+ * the axis' velocity limit, changing speed by up to its acceleration limit,
+ * one step per 20 ms PWM frame.
+ */
+#define DMG_CMD_MOVE_TO 'M' /* Queue a target pulse width in us for one axis */
+#define DMG_CMD_SET_VELOCITY 'V' /* us per frame, 0 to jump straight to targets */
+#define DMG_CMD_SET_ACCEL 'A' /* us per frame per frame, 0 for no limit */
+
+/*
+ * Aim both servos at once. value is (pan << 8) | tilt, each a position from
+ * 0 to DMG_AIM_STEPS on the grid relative moves step along, dropping every
+ * target the axes had queued. Applies to both axes or neither.
+ */
+#define DMG_CMD_AIM 'G'
+#define DMG_AIM_STEPS 10
+
+/*
+ * Priming stepper cruise rate in Hz, generated by hardware PWM. The stepper
+ * ramps up to it from the module's start rate. 0 steps once per PWM frame
+ * from the timer interrupt instead. The module rejects rates the PWM cannot
+ * produce (roughly 200 Hz to 20 kHz) or cannot ramp to in time.
+ */
+#define DMG_CMD_SET_STEP_RATE 'S'
+
+/*
+ * Firing and priming times in us, timed by an OS timer match rather than the
+ * jiffies clock. FIRE holds the solenoid for the fire time; PRIME gives up
+ * waiting for the feedback switch after the prime timeout. Changes apply
+ * from the next FIRE or PRIME. The module rejects times under 100 us or
+ * over 60 s.
+ */
+#define DMG_CMD_SET_FIRE_TIME 'W'
+#define DMG_CMD_SET_PRIME_TIMEOUT 'Q'
+
+/*
+ * Trace the next command in the same write. value is when the command was
+ * received, in CLOCK_MONOTONIC microseconds (truncated to 32 bits). The
+ * module adds when it was written and when it took effect, and logs a
+ * struct dmg_trace.
+ */
+#define DMG_CMD_TRACE 'T'
+
+/*
+ * Sequence programs. PROGRAM loads the value commands that follow it in the
+ * same write as a program, 1 to DMG_PROGRAM_MAX_STEPS of them, instead of
+ * applying them. RUN starts the program and ABORT stops it at any time.
+ * Programs run on their own OS timer, so waits are exact to the
+ * microsecond and do not drift, and need no writes while they run.
+ *
+ * Steps may be U D L R M G V A F P and the program-only steps below. The
+ * module rejects a program with a loop that waits less than 1 ms per pass,
+ * and stops a running program at the first step it rejects. PROGRAM and
+ * RUN are rejected while a program is running.
+ */
+#define DMG_CMD_PROGRAM 'N'
+#define DMG_CMD_RUN 'X'
+#define DMG_CMD_ABORT 'Z'
+#define DMG_PROGRAM_MAX_STEPS 64
+
+/* Program-only steps */
+#define DMG_CMD_WAIT 'Y' /* value us after the last wait or hold ended, or RUN; up to 60 s */
+#define DMG_CMD_HOLD 'H' /* Wait for the turret to reach the DMG_TURRET_* state in value */
+#define DMG_CMD_LOOP 'J' /* Run steps axis up to here value times in all, 0 for forever */
+
+/* Axis bits. MOVE_TO takes exactly one; the limits may take both. */
+#define DMG_AXIS_PAN (1 << 0)
+#define DMG_AXIS_TILT (1 << 1)
+
+struct dmg_command
+{
+	__u8 version; /* DMG_COMMAND_VERSION */
+	__u8 type; /* One of DMG_CMD_* */
+	__u8 axis; /* DMG_AXIS_* for motion commands, otherwise 0 */
+	__u8 reserved; /* Must be 0 */
+	__u32 value; /* Distance in ticks for relative moves, see above otherwise */
+};
+
+/* Turret firing states */
+#define DMG_TURRET_STANDBY 0
+#define DMG_TURRET_PRIMING 1
+#define DMG_TURRET_READY 2
+#define DMG_TURRET_FIRING 3
+
+/*
+ * Live turret state at offset 0 of the page mapped from the device.
+ * generation is odd while the module is updating the page; use
+ * dmg_status_read to get a consistent copy.
+ */
+struct dmg_status
+{
+	__u32 generation;
+	__u32 turret_state; /* DMG_TURRET_* */
+	__u32 pan_pulse; /* Current pulse widths in us */
+	__u32 tilt_pulse;
+	__u8 solenoid_state;
+	__u8 step_motor_state;
+	__u8 servos_idle; /* Servo pulses stopped or thinned out after settling */
+	__u8 program_running;
+	__u32 commands_applied;
+	__u32 commands_rejected;
+	__u32 pwm_frames;
+};
+
+/* Event types */
+#define DMG_EVENT_STATE 1 /* detail: the new DMG_TURRET_* state */
+#define DMG_EVENT_REJECTED 2 /* detail: the rejected command type */
+#define DMG_EVENT_FEEDBACK 3 /* The priming feedback switch closed */
+#define DMG_EVENT_PROGRAM 4 /* detail: how the program ended, DMG_PROGRAM_* */
+
+#define DMG_PROGRAM_DONE 0
+#define DMG_PROGRAM_ABORTED 1
+#define DMG_PROGRAM_FAILED 2 /* The module rejected a step */
+
+struct dmg_event
+{
+	__u8 type; /* DMG_EVENT_* */
+	__u8 detail;
+	__u16 lost; /* Events this reader missed before this one by falling behind */
+	__u32 time_ms; /* Kernel clock in ms when the event happened, wraps */
+};
+
+/*
+ * Command latency trace. All times are CLOCK_MONOTONIC microseconds
+ * truncated to 32 bits, so subtract them as __u32.
+ */
+struct dmg_trace
+{
+	__u8 type; /* The traced DMG_CMD_* */
+	__u8 reserved[3];
+	__u32 rx_us; /* Received by the server */
+	__u32 write_us; /* Written to the device */
+	__u32 frame_us; /* The PWM frame that first applied it started, or applied for F/P */
+};
+
+/*
+ * Ring of the latest traces, at DMG_TRACE_LOG_OFFSET in the mapped page.
+ * head counts every trace logged; the newest is traces[(head - 1) %
+ * DMG_TRACE_COUNT]. A trace copied while head moved by DMG_TRACE_COUNT or
+ * more may have been overwritten.
+ */
+#define DMG_TRACE_LOG_OFFSET 256
+#define DMG_TRACE_COUNT 128
+struct dmg_trace_log
+{
+	__u32 head;
+	__u32 dropped; /* Traces lost because too many awaited the same frame */
+	struct dmg_trace traces[DMG_TRACE_COUNT];
+};
+
+#ifndef __KERNEL__
+/*
+ * Copy the mapped status page without tearing. The PXA270 is single core,
+ * so only the compiler has to be kept from reordering the loads.
+ */
+static inline void
+dmg_status_read(const volatile struct dmg_status* page, struct dmg_status* status)
+{
+	__u32 generation;
+
+	do
+	{
+		while ((generation = page->generation) & 1)
+		{
+			/* Update in progress */
+		}
+		__asm__ __volatile__("" ::: "memory");
+		*status = *(const struct dmg_status*)page;
+		__asm__ __volatile__("" ::: "memory");
+	} while (page->generation != generation);
+}
+#endif
+
+#endif /* DMGTURRET_H */
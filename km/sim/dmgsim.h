@@ -0,0 +1,62 @@
+/*
+ * Host simulation of the DMGturret module. DMGturret.c is built unchanged
+ * against mock kernel headers (sim/include) and a mock PXA270, and runs on
+ * a virtual clock that only moves in dmgsim_advance. OS timer matches,
+ * kernel timers and GPIO interrupts fire at their exact virtual times, and
+ * the module's code takes no virtual time to run.
+ */
+#ifndef DMGSIM_H
+#define DMGSIM_H
+#include <stddef.h>
+
+/* Called for every GPIO output level change */
+typedef void (*dmgsim_edge_handler)(unsigned long long time_us, unsigned int gpio, int level, void *arg);
+
+/* Run the module's init and exit functions. dmgsim_load returns its result. */
+int dmgsim_load(void);
+void dmgsim_unload(void);
+
+/* Set a module parameter before dmgsim_load. Returns -1 if there is none. */
+int dmgsim_set_param(const char *name, unsigned int value);
+
+/* Virtual time in microseconds since dmgsim_load */
+unsigned long long dmgsim_now_us(void);
+
+/* Move virtual time forward, firing every interrupt and timer due on the way */
+void dmgsim_advance(unsigned long long us);
+
+void dmgsim_set_edge_handler(dmgsim_edge_handler handler, void *arg);
+void dmgsim_set_quiet(int quiet); /* Drop printk output */
+
+/* Drive a GPIO input, firing its interrupt on a matching edge */
+void dmgsim_set_gpio_input(unsigned int gpio, int level);
+int dmgsim_gpio_level(unsigned int gpio);
+
+/* Output rate of PWM 0 or 1 in Hz, or 0 while it is stopped */
+unsigned long dmgsim_pwm_rate_hz(unsigned int pwm);
+
+/*
+ * Claim a GPIO as another driver would, so the module's request for it
+ * fails, or release it again. The counts cover the module's claims too;
+ * dmgsim_bad_releases counts frees of GPIOs and IRQs that were not claimed.
+ */
+void dmgsim_claim_gpio(unsigned int gpio, int claimed);
+unsigned int dmgsim_gpios_claimed(void);
+unsigned int dmgsim_irqs_claimed(void);
+unsigned int dmgsim_bad_releases(void);
+
+/*
+ * The device's file operations. dmgsim_open opens a minor and returns a
+ * handle for the others, or a negative errno. Reads never block.
+ */
+int dmgsim_open(unsigned int minor);
+void dmgsim_close(int handle);
+long dmgsim_write(int handle, const void *buf, size_t count);
+long dmgsim_read(int handle, void *buf, size_t count);
+unsigned int dmgsim_poll(int handle);
+const volatile void *dmgsim_mmap(int handle);
+
+/* Read a /proc file the module created, or -1 if there is none */
+int dmgsim_proc_read(const char *name, char *buf, int size);
+
+#endif /* DMGSIM_H */
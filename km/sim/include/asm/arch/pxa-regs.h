@@ -0,0 +1,53 @@
+/*
+ * Mock PXA270 registers. Writes land in plain variables that sim/kernel.c
+ * applies once the module code that made them returns.
+ */
+#ifndef SIM_ASM_ARCH_PXA_REGS_H
+#define SIM_ASM_ARCH_PXA_REGS_H
+#include <linux/types.h>
+
+/*
+ * OS timers. Channels 4 and up count in 1 us ticks and reset on match,
+ * stopping there unless OMCR sets the periodic bit. OSSR is write-1-to-clear,
+ * so each access gets a word of its own.
+ */
+volatile u32 *dmgsim_ossr(void);
+#define OSSR (*dmgsim_ossr())
+extern volatile u32 OIER;
+extern volatile u32 OSCR4, OSMR4, OMCR4;
+extern volatile u32 OSCR5, OSMR5, OMCR5;
+extern volatile u32 OSCR6, OSMR6, OMCR6;
+extern volatile u32 OSCR7, OSMR7, OMCR7;
+extern volatile u32 OSCR8, OSMR8, OMCR8;
+extern volatile u32 OSCR9, OSMR9, OMCR9;
+extern volatile u32 OSCR10, OSMR10, OMCR10;
+extern volatile u32 OSCR11, OSMR11, OMCR11;
+#define OIER_E0 (1 << 0)
+#define OIER_E1 (1 << 1)
+#define OIER_E2 (1 << 2)
+#define OIER_E3 (1 << 3)
+
+/* GPIO set and clear registers, one per bank of 32 */
+extern volatile u32 GPSR0, GPSR1, GPSR2, GPSR3;
+extern volatile u32 GPCR0, GPCR1, GPCR2, GPCR3;
+#define GPSR(x) (*((x) < 96 ? ((x) < 64 ? ((x) < 32 ? &GPSR0 : &GPSR1) : &GPSR2) : &GPSR3))
+#define GPCR(x) (*((x) < 96 ? ((x) < 64 ? ((x) < 32 ? &GPCR0 : &GPCR1) : &GPCR2) : &GPCR3))
+#define GPIO_bit(x) (1u << ((x) & 0x1f))
+#define GPIO_OUT 0x080
+#define GPIO_ALT_FN_2_OUT 0x280
+#define GPIO16_PWM0 16
+#define GPIO17_PWM1 17
+#define GPIO16_PWM0_MD (16 | GPIO_ALT_FN_2_OUT)
+#define GPIO17_PWM1_MD (17 | GPIO_ALT_FN_2_OUT)
+
+/* PWM, clocked at 13 MHz */
+extern volatile u32 CKEN;
+extern volatile u32 PWM_CTRL0, PWM_PERVAL0, PWM_PWDUTY0;
+extern volatile u32 PWM_CTRL1, PWM_PERVAL1, PWM_PWDUTY1;
+#define CKEN0_PWM0 (1 << 0)
+#define CKEN1_PWM1 (1 << 1)
+
+#define IRQ_OST_4_11 7
+#define IRQ_GPIO(x) (64 + (x))
+
+#endif /* SIM_ASM_ARCH_PXA_REGS_H */
@@ -0,0 +1,12 @@
+#ifndef SIM_ASM_GPIO_H
+#define SIM_ASM_GPIO_H
+
+int gpio_request(unsigned gpio, const char *label);
+void gpio_free(unsigned gpio);
+int gpio_direction_input(unsigned gpio);
+int gpio_direction_output(unsigned gpio, int value);
+void pxa_gpio_set_value(unsigned gpio, int value);
+int pxa_gpio_get_value(unsigned gpio);
+int pxa_gpio_mode(int gpio_mode);
+
+#endif /* SIM_ASM_GPIO_H */
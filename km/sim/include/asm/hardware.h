@@ -0,0 +1,4 @@
+#ifndef SIM_ASM_HARDWARE_H
+#define SIM_ASM_HARDWARE_H
+
+#endif /* SIM_ASM_HARDWARE_H */
@@ -0,0 +1,11 @@
+#ifndef SIM_ASM_UACCESS_H
+#define SIM_ASM_UACCESS_H
+#include <linux/types.h>
+
+/* User and kernel memory are the same in the simulation */
+unsigned long copy_from_user(void *to, const void *from, unsigned long n);
+unsigned long copy_to_user(void *to, const void *from, unsigned long n);
+#define get_user(x, ptr) ((x) = *(ptr), 0)
+#define put_user(x, ptr) (*(ptr) = (x), 0)
+
+#endif /* SIM_ASM_UACCESS_H */
@@ -0,0 +1,23 @@
+#ifndef SIM_LINUX_BITOPS_H
+#define SIM_LINUX_BITOPS_H
+
+static inline int fls(int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+/* Interrupts never preempt the simulated module, so these need not be atomic */
+static inline void set_bit(int nr, volatile unsigned long *addr)
+{
+	*addr |= 1ul << nr;
+}
+
+static inline int test_and_clear_bit(int nr, volatile unsigned long *addr)
+{
+	int was = (*addr >> nr) & 1;
+
+	*addr &= ~(1ul << nr);
+	return was;
+}
+
+#endif /* SIM_LINUX_BITOPS_H */
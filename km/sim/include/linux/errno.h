@@ -0,0 +1,17 @@
+#ifndef SIM_LINUX_ERRNO_H
+#define SIM_LINUX_ERRNO_H
+
+#define EPERM 1
+#define EINTR 4
+#define EIO 5
+#define EAGAIN 11
+#define ENOMEM 12
+#define EACCES 13
+#define EFAULT 14
+#define EBUSY 16
+#define ENODEV 19
+#define EINVAL 22
+#define ENOSPC 28
+#define ERESTARTSYS 512
+
+#endif /* SIM_LINUX_ERRNO_H */
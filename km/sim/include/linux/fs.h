@@ -0,0 +1,40 @@
+#ifndef SIM_LINUX_FS_H
+#define SIM_LINUX_FS_H
+#include <linux/types.h>
+
+#define O_NONBLOCK 04000
+
+struct inode {
+	unsigned int i_rdev;
+};
+
+struct file {
+	unsigned int f_flags;
+	loff_t f_pos;
+	void *private_data;
+};
+
+struct poll_table_struct;
+struct vm_area_struct;
+struct file_operations {
+	ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char *, size_t, loff_t *);
+	unsigned int (*poll)(struct file *, struct poll_table_struct *);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+};
+
+#define MINORBITS 20
+#define MINOR(dev) ((unsigned int)((dev) & ((1U << MINORBITS) - 1)))
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+#define MKDEV(ma, mi) (((ma) << MINORBITS) | (mi))
+static inline unsigned iminor(const struct inode *inode)
+{
+	return MINOR(inode->i_rdev);
+}
+
+int register_chrdev(unsigned int major, const char *name, const struct file_operations *fops);
+int unregister_chrdev(unsigned int major, const char *name);
+
+#endif /* SIM_LINUX_FS_H */
@@ -0,0 +1,15 @@
+#ifndef SIM_LINUX_HRTIMER_H
+#define SIM_LINUX_HRTIMER_H
+
+#define USEC_PER_SEC 1000000L
+#define NSEC_PER_USEC 1000L
+
+struct timespec {
+	long tv_sec;
+	long tv_nsec;
+};
+
+/* Virtual time since dmgsim_load */
+void ktime_get_ts(struct timespec *ts);
+
+#endif /* SIM_LINUX_HRTIMER_H */
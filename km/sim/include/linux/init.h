@@ -0,0 +1,7 @@
+#ifndef SIM_LINUX_INIT_H
+#define SIM_LINUX_INIT_H
+
+#define __init
+#define __exit
+
+#endif /* SIM_LINUX_INIT_H */
@@ -0,0 +1,34 @@
+#ifndef SIM_LINUX_INTERRUPT_H
+#define SIM_LINUX_INTERRUPT_H
+#include <linux/types.h>
+
+typedef int irqreturn_t;
+#define IRQ_NONE 0
+#define IRQ_HANDLED 1
+
+#define SA_INTERRUPT 0x20000000
+#define SA_SHIRQ 0x04000000
+#define SA_TRIGGER_FALLING 0x1
+#define SA_TRIGGER_RISING 0x2
+
+int request_irq(unsigned int irq, irqreturn_t (*handler)(int, void *), unsigned long flags,
+                const char *name, void *dev_id);
+void free_irq(unsigned int irq, void *dev_id);
+
+/* Interrupts never preempt the simulated module */
+#define local_irq_save(flags) ((flags) = 0)
+#define local_irq_restore(flags) ((void)(flags))
+
+/* Scheduled tasklets run once the interrupt that scheduled them returns */
+struct tasklet_struct {
+	struct tasklet_struct *next;
+	bool scheduled;
+	void (*func)(unsigned long);
+	unsigned long data;
+};
+#define DECLARE_TASKLET(name, func, data) struct tasklet_struct name = { NULL, false, func, data }
+void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long), unsigned long data);
+void tasklet_schedule(struct tasklet_struct *t);
+void tasklet_kill(struct tasklet_struct *t);
+
+#endif /* SIM_LINUX_INTERRUPT_H */
@@ -0,0 +1,43 @@
+/*
+ * Mock kernel headers for building DMGturret.c as a host program. Only
+ * what the module uses is declared; sim/kernel.c implements it against a
+ * virtual clock and a mock PXA270 register set.
+ */
+#ifndef SIM_LINUX_KERNEL_H
+#define SIM_LINUX_KERNEL_H
+#include <stdarg.h>
+#include <linux/types.h>
+
+#define KERN_ALERT "<1>"
+#define KERN_ERR "<3>"
+#define KERN_WARNING "<4>"
+#define KERN_INFO "<6>"
+#define KERN_DEBUG "<7>"
+
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int sprintf(char *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int snprintf(char *buf, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+long simple_strtol(const char *cp, char **endp, unsigned int base);
+unsigned long int_sqrt(unsigned long x);
+
+void *memset(void *s, int c, size_t n);
+void *memcpy(void *dest, const void *src, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+size_t strlen(const char *s);
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y) ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+#define abs(x) ({ int __x = (x); (__x < 0) ? -__x : __x; })
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2 * !!(condition)]))
+#define do_div(n, base) ({ uint32_t __rem = (n) % (base); (n) /= (base); __rem; })
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_wmb() barrier()
+#define smp_rmb() barrier()
+#define smp_mb() barrier()
+
+#endif /* SIM_LINUX_KERNEL_H */
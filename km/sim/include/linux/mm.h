@@ -0,0 +1,32 @@
+#ifndef SIM_LINUX_MM_H
+#define SIM_LINUX_MM_H
+#include <linux/types.h>
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+#define VM_WRITE 0x00000002
+#define VM_MAYWRITE 0x00000020
+#define VM_IO 0x00004000
+#define VM_RESERVED 0x00080000
+
+typedef struct { unsigned long pgprot; } pgprot_t;
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_flags;
+	unsigned long vm_pgoff;
+	pgprot_t vm_page_prot;
+};
+
+struct page;
+unsigned long get_zeroed_page(gfp_t flags);
+void free_page(unsigned long addr);
+struct page *virt_to_page(const void *addr);
+unsigned long virt_to_phys(const volatile void *addr);
+#define SetPageReserved(page) ((void)(page))
+#define ClearPageReserved(page) ((void)(page))
+int remap_pfn_range(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn,
+                    unsigned long size, pgprot_t prot);
+
+#endif /* SIM_LINUX_MM_H */
@@ -0,0 +1,26 @@
+#ifndef SIM_LINUX_MODULE_H
+#define SIM_LINUX_MODULE_H
+#include <linux/kernel.h>
+
+/* The module's init and exit functions, called by dmgsim_load/unload */
+#define module_init(fn) int init_module(void) __attribute__((alias(#fn)));
+#define module_exit(fn) void cleanup_module(void) __attribute__((alias(#fn)));
+#define MODULE_LICENSE(license)
+#define MODULE_PARM_DESC(name, desc)
+
+/*
+ * Parameters are all unsigned ints here. Each is listed in the __param
+ * section for dmgsim_set_param to find by name.
+ */
+struct kernel_param {
+	const char *name;
+	unsigned int *value;
+};
+#define module_param_named(name, value, type, perm) \
+	static const struct kernel_param __param_##name \
+	__attribute__((used, section("__param"), aligned(sizeof(void *)))) = { #name, &(value) }
+#define module_param(name, type, perm) module_param_named(name, name, type, perm)
+#define THIS_MODULE ((struct module *)0)
+struct module;
+
+#endif /* SIM_LINUX_MODULE_H */
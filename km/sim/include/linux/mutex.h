@@ -0,0 +1,11 @@
+#ifndef SIM_LINUX_MUTEX_H
+#define SIM_LINUX_MUTEX_H
+#include <linux/errno.h>
+
+/* Nothing sleeps in the simulation; taking a held mutex fails instead */
+struct mutex { int locked; };
+#define mutex_init(lock) ((lock)->locked = 0)
+#define mutex_lock_interruptible(lock) ((lock)->locked ? -ERESTARTSYS : ((lock)->locked = 1, 0))
+#define mutex_unlock(lock) ((lock)->locked = 0)
+
+#endif /* SIM_LINUX_MUTEX_H */
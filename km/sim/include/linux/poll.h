@@ -0,0 +1,14 @@
+#ifndef SIM_LINUX_POLL_H
+#define SIM_LINUX_POLL_H
+#include <linux/fs.h>
+#include <linux/wait.h>
+
+#define POLLIN 0x0001
+#define POLLOUT 0x0004
+#define POLLRDNORM 0x0040
+#define POLLWRNORM 0x0100
+
+typedef struct poll_table_struct poll_table;
+#define poll_wait(filp, wq, table) ((void)(filp), (void)(wq), (void)(table))
+
+#endif /* SIM_LINUX_POLL_H */
@@ -0,0 +1,22 @@
+#ifndef SIM_LINUX_PROC_FS_H
+#define SIM_LINUX_PROC_FS_H
+#include <linux/fs.h>
+
+#define S_IFREG 0100000
+#define S_IRUGO 0444
+#define S_IWUSR 0200
+
+typedef int (read_proc_t)(char *page, char **start, off_t off, int count, int *eof, void *data);
+typedef int (write_proc_t)(struct file *file, const char *buffer, unsigned long count, void *data);
+struct proc_dir_entry {
+	const char *name;
+	read_proc_t *read_proc;
+	write_proc_t *write_proc;
+	void *data;
+	struct module *owner;
+};
+
+struct proc_dir_entry *create_proc_entry(const char *name, mode_t mode, struct proc_dir_entry *parent);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+
+#endif /* SIM_LINUX_PROC_FS_H */
@@ -0,0 +1,5 @@
+#ifndef SIM_LINUX_SCHED_H
+#define SIM_LINUX_SCHED_H
+#include <linux/wait.h>
+
+#endif /* SIM_LINUX_SCHED_H */
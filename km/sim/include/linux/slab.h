@@ -0,0 +1,11 @@
+#ifndef SIM_LINUX_SLAB_H
+#define SIM_LINUX_SLAB_H
+#include <linux/types.h>
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+
+void *kmalloc(size_t size, gfp_t flags);
+void kfree(const void *p);
+
+#endif /* SIM_LINUX_SLAB_H */
@@ -0,0 +1,22 @@
+#ifndef SIM_LINUX_TIMER_H
+#define SIM_LINUX_TIMER_H
+#include <linux/types.h>
+
+#define HZ 100
+
+extern volatile unsigned long jiffies;
+
+struct timer_list {
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+	bool pending;
+};
+
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data);
+int mod_timer(struct timer_list *timer, unsigned long expires);
+int del_timer(struct timer_list *timer);
+unsigned long msecs_to_jiffies(unsigned int m);
+unsigned int jiffies_to_msecs(unsigned long j);
+
+#endif /* SIM_LINUX_TIMER_H */
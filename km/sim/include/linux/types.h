@@ -0,0 +1,27 @@
+#ifndef SIM_LINUX_TYPES_H
+#define SIM_LINUX_TYPES_H
+#include <stddef.h>
+
+typedef __UINT8_TYPE__ uint8_t;
+typedef __UINT16_TYPE__ uint16_t;
+typedef __UINT32_TYPE__ uint32_t;
+typedef __UINT64_TYPE__ uint64_t;
+typedef __INT8_TYPE__ int8_t;
+typedef __INT16_TYPE__ int16_t;
+typedef __INT32_TYPE__ int32_t;
+typedef __INT64_TYPE__ int64_t;
+typedef uint8_t u8, __u8;
+typedef uint16_t u16, __u16;
+typedef uint32_t u32, __u32;
+typedef uint64_t u64, __u64;
+typedef int32_t s32, __s32;
+typedef long ssize_t;
+typedef long long loff_t;
+typedef long off_t;
+typedef unsigned short mode_t;
+typedef unsigned int gfp_t;
+typedef _Bool bool;
+#define true 1
+#define false 0
+
+#endif /* SIM_LINUX_TYPES_H */
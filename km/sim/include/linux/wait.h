@@ -0,0 +1,12 @@
+#ifndef SIM_LINUX_WAIT_H
+#define SIM_LINUX_WAIT_H
+#include <linux/errno.h>
+
+/* Nothing sleeps in the simulation; a read that would block fails instead */
+typedef struct { int unused; } wait_queue_head_t;
+#define DECLARE_WAIT_QUEUE_HEAD(name) wait_queue_head_t name = { 0 }
+#define init_waitqueue_head(wq) ((wq)->unused = 0)
+#define wake_up_interruptible(wq) ((void)(wq))
+#define wait_event_interruptible(wq, condition) ((void)(wq), (condition) ? 0 : -ERESTARTSYS)
+
+#endif /* SIM_LINUX_WAIT_H */
@@ -0,0 +1,911 @@
+/*
+ * The kernel and PXA270 underneath the simulated DMGturret module.
+ *
+ * Register writes are plain stores, so their side effects are applied each
+ * time module code returns: OSCR writes restart the counter, GPSR/GPCR
+ * writes change GPIO levels. OSSR writes take effect at the module's next
+ * OSSR access. As on the PXA270, OS timers match whether or not their
+ * interrupt is enabled, and the shared IRQ stays raised while any enabled
+ * match is left in OSSR.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/timer.h>
+#include <linux/interrupt.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/proc_fs.h>
+#include <linux/hrtimer.h>
+#include <asm/uaccess.h>
+#include <asm/gpio.h>
+#include <asm/arch/pxa-regs.h>
+#include "dmgsim.h"
+
+/* From the host C library; the mock headers stand in for its own */
+void *malloc(size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void free(void *p);
+void abort(void);
+int strcmp(const char *a, const char *b);
+int vdprintf(int fd, const char *fmt, va_list ap);
+
+int init_module(void);
+void cleanup_module(void);
+
+/* The linker bounds the module's parameter list */
+extern const struct kernel_param __start___param[], __stop___param[];
+
+#define MAX_IRQ_HANDLERS 16
+#define MAX_TIMERS 8
+#define MAX_PROC_ENTRIES 4
+#define MAX_FILES 8
+#define GPIO_BANKS 4
+#define OST_CHANNELS 8 /* 4 to 11 */
+#define OST_FIRST_CHANNEL 4
+#define OST_MASK (((1u << OST_CHANNELS) - 1) << OST_FIRST_CHANNEL)
+#define OSSR_UNTOUCHED 0xfu /* Channels 0-3 are the kernel's, so the module never clears them */
+#define OMCR_PERIODIC 0x40
+#define OST_STOPPED (~0u) /* What a stopped counter reads as, so a write of 0 shows */
+#define MAX_IRQ_REPEATS 1000
+#define US_PER_JIFFY (1000000 / HZ)
+#define PWM_CLOCK_HZ 13000000ul
+
+volatile u32 OIER;
+volatile u32 OSCR4, OSMR4, OMCR4;
+volatile u32 OSCR5, OSMR5, OMCR5;
+volatile u32 OSCR6, OSMR6, OMCR6;
+volatile u32 OSCR7, OSMR7, OMCR7;
+volatile u32 OSCR8, OSMR8, OMCR8;
+volatile u32 OSCR9, OSMR9, OMCR9;
+volatile u32 OSCR10, OSMR10, OMCR10;
+volatile u32 OSCR11, OSMR11, OMCR11;
+volatile u32 GPSR0, GPSR1, GPSR2, GPSR3;
+volatile u32 GPCR0, GPCR1, GPCR2, GPCR3;
+volatile u32 CKEN;
+volatile u32 PWM_CTRL0, PWM_PERVAL0, PWM_PWDUTY0;
+volatile u32 PWM_CTRL1, PWM_PERVAL1, PWM_PWDUTY1;
+volatile unsigned long jiffies;
+
+static volatile u32 *const oscr[OST_CHANNELS] = {
+	&OSCR4, &OSCR5, &OSCR6, &OSCR7, &OSCR8, &OSCR9, &OSCR10, &OSCR11
+};
+static volatile u32 *const osmr[OST_CHANNELS] = {
+	&OSMR4, &OSMR5, &OSMR6, &OSMR7, &OSMR8, &OSMR9, &OSMR10, &OSMR11
+};
+static volatile u32 *const omcr[OST_CHANNELS] = {
+	&OMCR4, &OMCR5, &OMCR6, &OMCR7, &OMCR8, &OMCR9, &OMCR10, &OMCR11
+};
+static volatile u32 *const gpsr[GPIO_BANKS] = { &GPSR0, &GPSR1, &GPSR2, &GPSR3 };
+static volatile u32 *const gpcr[GPIO_BANKS] = { &GPCR0, &GPCR1, &GPCR2, &GPCR3 };
+
+static u64 now_us;
+static u64 ost_base[OST_CHANNELS]; /* When each counter was last 0 */
+static u32 ost_exposed[OST_CHANNELS]; /* What OSCRn held when the module was entered */
+static bool ost_stopped[OST_CHANNELS];
+static u32 ost_status; /* OSSR */
+static volatile u32 ossr_word; /* Handed out by the module's last OSSR access */
+static u32 gpio_levels[GPIO_BANKS];
+static u32 gpio_claimed[GPIO_BANKS]; /* By gpio_request or dmgsim_claim_gpio */
+static unsigned int bad_releases; /* Frees of GPIOs and IRQs that were not claimed */
+static dmgsim_edge_handler edge_handler;
+static void *edge_handler_arg;
+static bool quiet;
+
+struct irq_handler {
+	unsigned int irq;
+	irqreturn_t (*handler)(int, void *);
+	unsigned long flags;
+	void *dev_id;
+};
+static struct irq_handler irq_handlers[MAX_IRQ_HANDLERS];
+static unsigned int irq_handler_count;
+
+static struct timer_list *timers[MAX_TIMERS];
+static struct tasklet_struct *tasklets;
+static struct proc_dir_entry proc_entries[MAX_PROC_ENTRIES];
+static const struct file_operations *device_fops;
+static unsigned int device_major;
+static struct file files[MAX_FILES];
+static unsigned int file_minor[MAX_FILES];
+static bool file_open[MAX_FILES];
+static void *mapped_page;
+
+/* Let the module read each OS timer counter */
+static void
+enter_module(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < OST_CHANNELS; i++)
+	{
+		ost_exposed[i] = ost_stopped[i] ? OST_STOPPED : (u32)(now_us - ost_base[i]);
+		*oscr[i] = ost_exposed[i];
+	}
+	ossr_word = ost_status | OSSR_UNTOUCHED;
+}
+
+/* Clear the OSSR bits the module wrote to the word it was last handed */
+static void
+apply_ossr_write(void)
+{
+	if (!(ossr_word & OSSR_UNTOUCHED))
+		ost_status &= ~ossr_word;
+	ossr_word = ost_status | OSSR_UNTOUCHED;
+}
+
+volatile u32 *
+dmgsim_ossr(void)
+{
+	apply_ossr_write();
+	return &ossr_word;
+}
+
+static void
+set_gpio_level(unsigned int gpio, int level)
+{
+	u32 *bank = &gpio_levels[gpio >> 5];
+	u32 bit = GPIO_bit(gpio);
+
+	if (!(*bank & bit) == !level)
+		return;
+	if (level)
+		*bank |= bit;
+	else
+		*bank &= ~bit;
+	if (edge_handler)
+		edge_handler(now_us, gpio, level, edge_handler_arg);
+}
+
+/* Apply the register writes the module made, then run its tasklets */
+static void
+leave_module(void)
+{
+	struct tasklet_struct *t;
+	unsigned int bank;
+	unsigned int bit;
+	unsigned int i;
+
+	for (i = 0; i < OST_CHANNELS; i++)
+	{
+		if (*oscr[i] != ost_exposed[i])
+		{
+			ost_base[i] = now_us - *oscr[i];
+			ost_stopped[i] = false;
+		}
+	}
+	apply_ossr_write();
+
+	for (bank = 0; bank < GPIO_BANKS; bank++)
+	{
+		if (!*gpsr[bank] && !*gpcr[bank])
+			continue;
+		for (bit = 0; bit < 32; bit++)
+		{
+			if (*gpsr[bank] & (1u << bit))
+				set_gpio_level(bank * 32 + bit, 1);
+			if (*gpcr[bank] & (1u << bit))
+				set_gpio_level(bank * 32 + bit, 0);
+		}
+		*gpsr[bank] = 0;
+		*gpcr[bank] = 0;
+	}
+
+	while ((t = tasklets) != NULL)
+	{
+		tasklets = t->next;
+		t->scheduled = false;
+		enter_module();
+		t->func(t->data);
+		leave_module();
+	}
+}
+
+/* Run every handler sharing the IRQ, as the kernel does */
+static void
+dispatch_irq(unsigned int irq)
+{
+	unsigned int i;
+
+	enter_module();
+	for (i = 0; i < irq_handler_count; i++)
+	{
+		if (irq_handlers[i].irq == irq)
+			irq_handlers[i].handler(irq, irq_handlers[i].dev_id);
+	}
+	leave_module();
+}
+
+/* When OS timer channel i next matches, or 0 if it is stopped */
+static u64
+ost_next_match(unsigned int i)
+{
+	u64 match;
+
+	if (ost_stopped[i])
+		return 0;
+	match = ost_base[i] + *osmr[i];
+	if (match <= now_us)
+		match += 1ull << 32; /* Missed it; wait for the counter to wrap */
+	return match;
+}
+
+static u64
+timer_expiry_us(const struct timer_list *timer)
+{
+	u64 expiry = (u64)timer->expires * US_PER_JIFFY;
+	return (expiry < now_us) ? now_us : expiry;
+}
+
+void
+dmgsim_advance(unsigned long long us)
+{
+	u64 end = now_us + us;
+	u64 next;
+	u64 match;
+	u32 matched;
+	int timer;
+	struct timer_list *t;
+	unsigned int repeats = 0;
+	unsigned int i;
+
+	for (;;)
+	{
+		/* The IRQ stays raised until the handlers clear every enabled match */
+		if (ost_status & OIER & OST_MASK)
+		{
+			if (++repeats > MAX_IRQ_REPEATS)
+			{
+				quiet = false;
+				printk(KERN_ERR "OS timer interrupt never cleared: OSSR %#x OIER %#x\n",
+				       ost_status, OIER);
+				abort();
+			}
+			dispatch_irq(IRQ_OST_4_11);
+			continue;
+		}
+		repeats = 0;
+
+		next = end;
+		matched = 0;
+		timer = -1;
+		for (i = 0; i < OST_CHANNELS; i++)
+		{
+			match = ost_next_match(i);
+			if (!match || match > next)
+				continue;
+			if (match < next)
+				matched = 0;
+			next = match;
+			matched |= 1u << (OST_FIRST_CHANNEL + i);
+		}
+		for (i = 0; i < MAX_TIMERS; i++)
+		{
+			if (timers[i] && timer_expiry_us(timers[i]) < next)
+			{
+				next = timer_expiry_us(timers[i]);
+				matched = 0;
+				timer = i;
+			}
+		}
+
+		now_us = next;
+		jiffies = now_us / US_PER_JIFFY;
+		if (timer >= 0)
+		{
+			t = timers[timer];
+			timers[timer] = NULL;
+			t->pending = false;
+			enter_module();
+			t->function(t->data);
+			leave_module();
+		}
+		else if (matched)
+		{
+			/* Each matching counter resets to 0, and stops there unless periodic */
+			for (i = 0; i < OST_CHANNELS; i++)
+			{
+				if (!(matched & (1u << (OST_FIRST_CHANNEL + i))))
+					continue;
+				ost_base[i] = now_us;
+				ost_stopped[i] = !(*omcr[i] & OMCR_PERIODIC);
+			}
+			ost_status |= matched;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+int
+dmgsim_load(void)
+{
+	int result;
+
+	enter_module();
+	result = init_module();
+	leave_module();
+	return result;
+}
+
+void
+dmgsim_unload(void)
+{
+	enter_module();
+	cleanup_module();
+	leave_module();
+}
+
+int
+dmgsim_set_param(const char *name, unsigned int value)
+{
+	const struct kernel_param *param;
+
+	for (param = __start___param; param < __stop___param; param++)
+	{
+		if (strcmp(param->name, name) == 0)
+		{
+			*param->value = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+unsigned long long
+dmgsim_now_us(void)
+{
+	return now_us;
+}
+
+void
+dmgsim_set_edge_handler(dmgsim_edge_handler handler, void *arg)
+{
+	edge_handler = handler;
+	edge_handler_arg = arg;
+}
+
+void
+dmgsim_set_quiet(int q)
+{
+	quiet = q;
+}
+
+void
+dmgsim_set_gpio_input(unsigned int gpio, int level)
+{
+	bool was = gpio_levels[gpio >> 5] & GPIO_bit(gpio);
+	unsigned int i;
+
+	set_gpio_level(gpio, level);
+	if (was == !!level)
+		return;
+	for (i = 0; i < irq_handler_count; i++)
+	{
+		if (irq_handlers[i].irq == IRQ_GPIO(gpio) &&
+		    (irq_handlers[i].flags & (level ? SA_TRIGGER_RISING : SA_TRIGGER_FALLING)))
+		{
+			dispatch_irq(IRQ_GPIO(gpio));
+			break;
+		}
+	}
+}
+
+int
+dmgsim_gpio_level(unsigned int gpio)
+{
+	return !!(gpio_levels[gpio >> 5] & GPIO_bit(gpio));
+}
+
+unsigned long
+dmgsim_pwm_rate_hz(unsigned int pwm)
+{
+	u32 ctrl = pwm ? PWM_CTRL1 : PWM_CTRL0;
+	u32 perval = pwm ? PWM_PERVAL1 : PWM_PERVAL0;
+	u32 duty = pwm ? PWM_PWDUTY1 : PWM_PWDUTY0;
+
+	if (!(CKEN & (pwm ? CKEN1_PWM1 : CKEN0_PWM0)) || !duty)
+		return 0;
+	return PWM_CLOCK_HZ / (((ctrl & 0x3f) + 1) * ((perval & 0x3ff) + 1));
+}
+
+void
+dmgsim_claim_gpio(unsigned int gpio, int claimed)
+{
+	if (claimed)
+		gpio_claimed[gpio >> 5] |= GPIO_bit(gpio);
+	else
+		gpio_claimed[gpio >> 5] &= ~GPIO_bit(gpio);
+}
+
+unsigned int
+dmgsim_gpios_claimed(void)
+{
+	unsigned int count = 0;
+	unsigned int bank;
+
+	for (bank = 0; bank < GPIO_BANKS; bank++)
+		count += __builtin_popcount(gpio_claimed[bank]);
+	return count;
+}
+
+unsigned int
+dmgsim_irqs_claimed(void)
+{
+	return irq_handler_count;
+}
+
+unsigned int
+dmgsim_bad_releases(void)
+{
+	return bad_releases;
+}
+
+int
+dmgsim_open(unsigned int minor)
+{
+	struct inode inode = { .i_rdev = MKDEV(device_major, minor) };
+	int handle;
+	int result;
+
+	for (handle = 0; handle < MAX_FILES && file_open[handle]; handle++)
+	{
+		/* Find a free slot */
+	}
+	if (!device_fops || handle == MAX_FILES)
+		return -ENODEV;
+
+	memset(&files[handle], 0, sizeof(files[handle]));
+	files[handle].f_flags = O_NONBLOCK;
+	enter_module();
+	result = device_fops->open(&inode, &files[handle]);
+	leave_module();
+	if (result < 0)
+		return result;
+	file_open[handle] = true;
+	file_minor[handle] = minor;
+	return handle;
+}
+
+void
+dmgsim_close(int handle)
+{
+	struct inode inode = { .i_rdev = MKDEV(device_major, file_minor[handle]) };
+
+	enter_module();
+	device_fops->release(&inode, &files[handle]);
+	leave_module();
+	file_open[handle] = false;
+}
+
+long
+dmgsim_write(int handle, const void *buf, size_t count)
+{
+	long result;
+
+	enter_module();
+	result = device_fops->write(&files[handle], buf, count, &files[handle].f_pos);
+	leave_module();
+	return result;
+}
+
+long
+dmgsim_read(int handle, void *buf, size_t count)
+{
+	long result;
+
+	enter_module();
+	result = device_fops->read(&files[handle], buf, count, &files[handle].f_pos);
+	leave_module();
+	return result;
+}
+
+unsigned int
+dmgsim_poll(int handle)
+{
+	unsigned int result;
+
+	enter_module();
+	result = device_fops->poll(&files[handle], NULL);
+	leave_module();
+	return result;
+}
+
+const volatile void *
+dmgsim_mmap(int handle)
+{
+	struct vm_area_struct vma = {
+		.vm_start = 0,
+		.vm_end = PAGE_SIZE,
+		.vm_flags = 0,
+	};
+	int result;
+
+	mapped_page = NULL;
+	enter_module();
+	result = device_fops->mmap(&files[handle], &vma);
+	leave_module();
+	return result == 0 ? mapped_page : NULL;
+}
+
+int
+dmgsim_proc_read(const char *name, char *buf, int size)
+{
+	char *start = NULL;
+	int eof = 0;
+	unsigned int i;
+	int result;
+
+	for (i = 0; i < MAX_PROC_ENTRIES; i++)
+	{
+		if (proc_entries[i].name && strcmp(proc_entries[i].name, name) == 0)
+		{
+			enter_module();
+			result = proc_entries[i].read_proc(buf, &start, 0, size, &eof, proc_entries[i].data);
+			leave_module();
+			return result;
+		}
+	}
+	return -1;
+}
+
+/* Kernel API */
+
+int
+printk(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (quiet)
+		return 0;
+	/* Drop the log level */
+	if (fmt[0] == '<' && fmt[1] && fmt[2] == '>')
+		fmt += 3;
+	va_start(ap, fmt);
+	len = vdprintf(2, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+long
+simple_strtol(const char *cp, char **endp, unsigned int base)
+{
+	long value = 0;
+	bool negative = false;
+
+	if (*cp == '-')
+	{
+		negative = true;
+		cp++;
+	}
+	while (*cp >= '0' && *cp <= '9')
+		value = value * base + (*cp++ - '0');
+	if (endp)
+		*endp = (char *)cp;
+	return negative ? -value : value;
+}
+
+unsigned long
+int_sqrt(unsigned long x)
+{
+	unsigned long root = 0;
+	unsigned long bit = 1ul << (sizeof(long) * 8 - 2);
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit)
+	{
+		if (x >= root + bit)
+		{
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+void *
+kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+void
+kfree(const void *p)
+{
+	free((void *)p);
+}
+
+unsigned long
+get_zeroed_page(gfp_t flags)
+{
+	void *page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+	if (page)
+		memset(page, 0, PAGE_SIZE);
+	return (unsigned long)page;
+}
+
+void
+free_page(unsigned long addr)
+{
+	free((void *)addr);
+}
+
+struct page *
+virt_to_page(const void *addr)
+{
+	return (struct page *)addr;
+}
+
+unsigned long
+virt_to_phys(const volatile void *addr)
+{
+	return (unsigned long)addr;
+}
+
+int
+remap_pfn_range(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn,
+                unsigned long size, pgprot_t prot)
+{
+	mapped_page = (void *)(pfn << PAGE_SHIFT);
+	return 0;
+}
+
+unsigned long
+copy_from_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+unsigned long
+copy_to_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* Picks the first major the kernel would pick, when asked to */
+int
+register_chrdev(unsigned int major, const char *name, const struct file_operations *fops)
+{
+	device_fops = fops;
+	device_major = major ? major : 254;
+	return major ? 0 : device_major;
+}
+
+int
+unregister_chrdev(unsigned int major, const char *name)
+{
+	device_fops = NULL;
+	return 0;
+}
+
+struct proc_dir_entry *
+create_proc_entry(const char *name, mode_t mode, struct proc_dir_entry *parent)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_PROC_ENTRIES; i++)
+	{
+		if (!proc_entries[i].name)
+		{
+			memset(&proc_entries[i], 0, sizeof(proc_entries[i]));
+			proc_entries[i].name = name;
+			return &proc_entries[i];
+		}
+	}
+	return NULL;
+}
+
+void
+remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_PROC_ENTRIES; i++)
+	{
+		if (proc_entries[i].name && strcmp(proc_entries[i].name, name) == 0)
+			proc_entries[i].name = NULL;
+	}
+}
+
+int
+request_irq(unsigned int irq, irqreturn_t (*handler)(int, void *), unsigned long flags,
+            const char *name, void *dev_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < irq_handler_count; i++)
+	{
+		if (irq_handlers[i].irq == irq && !(irq_handlers[i].flags & flags & SA_SHIRQ))
+			return -EBUSY;
+	}
+	if (irq_handler_count == MAX_IRQ_HANDLERS)
+		return -ENOMEM;
+
+	irq_handlers[irq_handler_count].irq = irq;
+	irq_handlers[irq_handler_count].handler = handler;
+	irq_handlers[irq_handler_count].flags = flags;
+	irq_handlers[irq_handler_count].dev_id = dev_id;
+	irq_handler_count++;
+	return 0;
+}
+
+void
+free_irq(unsigned int irq, void *dev_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < irq_handler_count; i++)
+	{
+		if (irq_handlers[i].irq == irq && irq_handlers[i].dev_id == dev_id)
+		{
+			irq_handlers[i] = irq_handlers[--irq_handler_count];
+			return;
+		}
+	}
+	bad_releases++;
+}
+
+void
+tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long), unsigned long data)
+{
+	t->next = NULL;
+	t->scheduled = false;
+	t->func = func;
+	t->data = data;
+}
+
+void
+tasklet_schedule(struct tasklet_struct *t)
+{
+	struct tasklet_struct **tail = &tasklets;
+
+	if (t->scheduled)
+		return;
+	while (*tail)
+		tail = &(*tail)->next;
+	t->next = NULL;
+	t->scheduled = true;
+	*tail = t;
+}
+
+void
+tasklet_kill(struct tasklet_struct *t)
+{
+	struct tasklet_struct **p;
+
+	for (p = &tasklets; *p; p = &(*p)->next)
+	{
+		if (*p == t)
+		{
+			*p = t->next;
+			break;
+		}
+	}
+	t->scheduled = false;
+}
+
+void
+setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data)
+{
+	timer->function = function;
+	timer->data = data;
+	timer->pending = false;
+}
+
+int
+mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	int was_pending = timer->pending;
+	unsigned int i;
+
+	timer->expires = expires;
+	if (!was_pending)
+	{
+		for (i = 0; i < MAX_TIMERS && timers[i]; i++)
+		{
+			/* Find a free slot */
+		}
+		if (i == MAX_TIMERS)
+			return was_pending;
+		timers[i] = timer;
+		timer->pending = true;
+	}
+	return was_pending;
+}
+
+int
+del_timer(struct timer_list *timer)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_TIMERS; i++)
+	{
+		if (timers[i] == timer)
+			timers[i] = NULL;
+	}
+	if (!timer->pending)
+		return 0;
+	timer->pending = false;
+	return 1;
+}
+
+unsigned long
+msecs_to_jiffies(unsigned int m)
+{
+	return (m + (1000 / HZ) - 1) / (1000 / HZ);
+}
+
+unsigned int
+jiffies_to_msecs(unsigned long j)
+{
+	return j * (1000 / HZ);
+}
+
+void
+ktime_get_ts(struct timespec *ts)
+{
+	ts->tv_sec = now_us / USEC_PER_SEC;
+	ts->tv_nsec = (now_us % USEC_PER_SEC) * NSEC_PER_USEC;
+}
+
+int
+gpio_request(unsigned gpio, const char *label)
+{
+	if (gpio_claimed[gpio >> 5] & GPIO_bit(gpio))
+		return -EBUSY;
+	gpio_claimed[gpio >> 5] |= GPIO_bit(gpio);
+	return 0;
+}
+
+void
+gpio_free(unsigned gpio)
+{
+	if (!(gpio_claimed[gpio >> 5] & GPIO_bit(gpio)))
+		bad_releases++;
+	gpio_claimed[gpio >> 5] &= ~GPIO_bit(gpio);
+}
+
+int
+gpio_direction_input(unsigned gpio)
+{
+	return 0;
+}
+
+int
+gpio_direction_output(unsigned gpio, int value)
+{
+	set_gpio_level(gpio, value);
+	return 0;
+}
+
+void
+pxa_gpio_set_value(unsigned gpio, int value)
+{
+	set_gpio_level(gpio, value);
+}
+
+int
+pxa_gpio_get_value(unsigned gpio)
+{
+	return dmgsim_gpio_level(gpio);
+}
+
+int
+pxa_gpio_mode(int gpio_mode)
+{
+	return 0;
+}
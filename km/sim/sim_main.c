@@ -0,0 +1,574 @@
+/*
+ * Run the DMGturret module on a virtual clock and check what it drives:
+ *  - every servo pulse starts exactly one PWM period after the last, or a
+ *    whole number of periods after idling, and is as wide as the status
+ *    page says
+ *  - MOVE_TO reaches its target without exceeding the velocity limit
+ *  - AIM moves both servos to grid positions, or neither
+ *  - priming ramps the stepper PWM and stops at the feedback switch, which
+ *    is debounced
+ *  - firing returns to standby after its timeout
+ *  - fire and prime times set in us end on the exact microsecond
+ *  - sequence programs loop, hold for turret states and wait to the exact
+ *    microsecond, and stop on ABORT
+ *  - a second turret moves, primes and fires on its own pins, PWM and
+ *    timers, with its servos pulsing in the same frames as the first's
+ *  - the pulses stop once the servos settle, and restart within a frame,
+ *    even after idling long enough for the servo PWM counter to wrap
+ *  - a load that fails part way through a turret's setup, and an unload,
+ *    release every pin and interrupt they claimed and nothing else
+ * then keep the servos running for hours of virtual time.
+ */
+#include "DMGturret.h"
+#include "dmgsim.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Must match DMGturret.c */
+#define PWM_PERIOD 20000
+#define PAN_SERVO 29
+#define TILT_SERVO 30
+#define STEP_MOTOR_FEEDBACK 28
+#define PAN_SERVO_1 58 /* Turret 1 */
+#define TILT_SERVO_1 59
+#define STEP_MOTOR_FEEDBACK_1 63
+#define DEFAULT_MAX_VELOCITY 25
+#define DEFAULT_STEP_RATE_HZ 2000
+#define FIRE_TIME_US 2000000
+#define IDLE_SETTLE_MS 2000
+
+#define MS(x) ((x) * 1000ull)
+
+struct servo_watch
+{
+	unsigned int gpio;
+	const char* name;
+	unsigned int turret;
+	int pan;
+	unsigned long long rise_us;
+	unsigned long long pulses;
+	unsigned int last_width;
+	unsigned int max_step; /* Largest width change between frames */
+	int idle; /* The module was idle during the last pulse */
+};
+
+static struct servo_watch servos[] = {
+	{ PAN_SERVO, "pan", 0, 1 },
+	{ TILT_SERVO, "tilt", 0, 0 },
+	{ PAN_SERVO_1, "turret 1 pan", 1, 1 },
+	{ TILT_SERVO_1, "turret 1 tilt", 1, 0 },
+};
+#define SERVO_COUNT (sizeof(servos) / sizeof(servos[0]))
+
+static const volatile struct dmg_status* status_pages[DMG_MAX_TURRETS];
+static unsigned int failures;
+
+#define CHECK(cond, ...) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fputc('\n', stderr); \
+			failures++; \
+		} \
+	} while (0)
+
+static void
+watch_edges(unsigned long long time_us, unsigned int gpio, int level, void* arg)
+{
+	struct dmg_status status;
+	struct servo_watch* servo;
+	unsigned int width;
+	unsigned int pulse;
+	size_t i;
+
+	for (i = 0; i < SERVO_COUNT && servos[i].gpio != gpio; i++)
+	{
+		/* Find the servo */
+	}
+	if (i == SERVO_COUNT)
+	{
+		return;
+	}
+	servo = &servos[i];
+
+	if (level)
+	{
+		CHECK(!servo->pulses || time_us - servo->rise_us == PWM_PERIOD ||
+				(servo->idle && (time_us - servo->rise_us) % PWM_PERIOD == 0),
+				"%s pulse at %lluus started %lluus after the last", servo->name, time_us,
+				time_us - servo->rise_us);
+		servo->rise_us = time_us;
+		return;
+	}
+
+	dmg_status_read(status_pages[servo->turret], &status);
+	width = time_us - servo->rise_us;
+	pulse = servo->pan ? status.pan_pulse : status.tilt_pulse;
+	CHECK(width == pulse, "%s pulse at %lluus was %uus, status says %uus", servo->name,
+			servo->rise_us, width, pulse);
+	if (servo->pulses && abs((int)width - (int)servo->last_width) > (int)servo->max_step)
+	{
+		servo->max_step = abs((int)width - (int)servo->last_width);
+	}
+	servo->last_width = width;
+	servo->idle = status.servos_idle;
+	servo->pulses++;
+}
+
+static void
+send_command(int handle, char type, unsigned char axis, unsigned int value)
+{
+	struct dmg_command cmd = { DMG_COMMAND_VERSION, type, axis, 0, value };
+	CHECK(dmgsim_write(handle, &cmd, sizeof(cmd)) == sizeof(cmd), "command %c was rejected", type);
+}
+
+static unsigned int
+state_of(unsigned int turret)
+{
+	struct dmg_status status;
+	dmg_status_read(status_pages[turret], &status);
+	return status.turret_state;
+}
+
+static unsigned int
+turret_state(void)
+{
+	return state_of(0);
+}
+
+/* Whether the next event is of the given type and detail */
+static int
+next_event_is(int handle, unsigned char type, unsigned char detail)
+{
+	struct dmg_event event;
+	return dmgsim_read(handle, &event, sizeof(event)) == sizeof(event) &&
+		event.type == type && event.detail == detail;
+}
+
+static void
+check_move_to(int handle)
+{
+	struct servo_watch* pan = &servos[0];
+
+	pan->max_step = 0;
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_PAN, 1800);
+	dmgsim_advance(MS(2000));
+	CHECK(pan->last_width == 1800, "pan stopped at %uus instead of 1800us", pan->last_width);
+	CHECK(pan->max_step <= DEFAULT_MAX_VELOCITY, "pan moved %uus in one frame", pan->max_step);
+}
+
+static void
+check_aim(int handle)
+{
+	struct dmg_command cmd = { DMG_COMMAND_VERSION, DMG_CMD_AIM, 0, 0, (DMG_AIM_STEPS + 1) << 8 };
+
+	CHECK(dmgsim_write(handle, &cmd, sizeof(cmd)) < 0, "aimed past the end of the pan range");
+	CHECK(next_event_is(handle, DMG_EVENT_REJECTED, DMG_CMD_AIM), "no REJECTED event");
+	/* 100us steps, so this one would wrap around to 4us */
+	cmd.type = DMG_CMD_LEFT;
+	cmd.value = 42949673;
+	CHECK(dmgsim_write(handle, &cmd, sizeof(cmd)) < 0, "stepped past the end of the pan range");
+	CHECK(next_event_is(handle, DMG_EVENT_REJECTED, DMG_CMD_LEFT), "no REJECTED event");
+	/* A move past the end of the range stops there, as merged joystick moves do */
+	send_command(handle, DMG_CMD_RIGHT, 0, 3);
+	send_command(handle, DMG_CMD_LEFT, 0, 6);
+	dmgsim_advance(MS(2000));
+	CHECK(servos[0].last_width == 2000, "pan stopped at %uus instead of 2000us", servos[0].last_width);
+	send_command(handle, DMG_CMD_AIM, 0, DMG_AIM_STEPS << 8 | 0);
+	dmgsim_advance(MS(2000));
+	CHECK(servos[0].last_width == 2000, "pan aimed at %uus instead of 2000us", servos[0].last_width);
+	CHECK(servos[1].last_width == 1300, "tilt aimed at %uus instead of 1300us", servos[1].last_width);
+
+	/* AIM goes straight there, without stopping at queued targets */
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_PAN, 1000);
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_PAN, 1900);
+	send_command(handle, DMG_CMD_AIM, 0, DMG_AIM_STEPS << 8 | 0);
+	servos[0].max_step = 0;
+	dmgsim_advance(MS(2000));
+	CHECK(servos[0].max_step == 0, "pan moved %uus toward queued targets", servos[0].max_step);
+	CHECK(servos[0].last_width == 2000, "pan aimed at %uus instead of 2000us", servos[0].last_width);
+}
+
+static void
+check_prime(int handle)
+{
+	struct dmg_event event;
+	unsigned long rate;
+
+	send_command(handle, DMG_CMD_PRIME, 0, 0);
+	CHECK(turret_state() == DMG_TURRET_PRIMING, "state %u after prime", turret_state());
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_PRIMING), "no PRIMING event");
+
+	dmgsim_advance(MS(1));
+	rate = dmgsim_pwm_rate_hz(0);
+	CHECK(rate > 0 && rate < DEFAULT_STEP_RATE_HZ, "stepper started at %luHz", rate);
+	dmgsim_advance(MS(500));
+	rate = dmgsim_pwm_rate_hz(0);
+	CHECK(rate * 100 >= DEFAULT_STEP_RATE_HZ * 99 && rate * 100 <= DEFAULT_STEP_RATE_HZ * 101,
+			"stepper cruising at %luHz", rate);
+
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 1);
+	CHECK(turret_state() == DMG_TURRET_READY, "state %u after feedback", turret_state());
+	CHECK(dmgsim_pwm_rate_hz(0) == 0, "stepper still running after feedback");
+	CHECK(next_event_is(handle, DMG_EVENT_FEEDBACK, 0), "no FEEDBACK event");
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_READY), "no READY event");
+
+	/* A bounce is not another closing */
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 0);
+	dmgsim_advance(MS(2));
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 1);
+	CHECK(dmgsim_read(handle, &event, sizeof(event)) <= 0, "FEEDBACK event for a bounce");
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 0);
+
+	/* The ramp timer has stopped, whatever the servo PWM does */
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_TILT, 1450);
+	dmgsim_advance(MS(500));
+	CHECK(dmgsim_pwm_rate_hz(0) == 0, "stepper restarted after feedback");
+}
+
+static void
+check_fire(int handle)
+{
+	send_command(handle, DMG_CMD_FIRE, 0, 0);
+	CHECK(turret_state() == DMG_TURRET_FIRING, "state %u after fire", turret_state());
+	dmgsim_advance(FIRE_TIME_US - MS(20));
+	CHECK(turret_state() == DMG_TURRET_FIRING, "fire ended early");
+	dmgsim_advance(MS(40));
+	CHECK(turret_state() == DMG_TURRET_STANDBY, "state %u after firing", turret_state());
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_FIRING), "no FIRING event");
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_STANDBY), "no STANDBY event");
+}
+
+/* Shorten the fire time and prime timeout and check they end exactly on time */
+static void
+check_timing(int handle)
+{
+	send_command(handle, DMG_CMD_SET_FIRE_TIME, 0, 1500);
+	send_command(handle, DMG_CMD_SET_PRIME_TIMEOUT, 0, 250000);
+
+	send_command(handle, DMG_CMD_PRIME, 0, 0);
+	dmgsim_advance(250000 - 1);
+	CHECK(turret_state() == DMG_TURRET_PRIMING, "prime timed out early");
+	dmgsim_advance(1);
+	CHECK(turret_state() == DMG_TURRET_READY, "state %u after the prime timeout", turret_state());
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_PRIMING), "no PRIMING event");
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_READY), "no READY event");
+
+	send_command(handle, DMG_CMD_FIRE, 0, 0);
+	dmgsim_advance(1500 - 1);
+	CHECK(turret_state() == DMG_TURRET_FIRING, "fire ended early");
+	dmgsim_advance(1);
+	CHECK(turret_state() == DMG_TURRET_STANDBY, "state %u after a 1500us fire", turret_state());
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_FIRING), "no FIRING event");
+	CHECK(next_event_is(handle, DMG_EVENT_STATE, DMG_TURRET_STANDBY), "no STANDBY event");
+}
+
+/* Whether an event of the given type and detail is waiting, skipping others */
+static int
+find_event(int handle, unsigned char type, unsigned char detail)
+{
+	struct dmg_event event;
+	while (dmgsim_read(handle, &event, sizeof(event)) == sizeof(event))
+	{
+		if (event.type == type && event.detail == detail)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static unsigned int
+program_running(void)
+{
+	struct dmg_status status;
+	dmg_status_read(status_pages[0], &status);
+	return status.program_running;
+}
+
+/* Run a prime and fire program twice, then abort it partway */
+static void
+check_program(int handle)
+{
+	static const struct dmg_command load[] = {
+		{ DMG_COMMAND_VERSION, DMG_CMD_PROGRAM, 0, 0, 8 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_MOVE_TO, DMG_AXIS_TILT, 0, 1400 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_WAIT, 0, 0, 100000 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_PRIME, 0, 0, 0 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_HOLD, 0, 0, DMG_TURRET_READY },
+		{ DMG_COMMAND_VERSION, DMG_CMD_WAIT, 0, 0, 5000 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_FIRE, 0, 0, 0 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_HOLD, 0, 0, DMG_TURRET_STANDBY },
+		{ DMG_COMMAND_VERSION, DMG_CMD_LOOP, 1, 0, 2 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_RUN, 0, 0, 0 },
+	};
+	static const struct dmg_command busy_loop[] = {
+		{ DMG_COMMAND_VERSION, DMG_CMD_PROGRAM, 0, 0, 2 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_FIRE, 0, 0, 0 },
+		{ DMG_COMMAND_VERSION, DMG_CMD_LOOP, 0, 0, 0 },
+	};
+	int pass;
+
+	CHECK(dmgsim_write(handle, load, sizeof(load)) == sizeof(load), "program was rejected");
+	CHECK(program_running(), "program not running after RUN");
+	for (pass = 0; pass < 2; pass++)
+	{
+		dmgsim_advance(100000 - 1);
+		CHECK(turret_state() == DMG_TURRET_STANDBY, "pass %d primed early", pass);
+		dmgsim_advance(1);
+		CHECK(turret_state() == DMG_TURRET_PRIMING, "pass %d state %u after its wait", pass,
+				turret_state());
+
+		dmgsim_advance(MS(1));
+		dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 1);
+		dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 0);
+		dmgsim_advance(5000 - 1);
+		CHECK(turret_state() == DMG_TURRET_READY, "pass %d fired early", pass);
+		dmgsim_advance(1);
+		CHECK(turret_state() == DMG_TURRET_FIRING, "pass %d state %u after holding for READY",
+				pass, turret_state());
+		dmgsim_advance(1500);
+		CHECK(turret_state() == DMG_TURRET_STANDBY, "pass %d still firing", pass);
+	}
+	CHECK(!program_running(), "program still running after its last pass");
+	CHECK(find_event(handle, DMG_EVENT_PROGRAM, DMG_PROGRAM_DONE), "no program DONE event");
+	CHECK(servos[1].last_width == 1400, "tilt at %uus instead of 1400us", servos[1].last_width);
+
+	send_command(handle, DMG_CMD_RUN, 0, 0);
+	dmgsim_advance(MS(50));
+	send_command(handle, DMG_CMD_ABORT, 0, 0);
+	CHECK(!program_running(), "program still running after ABORT");
+	dmgsim_advance(MS(100));
+	CHECK(turret_state() == DMG_TURRET_STANDBY, "aborted program primed");
+	CHECK(find_event(handle, DMG_EVENT_PROGRAM, DMG_PROGRAM_ABORTED), "no program ABORTED event");
+
+	CHECK(dmgsim_write(handle, busy_loop, sizeof(busy_loop)) < 0, "loop without a wait was loaded");
+}
+
+/*
+ * Drive turret 1 while turret 0 stands by. Its servos share turret 0's PWM
+ * frames, but everything else is its own.
+ */
+static void
+check_second_turret(int handle, int handle_1)
+{
+	struct servo_watch* pan_1 = &servos[2];
+	unsigned int pan = servos[0].last_width;
+	unsigned long rate;
+
+	send_command(handle_1, DMG_CMD_MOVE_TO, DMG_AXIS_PAN, 1200);
+	dmgsim_advance(MS(2000));
+	CHECK(pan_1->last_width == 1200, "turret 1 pan at %uus instead of 1200us", pan_1->last_width);
+	CHECK(servos[0].last_width == pan, "turret 0 pan moved to %uus", servos[0].last_width);
+	CHECK(pan_1->rise_us == servos[0].rise_us, "turret 1 frame started at %lluus, turret 0's at %lluus",
+			pan_1->rise_us, servos[0].rise_us);
+
+	send_command(handle_1, DMG_CMD_SET_FIRE_TIME, 0, 1000);
+	send_command(handle_1, DMG_CMD_PRIME, 0, 0);
+	CHECK(state_of(1) == DMG_TURRET_PRIMING, "turret 1 state %u after prime", state_of(1));
+	CHECK(turret_state() == DMG_TURRET_STANDBY, "turret 0 state %u after turret 1 primed",
+			turret_state());
+	dmgsim_advance(MS(100));
+	rate = dmgsim_pwm_rate_hz(1);
+	CHECK(rate > 0, "turret 1 stepper not running on PWM1");
+	CHECK(dmgsim_pwm_rate_hz(0) == 0, "turret 0 stepper running");
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 1);
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK, 0);
+	CHECK(state_of(1) == DMG_TURRET_PRIMING, "turret 1 took turret 0's feedback");
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK_1, 1);
+	dmgsim_set_gpio_input(STEP_MOTOR_FEEDBACK_1, 0);
+	CHECK(state_of(1) == DMG_TURRET_READY, "turret 1 state %u after its feedback", state_of(1));
+	CHECK(dmgsim_pwm_rate_hz(1) == 0, "turret 1 stepper still running after feedback");
+
+	send_command(handle_1, DMG_CMD_FIRE, 0, 0);
+	dmgsim_advance(1000 - 1);
+	CHECK(state_of(1) == DMG_TURRET_FIRING, "turret 1 fire ended early");
+	dmgsim_advance(1);
+	CHECK(state_of(1) == DMG_TURRET_STANDBY, "turret 1 state %u after a 1000us fire", state_of(1));
+	CHECK(next_event_is(handle_1, DMG_EVENT_STATE, DMG_TURRET_PRIMING), "no turret 1 PRIMING event");
+	CHECK(find_event(handle_1, DMG_EVENT_STATE, DMG_TURRET_STANDBY), "no turret 1 STANDBY event");
+	CHECK(find_event(handle, DMG_EVENT_FEEDBACK, 0), "no turret 0 FEEDBACK event");
+	CHECK(turret_state() == DMG_TURRET_STANDBY, "turret 0 state %u after turret 1 fired",
+			turret_state());
+}
+
+/* Let the servos settle, check the pulses stop, then wake them */
+static void
+check_idle(int handle)
+{
+	struct dmg_status status;
+	unsigned long long pulses;
+	unsigned long long woken_us;
+
+	dmgsim_advance(MS(IDLE_SETTLE_MS + 100));
+	dmg_status_read(status_pages[0], &status);
+	CHECK(status.servos_idle, "servos still running after settling");
+	pulses = servos[0].pulses;
+	dmgsim_advance(MS(1000));
+	CHECK(servos[0].pulses == pulses, "%llu pulses while idle", servos[0].pulses - pulses);
+
+	woken_us = dmgsim_now_us();
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_TILT, 1500);
+	dmgsim_advance(PWM_PERIOD);
+	CHECK(servos[1].rise_us >= woken_us, "no pulse within a frame of waking");
+	dmg_status_read(status_pages[0], &status);
+	CHECK(!status.servos_idle, "still idle after a command");
+	dmgsim_advance(MS(1000));
+	CHECK(servos[1].last_width == 1500, "tilt stopped at %uus instead of 1500us", servos[1].last_width);
+}
+
+/*
+ * Idle past the wrap of the parked servo PWM counter, whose match then sets
+ * OSSR with its interrupt off, and let the prime timeout raise the shared
+ * IRQ. The servos must stay idle until woken, then pulse as usual.
+ */
+static void
+check_idle_wrap(int handle)
+{
+	unsigned long long pulses;
+
+	dmgsim_advance(MS(IDLE_SETTLE_MS + 100));
+	pulses = servos[1].pulses;
+	dmgsim_advance((1ull << 32) + MS(1000));
+
+	send_command(handle, DMG_CMD_PRIME, 0, 0);
+	dmgsim_advance(MS(1000));
+	CHECK(turret_state() == DMG_TURRET_READY, "state %u after the prime timeout", turret_state());
+	CHECK(servos[1].pulses == pulses, "%llu pulses while idle", servos[1].pulses - pulses);
+	CHECK(!dmgsim_gpio_level(TILT_SERVO), "tilt servo pin left high while idle");
+
+	send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_TILT, 1350);
+	dmgsim_advance(MS(1000));
+	CHECK(servos[1].last_width == 1350, "tilt stopped at %uus instead of 1350us", servos[1].last_width);
+}
+
+/* Run the servos for a long time, moving both back and forth */
+static void
+check_long_run(int handle, unsigned long long seconds)
+{
+	struct timespec start, end;
+	unsigned long long frames = servos[0].pulses;
+	unsigned long long s;
+	double wall;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s = 0; s < seconds && !failures; s++)
+	{
+		send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_PAN, (s & 1) ? 1000 : 2000);
+		send_command(handle, DMG_CMD_MOVE_TO, DMG_AXIS_TILT, (s & 1) ? 1600 : 1300);
+		dmgsim_advance(MS(1000));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	frames = servos[0].pulses - frames;
+	wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	/* The first or last frame may straddle the run */
+	CHECK(llabs((long long)frames - (long long)(s * (1000000 / PWM_PERIOD))) <= 1,
+			"%llu frames in %llus", frames, s);
+	printf("%llu frames in %.2fs (%.0f frames/s, %.0fx real time)\n", frames, wall,
+			frames / wall, s / wall);
+}
+
+/* Hold turret 1's feedback switch pin so its setup fails after turret 0's has finished */
+static void
+check_failed_load(void)
+{
+	dmgsim_claim_gpio(STEP_MOTOR_FEEDBACK_1, 1);
+	CHECK(dmgsim_load() == -EBUSY, "loaded without turret 1's feedback pin");
+	CHECK(dmgsim_gpios_claimed() == 1, "%u GPIOs claimed after a failed load, not just the held one",
+	      dmgsim_gpios_claimed());
+	CHECK(dmgsim_irqs_claimed() == 0, "%u IRQs left claimed after a failed load", dmgsim_irqs_claimed());
+	CHECK(dmgsim_bad_releases() == 0, "%u unclaimed GPIOs or IRQs freed", dmgsim_bad_releases());
+	dmgsim_claim_gpio(STEP_MOTOR_FEEDBACK_1, 0);
+}
+
+static void
+usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-h hours] [-v]\n"
+			"  -h  Virtual hours to keep the servos running for, default 1\n"
+			"  -v  Show the module's printk output\n", name);
+}
+
+int
+main(int argc, char** argv)
+{
+	double hours = 1;
+	int verbose = 0;
+	int handle;
+	int handle_1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:v")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			hours = atof(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	dmgsim_set_quiet(!verbose);
+	if (dmgsim_set_param("turrets", DMG_MAX_TURRETS) != 0)
+	{
+		fprintf(stderr, "Module has no turrets parameter\n");
+		return 1;
+	}
+	check_failed_load();
+	if (dmgsim_load() != 0)
+	{
+		fprintf(stderr, "Module failed to load\n");
+		return 1;
+	}
+	handle = dmgsim_open(0);
+	handle_1 = dmgsim_open(1);
+	if (handle < 0 || !(status_pages[0] = dmgsim_mmap(handle)) ||
+			handle_1 < 0 || !(status_pages[1] = dmgsim_mmap(handle_1)))
+	{
+		fprintf(stderr, "Could not open and map the devices\n");
+		return 1;
+	}
+	CHECK(dmgsim_open(DMG_MAX_TURRETS) < 0, "opened a minor with no turret");
+	dmgsim_set_edge_handler(watch_edges, NULL);
+
+	dmgsim_advance(MS(100));
+	check_move_to(handle);
+	check_aim(handle);
+	check_prime(handle);
+	check_fire(handle);
+	check_timing(handle);
+	check_program(handle);
+	check_second_turret(handle, handle_1);
+	check_idle(handle);
+	check_idle_wrap(handle);
+	check_long_run(handle, hours * 3600);
+
+	dmgsim_set_edge_handler(NULL, NULL);
+	dmgsim_close(handle_1);
+	dmgsim_close(handle);
+	dmgsim_unload();
+	CHECK(dmgsim_gpios_claimed() == 0 && dmgsim_irqs_claimed() == 0,
+	      "%u GPIOs and %u IRQs left claimed after unloading", dmgsim_gpios_claimed(), dmgsim_irqs_claimed());
+	CHECK(dmgsim_bad_releases() == 0, "%u unclaimed GPIOs or IRQs freed", dmgsim_bad_releases());
+
+	if (failures)
+	{
+		fprintf(stderr, "%u check(s) failed\n", failures);
+		return 1;
+	}
+	printf("Simulation checks pass!\n");
+	return 0;
+}
@@ -0,0 +1,574 @@
+/*
+ * Benchmark of the server's command path: a client thread writes bluetooth
+ * messages into one end of a socketpair, the connection loop reads the other
+ * end and hands them to the message handler, and the device thread writes the
+ * commands to a pipe that a sink thread drains in place of the control device.
+ *
+ * Each traffic mix is run twice. Flat out, the client sends everything as
+ * fast as it can, which gives commands/s. Paced, the client waits for each
+ * write's commands to reach the pipe before sending the next, which gives the
+ * latency of a command from the client's write to the device write. Either
+ * way the client reads its acknowledgements as it goes, and waits for the
+ * last message's before hanging up.
+ */
+#include "benchmark.h"
+#include "command.h"
+#include "log.h"
+#include "DMGturret.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#define BENCHMARK_MESSAGES 20000
+#define SINK_READ_COMMANDS 128
+/* How long to wait for a command before deciding it was lost */
+#define ARRIVAL_TIMEOUT_MS 1000
+
+/*
+ * Bluetooth traffic to send. Each write carries min_messages to max_messages
+ * messages. 1 in fire_every messages is a fire or prime and 1 in
+ * invalid_every is invalid; 1 in split_every writes ends part way through a
+ * message. 0 never does.
+ */
+struct TrafficMix
+{
+	const char* name;
+	unsigned int min_messages;
+	unsigned int max_messages;
+	unsigned int fire_every;
+	unsigned int invalid_every;
+	unsigned int split_every;
+};
+
+static const struct TrafficMix mixes[] =
+{
+	/* A joystick sending each move as it happens */
+	{ "joystick", 1, 1, 0, 0, 0 },
+	/* A client batching moves */
+	{ "burst", 16, 16, 0, 0, 0 },
+	/* Uneven batches, firing, bad messages and messages split across reads */
+	{ "mixed", 1, 8, 32, 16, 4 },
+};
+
+/* One mix's traffic, generated before it is timed */
+struct Traffic
+{
+	unsigned char* stream; /* Every message back to back */
+	size_t* write_end; /* Offset in stream where each write ends */
+	size_t write_count;
+	unsigned char* command_types; /* The command each valid message becomes */
+	size_t* command_write; /* The write that completes each command */
+	size_t* commands_by_write; /* Commands completed by the end of each write */
+	size_t command_count;
+};
+
+static int sink_fd = -1;
+static int device_fd = -1;
+static pthread_t sink_thread;
+
+/* Written by the sink thread while a run is in progress */
+static unsigned char* received_types;
+static unsigned long long* arrival_ns;
+static volatile size_t received;
+static sem_t arrived;
+
+static volatile unsigned long allocations;
+
+/*
+ * Count every allocation, including the C library's own, by standing in for
+ * glibc's allocator entry points.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void*
+malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_malloc(size);
+}
+
+void*
+calloc(size_t count, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_calloc(count, size);
+}
+
+void*
+realloc(void* ptr, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_realloc(ptr, size);
+}
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void*
+sink_thread_main(void* arg)
+{
+	struct dmg_command commands[SINK_READ_COMMANDS];
+	unsigned long long now;
+	ssize_t read_count;
+	size_t i;
+
+	while ((read_count = read(sink_fd, commands, sizeof(commands))) > 0)
+	{
+		now = now_ns();
+		/* Device writes are a whole number of commands and atomic */
+		for (i = 0; i < read_count / sizeof(commands[0]) && received < BENCHMARK_MESSAGES; i++)
+		{
+			if (commands[i].type == DMG_CMD_TRACE)
+			{
+				continue;
+			}
+			received_types[received] = commands[i].type;
+			arrival_ns[received] = now;
+			received++;
+		}
+		sem_post(&arrived);
+	}
+	return NULL;
+}
+
+int
+benchmark_device_open(void)
+{
+	int fds[2];
+
+	received_types = malloc(BENCHMARK_MESSAGES);
+	arrival_ns = malloc(BENCHMARK_MESSAGES * sizeof(*arrival_ns));
+	if (!received_types || !arrival_ns || sem_init(&arrived, 0, 0) == -1 || pipe(fds) == -1)
+	{
+		return -1;
+	}
+
+	sink_fd = fds[0];
+	device_fd = fds[1];
+	if (pthread_create(&sink_thread, NULL, sink_thread_main, NULL) != 0)
+	{
+		close(sink_fd);
+		close(device_fd);
+		return -1;
+	}
+	return device_fd;
+}
+
+void
+benchmark_device_close(void)
+{
+	/* The sink sees end of file */
+	close(device_fd);
+	pthread_join(sink_thread, NULL);
+	close(sink_fd);
+	sem_destroy(&arrived);
+	free(received_types);
+	free(arrival_ns);
+}
+
+/* Park-Miller, so every run of a mix sends the same traffic */
+static unsigned int
+next_random(unsigned int* seed)
+{
+	*seed = (unsigned long long)*seed * 48271 % 0x7fffffff;
+	return *seed;
+}
+
+static int
+traffic_init(struct Traffic* traffic, const struct TrafficMix* mix)
+{
+	static const unsigned char moves[] = { 2, 3, 4, 5 };
+	static const unsigned char types[] = { 'F', 'P', 'U', 'D', 'L', 'R', 'G' };
+	size_t stream_size = BENCHMARK_MESSAGES * BLUETOOTH_MESSAGE_SIZE;
+	unsigned int seed = 1;
+	unsigned char* message;
+	size_t messages;
+	size_t offset;
+	size_t w;
+	size_t i;
+
+	memset(traffic, 0, sizeof(*traffic));
+	traffic->stream = malloc(stream_size);
+	/* Every write sends at least one byte */
+	traffic->write_end = malloc(stream_size * sizeof(size_t));
+	traffic->command_types = malloc(BENCHMARK_MESSAGES);
+	traffic->command_write = malloc(BENCHMARK_MESSAGES * sizeof(size_t));
+	traffic->commands_by_write = malloc(stream_size * sizeof(size_t));
+	if (!traffic->stream || !traffic->write_end || !traffic->command_types ||
+	    !traffic->command_write || !traffic->commands_by_write)
+	{
+		return -1;
+	}
+
+	for (offset = 0; offset < stream_size; offset += BLUETOOTH_MESSAGE_SIZE)
+	{
+		message = traffic->stream + offset;
+		if (mix->invalid_every && next_random(&seed) % mix->invalid_every == 0)
+		{
+			message[0] = sizeof(types);
+			message[1] = 0;
+			continue;
+		}
+		if (mix->fire_every && next_random(&seed) % mix->fire_every == 0)
+		{
+			message[0] = next_random(&seed) % 2;
+			message[1] = 0;
+		}
+		else
+		{
+			message[0] = moves[next_random(&seed) % sizeof(moves)];
+			message[1] = 1 + next_random(&seed) % 3;
+		}
+		traffic->command_types[traffic->command_count++] = types[message[0]];
+	}
+
+	for (offset = 0; offset < stream_size; offset = traffic->write_end[traffic->write_count++])
+	{
+		messages = mix->min_messages +
+			next_random(&seed) % (mix->max_messages - mix->min_messages + 1);
+		/* Round down to a message boundary, then maybe stop part way into the last */
+		offset -= offset % BLUETOOTH_MESSAGE_SIZE;
+		offset += messages * BLUETOOTH_MESSAGE_SIZE;
+		if (mix->split_every && next_random(&seed) % mix->split_every == 0)
+		{
+			offset++;
+		}
+		traffic->write_end[traffic->write_count] = offset < stream_size ? offset : stream_size;
+	}
+
+	/* Match each command to the write that completes its message */
+	w = 0;
+	i = 0;
+	for (offset = 0; offset < stream_size; offset += BLUETOOTH_MESSAGE_SIZE)
+	{
+		while (traffic->write_end[w] < offset + BLUETOOTH_MESSAGE_SIZE)
+		{
+			traffic->commands_by_write[w++] = i;
+		}
+		if (traffic->stream[offset] < sizeof(types))
+		{
+			traffic->command_write[i++] = w;
+		}
+	}
+	for (; w < traffic->write_count; w++)
+	{
+		traffic->commands_by_write[w] = i;
+	}
+	return 0;
+}
+
+static void
+traffic_destroy(struct Traffic* traffic)
+{
+	free(traffic->stream);
+	free(traffic->write_end);
+	free(traffic->command_types);
+	free(traffic->command_write);
+	free(traffic->commands_by_write);
+}
+
+/* Wait for the sink to have count commands. Returns -1 if they stop coming. */
+static int
+wait_for_commands(size_t count)
+{
+	struct timespec deadline;
+
+	while (received < count)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += ARRIVAL_TIMEOUT_MS / 1000;
+		if (sem_timedwait(&arrived, &deadline) == -1 && errno == ETIMEDOUT)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct BenchmarkClient
+{
+	int fd;
+	const struct Traffic* traffic;
+	bool paced;
+	unsigned long long* send_ns; /* When each write started */
+	unsigned long long end_ns; /* When the last command arrived */
+	bool lost;
+	unsigned char reply[BLUETOOTH_MESSAGE_SIZE]; /* A reply split across reads */
+	size_t reply_len;
+	uint32_t acked; /* Number of the last message acknowledged, from the 8 bit ACKs */
+};
+
+/*
+ * Read whatever replies have arrived, waiting up to timeout_ms for the first.
+ * Returns -1 if the connection failed.
+ */
+static int
+read_acks(struct BenchmarkClient* client, int timeout_ms)
+{
+	struct pollfd pfd = { client->fd, POLLIN, 0 };
+	unsigned char buf[256];
+	ssize_t read_count;
+	ssize_t i;
+
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+	{
+		return 0;
+	}
+	while ((read_count = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	{
+		for (i = 0; i < read_count; i++)
+		{
+			client->reply[client->reply_len++] = buf[i];
+			if (client->reply_len < BLUETOOTH_MESSAGE_SIZE)
+			{
+				continue;
+			}
+			if (client->reply[0] == NOTIFY_ACK)
+			{
+				/* Fewer than 256 messages go by between ACKs */
+				client->acked += (uint8_t)(client->reply[1] - client->acked);
+			}
+			client->reply_len = 0;
+		}
+	}
+	return (read_count == 0 || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+static void*
+client_thread_main(void* arg)
+{
+	struct BenchmarkClient* client = arg;
+	const struct Traffic* traffic = client->traffic;
+	uint32_t last_seq = BENCHMARK_MESSAGES - 1;
+	unsigned long long deadline_ns;
+	size_t offset = 0;
+	ssize_t written;
+	size_t w;
+
+	for (w = 0; w < traffic->write_count && !client->lost; w++)
+	{
+		client->send_ns[w] = now_ns();
+		while (offset < traffic->write_end[w])
+		{
+			written = write(client->fd, traffic->stream + offset, traffic->write_end[w] - offset);
+			if (written == -1)
+			{
+				client->lost = true;
+				break;
+			}
+			offset += written;
+		}
+		if (read_acks(client, 0) == -1)
+		{
+			client->lost = true;
+		}
+		if (client->paced && wait_for_commands(traffic->commands_by_write[w]) == -1)
+		{
+			client->lost = true;
+		}
+	}
+	if (wait_for_commands(traffic->command_count) == -1)
+	{
+		client->lost = true;
+	}
+	client->end_ns = now_ns();
+
+	deadline_ns = client->end_ns + ARRIVAL_TIMEOUT_MS * 1000000ull;
+	while (!client->lost && client->acked != last_seq && now_ns() < deadline_ns)
+	{
+		if (read_acks(client, 10) == -1)
+		{
+			client->lost = true;
+		}
+	}
+	if (client->acked != last_seq)
+	{
+		client->lost = true;
+	}
+
+	/* The connection loop returns once it sees the client leave */
+	close(client->fd);
+	return NULL;
+}
+
+/*
+ * Send the traffic through the connection loop. Returns the number of
+ * commands that arrived intact and in order.
+ */
+static size_t
+run_traffic(const struct Traffic* traffic, bool paced, BluetoothMessageHandler message_handler,
+            const struct EventSource* sources, size_t source_count,
+            unsigned long long* send_ns, unsigned long long* elapsed_ns)
+{
+	struct BenchmarkClient client = { .traffic = traffic, .paced = paced, .send_ns = send_ns,
+	                                  .acked = (uint32_t)-1 };
+	pthread_t client_thread;
+	int fds[2];
+	size_t i;
+
+	received = 0;
+	while (sem_trywait(&arrived) == 0)
+	{
+		/* Forget the last run's wakeups */
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+	{
+		return 0;
+	}
+	client.fd = fds[1];
+	if (pthread_create(&client_thread, NULL, client_thread_main, &client) != 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return 0;
+	}
+	run_socket_server(fds[0], message_handler, sources, source_count);
+	pthread_join(client_thread, NULL);
+	if (client.lost)
+	{
+		return 0;
+	}
+
+	*elapsed_ns = client.end_ns - send_ns[0];
+	for (i = 0; i < received && received_types[i] == traffic->command_types[i]; i++)
+	{
+		/* Count the commands that match what was sent */
+	}
+	return i;
+}
+
+static int
+compare_ull(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static unsigned long long
+percentile(const unsigned long long* sorted, size_t count, unsigned int pct)
+{
+	size_t rank = (count * pct + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+/* Print one mix's results to report. Returns -1 if commands were lost. */
+static int
+benchmark_mix(const struct TrafficMix* mix, BluetoothMessageHandler message_handler,
+              const struct EventSource* sources, size_t source_count, FILE* report)
+{
+	struct Traffic traffic;
+	unsigned long long* send_ns;
+	unsigned long long* latency_ns;
+	unsigned long long elapsed_ns;
+	unsigned long allocations_before;
+	unsigned long mix_allocations;
+	size_t flat_out;
+	size_t paced;
+	size_t i;
+
+	send_ns = malloc(BENCHMARK_MESSAGES * BLUETOOTH_MESSAGE_SIZE * sizeof(*send_ns));
+	latency_ns = malloc(BENCHMARK_MESSAGES * sizeof(*latency_ns));
+	if (!send_ns || !latency_ns || traffic_init(&traffic, mix) == -1)
+	{
+		fprintf(report, "%-10s out of memory\n", mix->name);
+		return -1;
+	}
+
+	allocations_before = allocations;
+	flat_out = run_traffic(&traffic, false, message_handler, sources, source_count,
+			send_ns, &elapsed_ns);
+	paced = run_traffic(&traffic, true, message_handler, sources, source_count,
+			send_ns, &elapsed_ns);
+	mix_allocations = allocations - allocations_before;
+
+	for (i = 0; i < paced; i++)
+	{
+		latency_ns[i] = arrival_ns[i] - send_ns[traffic.command_write[i]];
+	}
+	qsort(latency_ns, paced, sizeof(*latency_ns), compare_ull);
+
+	if (paced > 0)
+	{
+		fprintf(report, "%-10s %10.0f %8.1f %8.1f %8.1f %8.1f %10.2f\n", mix->name,
+				flat_out * 1e9 / elapsed_ns,
+				percentile(latency_ns, paced, 50) / 1e3, percentile(latency_ns, paced, 90) / 1e3,
+				percentile(latency_ns, paced, 99) / 1e3, latency_ns[paced - 1] / 1e3,
+				(double)mix_allocations / (2 * traffic.command_count));
+	}
+	if (flat_out != traffic.command_count || paced != traffic.command_count)
+	{
+		fprintf(report, "%-10s only %u flat out and %u paced of %u commands arrived in order "
+				"and were acknowledged\n",
+				mix->name, (unsigned)flat_out, (unsigned)paced, (unsigned)traffic.command_count);
+	}
+
+	traffic_destroy(&traffic);
+	free(send_ns);
+	free(latency_ns);
+	return (flat_out == traffic.command_count && paced == traffic.command_count) ? 0 : -1;
+}
+
+int
+run_benchmark(BluetoothMessageHandler message_handler,
+              const struct EventSource* sources, size_t source_count)
+{
+	FILE* report;
+	int null_fd;
+	int stderr_fd;
+	int ret = 0;
+	size_t i;
+
+	/* Keep the server's logging out of the report but still pay for it */
+	fflush(stdout);
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	stderr_fd = dup(STDERR_FILENO);
+	null_fd = open("/dev/null", O_WRONLY);
+	if (!report || stderr_fd == -1 || null_fd == -1)
+	{
+		perror("benchmark output");
+		return -1;
+	}
+
+	fprintf(report, "%u messages per run, latency in us from client write to device write\n",
+			BENCHMARK_MESSAGES);
+	fprintf(report, "%-10s %10s %8s %8s %8s %8s %10s\n",
+			"mix", "commands/s", "p50", "p90", "p99", "max", "allocs/cmd");
+	for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+	{
+		fflush(report);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		if (benchmark_mix(&mixes[i], message_handler, sources, source_count, report) != 0)
+		{
+			ret = -1;
+		}
+		log_flush();
+		fflush(stdout);
+		dup2(fileno(report), STDOUT_FILENO);
+		dup2(stderr_fd, STDERR_FILENO);
+	}
+
+	fclose(report);
+	close(stderr_fd);
+	close(null_fd);
+	return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef RC_BENCHMARK_H
+#define RC_BENCHMARK_H
+#include "bluetooth.h"
+
+/*
+ * Stand in for the control device with a pipe. Returns the end the server
+ * writes commands to, or -1.
+ */
+int benchmark_device_open(void);
+void benchmark_device_close(void);
+
+/*
+ * Feed traffic mixes through message_handler and the connection loop over a
+ * socketpair, with the given event sources, and print commands/s, latency
+ * percentiles and allocations. Returns 0, or -1 if commands went missing or
+ * out of order, or the last message was never acknowledged.
+ */
+int run_benchmark(BluetoothMessageHandler message_handler,
+                  const struct EventSource* sources, size_t source_count);
+
+#endif /* RC_BENCHMARK_H */
@@ -5,21 +5,43 @@
  *   https://people.csail.mit.edu/albert/bluez-intro/x604.html
  */
 #include "bluetooth.h"
+#include "log.h"
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 #include <bluetooth/rfcomm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
 
 #include <errno.h>
 #include <string.h>
 
-#define SERVER_QUEUE_LENGTH 1
+#define MAX_CLIENTS 4
+#define SERVER_QUEUE_LENGTH MAX_CLIENTS
 #define RFCOMM_CHANNEL 11
 #define SERVER_BUFFER_SIZE 256
+#define EPOLL_TICK_MS 250
+/* A client that stops part way through a message is assumed to be dead */
+#define CLIENT_STALL_TIMEOUT_MS 2000
+/* Control is handed to a waiting observer after this long without commands */
+#define CONTROLLER_IDLE_TIMEOUT_MS 60000
+/* Room for a few batches of acknowledgements as well as notifications */
+#define CLIENT_OUTPUT_BUFFER_SIZE 1024
+#define MAX_EVENT_SOURCES 4
+
+#if BLUETOOTH_STREAM_BUFFER_SIZE % BLUETOOTH_MESSAGE_SIZE != 0
+# error "The stream buffer must hold a whole number of messages"
+#endif
 
 /*
  * GUID Generated with uuidgen on vlsi32
@@ -53,7 +75,7 @@ bluetooth_register_service()
 	sdp_record_t *record = sdp_record_alloc();
 	if (!record)
 	{
-		fprintf(stderr, "Unable to allocate SDP record: %s\n", strerror(errno));
+		LOG_ERROR("Unable to allocate SDP record: %s", strerror(errno));
 		return NULL;
 	}
 
@@ -96,14 +118,14 @@ bluetooth_register_service()
 		err = sdp_record_register(session, record, 0);
 		if (err == -1)
 		{
-			fprintf(stderr, "Error in sdp_record_register: %s\n", strerror(errno));
+			LOG_ERROR("Error in sdp_record_register: %s", strerror(errno));
 			sdp_close(session);
 			session = NULL;
 		}
 	}
 	else
 	{
-		fprintf(stderr, "Unable to register bluetooth service: %s\n", strerror(errno));
+		LOG_ERROR("Unable to register bluetooth service: %s", strerror(errno));
 	}
 
 	sdp_data_free(channel);
@@ -115,97 +137,791 @@ bluetooth_register_service()
 	return session;
 }
 
+uint32_t
+monotonic_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)now.tv_sec * 1000000u + now.tv_nsec / 1000;
+}
+
+void
+message_stream_init(struct MessageStream* stream)
+{
+	stream->len = 0;
+	stream->next_seq = 0;
+}
+
+ssize_t
+message_stream_read(struct MessageStream* stream, int fd,
+                    BluetoothMessageHandler message_handler,
+                    struct MessageOrigin* origin)
+{
+	ssize_t bytes_read;
+	size_t whole_size;
+
+	bytes_read = read(fd, stream->buf + stream->len, sizeof(stream->buf) - stream->len);
+	if (bytes_read <= 0)
+	{
+		return bytes_read;
+	}
+	origin->rx_us = monotonic_us();
+	stream->len += bytes_read;
+
+	whole_size = stream->len - stream->len % BLUETOOTH_MESSAGE_SIZE;
+	if (whole_size > 0)
+	{
+		origin->first_seq = stream->next_seq;
+		stream->next_seq += whole_size / BLUETOOTH_MESSAGE_SIZE;
+		if (message_handler(stream->buf, whole_size, origin) != 0)
+		{
+			LOG_DEBUG("Unable to handle %u message(s)",
+					(unsigned)(whole_size / BLUETOOTH_MESSAGE_SIZE));
+		}
+
+		/* Keep the start of a partial message for the next read */
+		stream->len -= whole_size;
+		memmove(stream->buf, stream->buf + whole_size, stream->len);
+	}
+
+	return bytes_read;
+}
+
+/*
+ * A connected client. Only the controller's commands are carried out.
+ * Observers stay connected and take over control when the controller leaves.
+ * Every client is sent event notifications.
+ */
+struct Client
+{
+	int fd; /* -1 if this slot is free */
+	unsigned int id; /* Never reused, so replies can't reach a later connection */
+	bool is_controller;
+	char address[SERVER_BUFFER_SIZE];
+	struct MessageStream stream;
+	long connected_ms;
+	long last_message_ms;
+	long partial_since_ms; /* When stream started holding a partial message */
+	unsigned char out[CLIENT_OUTPUT_BUFFER_SIZE]; /* Not yet sent */
+	size_t out_len;
+	long out_since_ms; /* When out last stopped draining */
+	bool want_write; /* Watching for EPOLLOUT */
+};
+
 /*
- * Wait for connections and handle their requests. Only supports up to one
- * connection at a time.
+ * A way for clients to reach the server. open returns a listening socket,
+ * or -1 after printing why. close undoes open. peer_name describes an
+ * address returned by accept().
  */
+struct TransportOps
+{
+	int (*open)(const char* address);
+	void (*close)(int server_socket, const char* address);
+	void (*peer_name)(const struct sockaddr* peer, char* name, size_t size);
+};
+
+struct Server
+{
+	const struct TransportOps* transport; /* NULL when serving a single socket */
+	int server_socket;
+	int epoll_fd;
+	BluetoothMessageHandler message_handler;
+	struct EventSource sources[MAX_EVENT_SOURCES];
+	size_t source_count;
+	struct Client clients[MAX_CLIENTS];
+};
+
+/* epoll data for the server socket, which is neither a client nor a source */
+static char server_socket_marker;
+
+/* The server whose handlers are running, for bluetooth_reply */
+static struct Server* active_server;
+static unsigned int next_client_id;
+
+static long
+now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
 static int
-wait_for_connections(int server_socket, BluetoothMessageHandler message_handler)
+set_nonblocking(int fd)
 {
-	int client_connection = -1;
-	struct sockaddr_rc peer_addr = { 0 };
-	socklen_t peer_addr_size = sizeof(peer_addr);
-	char buf[SERVER_BUFFER_SIZE] = { 0 };
-	int bytes_read;
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+	{
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static struct Client*
+find_controller(struct Server* server)
+{
+	int i;
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (server->clients[i].fd != -1 && server->clients[i].is_controller)
+		{
+			return &server->clients[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Give control to the longest-connected client other than skip, if any.
+ */
+static void
+promote_observer(struct Server* server, struct Client* skip)
+{
+	struct Client* next = NULL;
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		struct Client* client = &server->clients[i];
+		if (client->fd != -1 && client != skip &&
+		    (!next || client->connected_ms < next->connected_ms))
+		{
+			next = client;
+		}
+	}
+
+	if (next)
+	{
+		next->is_controller = true;
+		next->last_message_ms = now_ms();
+		LOG_INFO("%s is now the controller", next->address);
+	}
+}
+
+static void
+close_client(struct Server* server, struct Client* client)
+{
+	bool was_controller = client->is_controller;
+
+	if (client->stream.len > 0)
+	{
+		LOG_WARNING("Dropped %u byte(s) of a partial message",
+				(unsigned)client->stream.len);
+	}
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->fd = -1;
+	client->is_controller = false;
+	LOG_INFO("Disconnected %s", client->address);
+
+	if (was_controller)
+	{
+		promote_observer(server, client);
+	}
+}
+
+/*
+ * Send as much queued output as the connection takes without blocking, and
+ * only ask to hear about writability while output is left over.
+ */
+static void
+flush_client(struct Server* server, struct Client* client)
+{
+	struct epoll_event event = { 0 };
+	ssize_t written;
+
+	if (client->out_len > 0)
+	{
+		/* A client that hung up must not kill the server with SIGPIPE */
+		written = send(client->fd, client->out, client->out_len, MSG_NOSIGNAL);
+		if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("Unable to write to %s: %s", client->address, strerror(errno));
+			close_client(server, client);
+			return;
+		}
+		if (written > 0)
+		{
+			client->out_len -= written;
+			memmove(client->out, client->out + written, client->out_len);
+			client->out_since_ms = now_ms();
+		}
+	}
+
+	if (client->want_write != (client->out_len > 0))
+	{
+		client->want_write = client->out_len > 0;
+		event.events = client->want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.ptr = client;
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+	}
+}
 
-	/* Wait for new connections */
-	fprintf(stderr, "Waiting for a connection\n");
-	while ((client_connection = accept(server_socket, (struct sockaddr *)&peer_addr, &peer_addr_size)) != -1)
+/*
+ * Queue data for a client. A client that can't keep up with what it is
+ * sent is disconnected rather than allowed to hold up the others.
+ */
+static void
+send_to_client(struct Server* server, struct Client* client,
+               const unsigned char* data, size_t size)
+{
+	if (size > sizeof(client->out) - client->out_len)
 	{
-		ba2str(&peer_addr.rc_bdaddr, buf);
-		fprintf(stderr, "Accepted connection from %s\n", buf);
-		memset(buf, 0, sizeof(buf));
+		LOG_WARNING("%s is not reading", client->address);
+		close_client(server, client);
+		return;
+	}
 
-		/* read data from the client */
-		while ((bytes_read = read(client_connection, buf, sizeof(buf))) > 0)
+	if (client->out_len == 0)
+	{
+		client->out_since_ms = now_ms();
+	}
+	memcpy(client->out + client->out_len, data, size);
+	client->out_len += size;
+	flush_client(server, client);
+}
+
+static void
+broadcast(struct Server* server, const unsigned char* data, size_t size)
+{
+	int i;
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (server->clients[i].fd != -1)
 		{
-			if (message_handler((unsigned char*)buf, bytes_read) != 0)
+			send_to_client(server, &server->clients[i], data, size);
+		}
+	}
+}
+
+/*
+ * Start serving a connection. Returns -1 and leaves fd to the caller if it
+ * can't be watched.
+ */
+static int
+add_client(struct Server* server, struct Client* client, int fd, const char* address)
+{
+	struct epoll_event event = { 0 };
+
+	if (set_nonblocking(fd) == -1)
+	{
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		return -1;
+	}
+
+	client->fd = fd;
+	client->id = next_client_id++;
+	snprintf(client->address, sizeof(client->address), "%s", address);
+	client->is_controller = !find_controller(server);
+	client->connected_ms = now_ms();
+	client->last_message_ms = client->connected_ms;
+	client->partial_since_ms = 0;
+	client->out_len = 0;
+	client->want_write = false;
+	message_stream_init(&client->stream);
+	LOG_INFO("Accepted %s from %s",
+			client->is_controller ? "controller" : "observer", client->address);
+	return 0;
+}
+
+static void
+accept_clients(struct Server* server)
+{
+	struct sockaddr_storage peer_addr = { 0 };
+	socklen_t peer_addr_size = sizeof(peer_addr);
+	struct Client* client;
+	char address[SERVER_BUFFER_SIZE] = { 0 };
+	int client_connection;
+	int i;
+
+	while ((client_connection = accept(server->server_socket, (struct sockaddr *)&peer_addr, &peer_addr_size)) != -1)
+	{
+		client = NULL;
+		for (i = 0; i < MAX_CLIENTS && !client; i++)
+		{
+			if (server->clients[i].fd == -1)
 			{
-				fprintf(stderr, "Unable to handle message: %.*s\n", bytes_read, buf);
+				client = &server->clients[i];
 			}
 		}
-		close(client_connection);
-		fprintf(stderr, "Disconnected\n");
+
+		server->transport->peer_name((struct sockaddr *)&peer_addr, address, sizeof(address));
+		peer_addr_size = sizeof(peer_addr);
+		if (!client || add_client(server, client, client_connection, address) == -1)
+		{
+			LOG_WARNING("Refusing connection from %s: %s", address,
+					client ? strerror(errno) : "too many clients");
+			close(client_connection);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		LOG_ERROR("Unable to accept on socket: %s", strerror(errno));
 	}
+}
+
+void
+bluetooth_reply(unsigned int client, const unsigned char* data, size_t size)
+{
+	int i;
 
-	if (client_connection == -1)
+	if (!active_server)
 	{
-		fprintf(stderr, "Unable to accept on socket: %s\n", strerror(errno));
+		return;
 	}
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (active_server->clients[i].fd != -1 && active_server->clients[i].id == client)
+		{
+			send_to_client(active_server, &active_server->clients[i], data, size);
+			return;
+		}
+	}
+}
+
+/*
+ * Observers' messages are handled too, so their connections do not back up
+ * and the handler can refuse them.
+ */
+static void
+read_client(struct Server* server, struct Client* client)
+{
+	struct MessageOrigin origin = { client->id, client->is_controller };
+	ssize_t bytes_read;
 
+	bytes_read = message_stream_read(&client->stream, client->fd, server->message_handler,
+			&origin);
+	if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		return;
+	}
+	if (bytes_read <= 0)
+	{
+		if (bytes_read == -1)
+		{
+			LOG_ERROR("Unable to read from %s: %s", client->address, strerror(errno));
+		}
+		close_client(server, client);
+		return;
+	}
+
+	client->last_message_ms = now_ms();
+	if (client->stream.len == 0)
+	{
+		client->partial_since_ms = 0;
+	}
+	else if (!client->partial_since_ms)
+	{
+		client->partial_since_ms = client->last_message_ms;
+	}
+}
+
+/*
+ * Pass on whatever an event source has to say to every client.
+ */
+static void
+read_events(struct Server* server, const struct EventSource* source)
+{
+	unsigned char notification[CLIENT_OUTPUT_BUFFER_SIZE];
+	ssize_t size;
+
+	while ((size = source->handler(notification, sizeof(notification))) > 0)
+	{
+		broadcast(server, notification, size);
+	}
+}
+
+/*
+ * Drop clients that stopped in the middle of a message or stopped taking
+ * output, and hand control away from a controller that has gone quiet while
+ * others are waiting.
+ */
+static void
+expire_clients(struct Server* server)
+{
+	long now = now_ms();
+	struct Client* controller;
+	int connected = 0;
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		struct Client* client = &server->clients[i];
+		if (client->fd == -1)
+		{
+			continue;
+		}
+		if ((client->partial_since_ms &&
+		     now - client->partial_since_ms > CLIENT_STALL_TIMEOUT_MS) ||
+		    (client->out_len > 0 && now - client->out_since_ms > CLIENT_STALL_TIMEOUT_MS))
+		{
+			LOG_WARNING("%s stalled", client->address);
+			close_client(server, client);
+			continue;
+		}
+		connected++;
+	}
+
+	controller = find_controller(server);
+	if (controller && connected > 1 &&
+	    now - controller->last_message_ms > CONTROLLER_IDLE_TIMEOUT_MS)
+	{
+		LOG_INFO("%s is idle", controller->address);
+		controller->is_controller = false;
+		/* Move it to the back of the line */
+		controller->connected_ms = now;
+		promote_observer(server, controller);
+	}
+}
+
+/*
+ * Set up to watch the server socket, if there is one, and the event sources.
+ */
+static int
+server_init(struct Server* server, const struct EventSource* sources, size_t source_count)
+{
+	struct epoll_event event = { 0 };
+	size_t i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		server->clients[i].fd = -1;
+		server->clients[i].is_controller = false;
+	}
+
+	server->epoll_fd = epoll_create(MAX_CLIENTS + 1 + MAX_EVENT_SOURCES);
+	if (server->epoll_fd == -1)
+	{
+		LOG_ERROR("Unable to create epoll instance: %s", strerror(errno));
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = &server_socket_marker;
+	if (server->server_socket != -1 &&
+	    (set_nonblocking(server->server_socket) == -1 ||
+	     epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->server_socket, &event) == -1))
+	{
+		LOG_ERROR("Unable to watch server socket: %s", strerror(errno));
+		close(server->epoll_fd);
+		return -1;
+	}
+
+	server->source_count = 0;
+	for (i = 0; i < source_count; i++)
+	{
+		if (sources[i].fd == -1)
+		{
+			continue;
+		}
+		if (server->source_count == MAX_EVENT_SOURCES)
+		{
+			LOG_ERROR("Too many event sources");
+			close(server->epoll_fd);
+			return -1;
+		}
+
+		server->sources[server->source_count] = sources[i];
+		event.data.ptr = &server->sources[server->source_count];
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sources[i].fd, &event) == -1)
+		{
+			LOG_ERROR("Unable to watch for events: %s", strerror(errno));
+			close(server->epoll_fd);
+			return -1;
+		}
+		server->source_count++;
+	}
 	return 0;
 }
 
+static bool
+any_clients(struct Server* server)
+{
+	int i;
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (server->clients[i].fd != -1)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Wait for connections and handle their requests. One client at a time is
+ * the controller; up to MAX_CLIENTS - 1 more are connected as observers.
+ * Without a server socket, returns 0 once the last client disconnects.
+ */
+static int
+wait_for_connections(struct Server* server)
+{
+	struct epoll_event events[MAX_CLIENTS + 1 + MAX_EVENT_SOURCES];
+	struct EventSource* source;
+	int event_count;
+	int i;
+
+	if (server->server_socket != -1)
+	{
+		LOG_INFO("Waiting for connections");
+	}
+	active_server = server;
+	while ((event_count = epoll_wait(server->epoll_fd, events,
+	                                 sizeof(events) / sizeof(events[0]), EPOLL_TICK_MS)) != -1 ||
+	       errno == EINTR)
+	{
+		for (i = 0; i < event_count; i++)
+		{
+			struct Client* client = events[i].data.ptr;
+			source = events[i].data.ptr;
+			if (events[i].data.ptr == &server_socket_marker)
+			{
+				accept_clients(server);
+			}
+			else if (source >= server->sources && source < server->sources + server->source_count)
+			{
+				read_events(server, source);
+			}
+			else if (client->fd != -1)
+			{
+				if (events[i].events & EPOLLOUT)
+				{
+					flush_client(server, client);
+				}
+				if (client->fd != -1 && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				{
+					read_client(server, client);
+				}
+			}
+		}
+		expire_clients(server);
+
+		if (server->server_socket == -1 && !any_clients(server))
+		{
+			active_server = NULL;
+			close(server->epoll_fd);
+			return 0;
+		}
+	}
+
+	active_server = NULL;
+
+	LOG_ERROR("Unable to wait for events: %s", strerror(errno));
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (server->clients[i].fd != -1)
+		{
+			close(server->clients[i].fd);
+		}
+	}
+	close(server->epoll_fd);
+	return -1;
+}
+
 int
-run_rfcomm_server(BluetoothMessageHandler message_handler)
+run_socket_server(int client_fd, BluetoothMessageHandler message_handler,
+                  const struct EventSource* sources, size_t source_count)
 {
-	struct sockaddr_rc local_address = { 0 };
-	int server_socket = -1;
-	int ret;
-	sdp_session_t *sdp_session = NULL;
+	struct Server server;
+
+	server.transport = NULL;
+	server.server_socket = -1;
+	server.message_handler = message_handler;
+	if (server_init(&server, sources, source_count) == -1)
+	{
+		close(client_fd);
+		return -1;
+	}
+	if (add_client(&server, &server.clients[0], client_fd, "local socket") == -1)
+	{
+		LOG_ERROR("Unable to watch connection: %s", strerror(errno));
+		close(client_fd);
+		close(server.epoll_fd);
+		return -1;
+	}
+	return wait_for_connections(&server);
+}
 
-	server_socket = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+/*
+ * Socket, bind and listen, printing why if any of them fail.
+ */
+static int
+listen_socket(int domain, int protocol, const struct sockaddr* address, socklen_t address_size)
+{
+	int server_socket;
+	int one = 1;
+
+	server_socket = socket(domain, SOCK_STREAM, protocol);
 	if (server_socket == -1)
 	{
-		fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
-		goto cleanup;
+		LOG_ERROR("Unable to create socket: %s", strerror(errno));
+		return -1;
 	}
 
+	/* Let a restarted server take over a TCP port straight away */
+	if (domain == AF_INET)
+	{
+		setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+
+	if (bind(server_socket, address, address_size) == -1)
+	{
+		LOG_ERROR("Unable to bind socket: %s", strerror(errno));
+		close(server_socket);
+		return -1;
+	}
+
+	if (listen(server_socket, SERVER_QUEUE_LENGTH) == -1)
+	{
+		LOG_ERROR("Unable to listen to socket: %s", strerror(errno));
+		close(server_socket);
+		return -1;
+	}
+	return server_socket;
+}
+
+static sdp_session_t* rfcomm_sdp_session;
+
+static int
+rfcomm_open(const char* address)
+{
+	struct sockaddr_rc local_address = { 0 };
+	int server_socket;
+
 	local_address.rc_family = AF_BLUETOOTH;
 	local_address.rc_bdaddr = *BDADDR_ANY;
 	local_address.rc_channel = (uint8_t)RFCOMM_CHANNEL;
-	ret = bind(server_socket, (struct sockaddr *)&local_address, sizeof(local_address));
-	if (ret == -1)
+	server_socket = listen_socket(AF_BLUETOOTH, BTPROTO_RFCOMM,
+			(struct sockaddr *)&local_address, sizeof(local_address));
+	if (server_socket == -1)
 	{
-		fprintf(stderr, "Unable to bind socket: %s\n", strerror(errno));
-		goto cleanup;
+		return -1;
 	}
 
-	ret = listen(server_socket, SERVER_QUEUE_LENGTH);
-	if (ret == -1)
+	rfcomm_sdp_session = bluetooth_register_service();
+	if (!rfcomm_sdp_session)
+	{
+		/* Specific error message already printed */
+		close(server_socket);
+		return -1;
+	}
+	return server_socket;
+}
+
+static void
+rfcomm_close(int server_socket, const char* address)
+{
+	sdp_close(rfcomm_sdp_session);
+	rfcomm_sdp_session = NULL;
+	close(server_socket);
+}
+
+static void
+rfcomm_peer_name(const struct sockaddr* peer, char* name, size_t size)
+{
+	ba2str(&((const struct sockaddr_rc *)peer)->rc_bdaddr, name);
+}
+
+static int
+unix_open(const char* address)
+{
+	struct sockaddr_un local_address = { 0 };
+
+	if (!address || strlen(address) >= sizeof(local_address.sun_path))
 	{
-		fprintf(stderr, "Unable to listen to socket: %s\n", strerror(errno));
-		goto cleanup;
+		LOG_ERROR("Unix socket path missing or too long");
+		return -1;
 	}
+	local_address.sun_family = AF_UNIX;
+	strcpy(local_address.sun_path, address);
 
-	sdp_session = bluetooth_register_service();
-	if (!sdp_session)
+	/* Left behind by a server that did not exit cleanly */
+	unlink(address);
+	return listen_socket(AF_UNIX, 0, (struct sockaddr *)&local_address, sizeof(local_address));
+}
+
+static void
+unix_close(int server_socket, const char* address)
+{
+	close(server_socket);
+	unlink(address);
+}
+
+static void
+unix_peer_name(const struct sockaddr* peer, char* name, size_t size)
+{
+	snprintf(name, size, "unix socket");
+}
+
+static int
+tcp_open(const char* address)
+{
+	struct sockaddr_in local_address = { 0 };
+	char* end = NULL;
+	long port = address ? strtol(address, &end, 10) : 0;
+
+	if (!address || *end != '\0' || port <= 0 || port > 65535)
 	{
-		/* Specific error message already printed */
-		goto cleanup;
+		LOG_ERROR("TCP port missing or invalid");
+		return -1;
 	}
+	local_address.sin_family = AF_INET;
+	local_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local_address.sin_port = htons(port);
+	return listen_socket(AF_INET, 0, (struct sockaddr *)&local_address, sizeof(local_address));
+}
+
+static void
+tcp_close(int server_socket, const char* address)
+{
+	close(server_socket);
+}
+
+static void
+tcp_peer_name(const struct sockaddr* peer, char* name, size_t size)
+{
+	const struct sockaddr_in* in = (const struct sockaddr_in *)peer;
+	char host[INET_ADDRSTRLEN] = "?";
+
+	inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+	snprintf(name, size, "%s:%u", host, ntohs(in->sin_port));
+}
+
+/* Indexed by enum Transport */
+static const struct TransportOps transports[] =
+{
+	{ rfcomm_open, rfcomm_close, rfcomm_peer_name },
+	{ unix_open, unix_close, unix_peer_name },
+	{ tcp_open, tcp_close, tcp_peer_name },
+};
 
-	wait_for_connections(server_socket, message_handler);
+int
+run_server(enum Transport transport, const char* address,
+           BluetoothMessageHandler message_handler,
+           const struct EventSource* sources, size_t source_count)
+{
+	struct Server server;
 
-cleanup:
-	if (sdp_session)
+	server.transport = &transports[transport];
+	server.server_socket = server.transport->open(address);
+	if (server.server_socket == -1)
 	{
-		sdp_close(sdp_session);
+		return 0;
 	}
-	if (server_socket != -1)
+
+	server.message_handler = message_handler;
+	if (server_init(&server, sources, source_count) == 0)
 	{
-		close(server_socket);
+		wait_for_connections(&server);
 	}
+
+	server.transport->close(server.server_socket, address);
 	return 0;
 }
-
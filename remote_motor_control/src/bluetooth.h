@@ -1,11 +1,103 @@
 #ifndef RC_BLUETOOTH_H
 #define RC_BLUETOOTH_H
+#include <stdint.h>
+#include <stdbool.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 
-typedef int (*BluetoothMessageHandler)(const unsigned char* message, size_t message_size);
+/* Every message is a command ID byte followed by an argument byte */
+#define BLUETOOTH_MESSAGE_SIZE 2
+#define BLUETOOTH_STREAM_BUFFER_SIZE 256
 
-int run_rfcomm_server(BluetoothMessageHandler message_handler);
+/*
+ * Where a batch of messages came from. Each connection numbers the messages
+ * it sends from 0, so message i of the batch is number first_seq + i.
+ */
+struct MessageOrigin
+{
+	unsigned int client; /* Identifies the connection to bluetooth_reply */
+	bool controller; /* Only the controller's commands are carried out */
+	uint32_t first_seq;
+	uint32_t rx_us; /* When the read that completed them returned, from monotonic_us() */
+};
+
+/*
+ * Handle a batch of messages. message holds message_size / BLUETOOTH_MESSAGE_SIZE
+ * whole messages back to back.
+ */
+typedef int (*BluetoothMessageHandler)(const unsigned char* message, size_t message_size,
+                                       const struct MessageOrigin* origin);
+
+/* CLOCK_MONOTONIC in microseconds, truncated to 32 bits like the module's traces */
+uint32_t monotonic_us(void);
+
+/*
+ * Reassembles the byte stream from a client into whole messages. Bytes of a
+ * partial message are kept until the rest of it arrives.
+ */
+struct MessageStream
+{
+	unsigned char buf[BLUETOOTH_STREAM_BUFFER_SIZE];
+	size_t len;
+	uint32_t next_seq; /* Number of the next whole message */
+};
+
+void message_stream_init(struct MessageStream* stream);
+
+/*
+ * Read once from fd and pass every whole message in the stream to the handler
+ * in a single call. The handler is given origin with first_seq and rx_us
+ * filled in. Returns the result of read().
+ */
+ssize_t message_stream_read(struct MessageStream* stream, int fd,
+                            BluetoothMessageHandler message_handler,
+                            struct MessageOrigin* origin);
+
+/*
+ * Called when an event source's fd is readable. Fill notification with up to
+ * notification_size bytes to send to every client and return how many, or 0
+ * or less once there is nothing more to send.
+ */
+typedef ssize_t (*BluetoothEventHandler)(unsigned char* notification, size_t notification_size);
+
+struct EventSource
+{
+	int fd;
+	BluetoothEventHandler handler;
+};
+
+/*
+ * Queue data for one client. Only for message and event handlers, which run
+ * in the server's thread. Does nothing if the client has disconnected.
+ */
+void bluetooth_reply(unsigned int client, const unsigned char* data, size_t size);
+
+/*
+ * How clients reach the server. The socket transports need no bluetooth
+ * hardware, for load testing and profiling on a development machine.
+ */
+enum Transport
+{
+	TRANSPORT_RFCOMM, /* Bluetooth, advertised over SDP. Takes no address. */
+	TRANSPORT_UNIX, /* A Unix domain socket; the address is its path */
+	TRANSPORT_TCP /* A port on the loopback interface; the address is the port */
+};
+
+/*
+ * Serve clients until an unrecoverable error, also watching source_count
+ * event sources. Sources with an fd of -1 are skipped.
+ */
+int run_server(enum Transport transport, const char* address,
+               BluetoothMessageHandler message_handler,
+               const struct EventSource* sources, size_t source_count);
+
+/*
+ * Serve one already connected client, e.g. one end of a socketpair, the same
+ * way run_server serves its clients. Returns 0 once it
+ * disconnects. Takes ownership of client_fd.
+ */
+int run_socket_server(int client_fd, BluetoothMessageHandler message_handler,
+                      const struct EventSource* sources, size_t source_count);
 
 #endif /* RC_BLUETOOTH_H */
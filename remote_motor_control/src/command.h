@@ -0,0 +1,39 @@
+#ifndef RC_COMMAND_H
+#define RC_COMMAND_H
+#include <stdint.h>
+
+/*
+ * A command parsed from a bluetooth message, before it is written to the
+ * control device.
+ */
+struct Command
+{
+	unsigned char command_type;
+	unsigned int magnitude; /* For commands that have a distance */
+	uint32_t rx_us; /* When the message was read, from monotonic_us() */
+	unsigned int client; /* The connection that sent it */
+	uint32_t seq; /* Its number among the messages that connection sent */
+};
+
+/*
+ * Notifications sent to clients. The ID byte has the top bit set so it
+ * can't be mistaken for a command, and is followed by an argument byte.
+ * Message numbers in notifications are the low 8 bits of the number.
+ */
+#define NOTIFY_STATE 0x80 /* Turret state changed; arg is the DMG_TURRET_* state */
+#define NOTIFY_REJECTED 0x81 /* arg is the rejected bluetooth command ID */
+#define NOTIFY_FEEDBACK 0x82 /* The priming feedback switch closed */
+#define NOTIFY_PROGRAM 0x88 /* A program ended; arg is the DMG_PROGRAM_* result */
+
+/*
+ * Replies to the client that sent the messages. An ACK covers its message
+ * and every one before it; of those, the ones not NACKed or LOST were
+ * carried out. Each ACK is followed by a QUEUE.
+ */
+#define NOTIFY_ACK 0x83 /* arg is the last message dealt with */
+#define NOTIFY_NACK 0x84 /* arg is a message that was invalid, refused or rejected */
+#define NOTIFY_LOST_FROM 0x85 /* arg is the first of a run of messages dropped on overflow */
+#define NOTIFY_LOST_TO 0x86 /* arg is the last of the run */
+#define NOTIFY_QUEUE 0x87 /* arg is how many commands are waiting for the device */
+
+#endif /* RC_COMMAND_H */
@@ -0,0 +1,204 @@
+/*
+ * Lock-free single-producer/single-consumer command queue between the
+ * bluetooth thread and the control device thread.
+ *
+ * head and floor are only written by the producer, tail only by the consumer.
+ * To drop the oldest command, the producer moves floor past it instead of
+ * touching tail. The consumer skips anything below floor, and re-checks floor
+ * after copying a slot in case the producer overwrote it mid-copy.
+ */
+#include "command_ring.h"
+#include <errno.h>
+
+#define COMMAND_RING_MASK (COMMAND_RING_SIZE - 1)
+
+#if COMMAND_RING_SIZE & COMMAND_RING_MASK
+# error "COMMAND_RING_SIZE must be a power of two"
+#endif
+
+#if defined(__ATOMIC_ACQUIRE)
+# define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define FULL_BARRIER() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+/*
+ * Older toolchains, like the Gumstix cross compiler, have no atomic builtins.
+ * The PXA270 has a single core, so it is enough to keep the compiler from
+ * reordering accesses.
+ */
+# define FULL_BARRIER() __asm__ __volatile__("" ::: "memory")
+# define LOAD_ACQUIRE(p) ({ unsigned int v_ = *(volatile unsigned int*)(p); FULL_BARRIER(); v_; })
+# define STORE_RELEASE(p, v) do { FULL_BARRIER(); *(volatile unsigned int*)(p) = (v); } while (0)
+#endif
+
+/* Is index a newer than index b? Indices wrap around. */
+#define INDEX_AFTER(a, b) ((int)((a) - (b)) > 0)
+
+int
+command_ring_init(struct CommandRing* ring, enum OverflowPolicy policy)
+{
+	ring->policy = policy;
+	ring->head = 0;
+	ring->floor = 0;
+	ring->tail = 0;
+	ring->pushed = 0;
+	ring->dropped = 0;
+	ring->popped = 0;
+	ring->high_water = 0;
+
+	if (sem_init(&ring->items, 0, 0) == -1)
+	{
+		return -1;
+	}
+	if (sem_init(&ring->spaces, 0, COMMAND_RING_SIZE) == -1)
+	{
+		sem_destroy(&ring->items);
+		return -1;
+	}
+	return 0;
+}
+
+void
+command_ring_destroy(struct CommandRing* ring)
+{
+	sem_destroy(&ring->items);
+	sem_destroy(&ring->spaces);
+}
+
+int
+command_ring_push(struct CommandRing* ring, const struct Command* cmd)
+{
+	unsigned int head = ring->head;
+	unsigned int oldest;
+	unsigned int depth;
+	int dropped = 0;
+
+	if (ring->policy == OVERFLOW_BLOCK)
+	{
+		/* Never full after this, so nothing is dropped below */
+		while (sem_wait(&ring->spaces) == -1 && errno == EINTR)
+		{
+			/* Retry */
+		}
+	}
+
+	oldest = LOAD_ACQUIRE(&ring->tail);
+	if (INDEX_AFTER(ring->floor, oldest))
+	{
+		oldest = ring->floor;
+	}
+
+	if (head - oldest >= COMMAND_RING_SIZE)
+	{
+		oldest++;
+		STORE_RELEASE(&ring->floor, oldest);
+		/* The consumer must see the new floor before the slot changes */
+		FULL_BARRIER();
+		ring->dropped++;
+		dropped = 1;
+	}
+
+	ring->slots[head & COMMAND_RING_MASK] = *cmd;
+	STORE_RELEASE(&ring->head, head + 1);
+	ring->pushed++;
+
+	depth = head + 1 - oldest;
+	if (depth > ring->high_water)
+	{
+		ring->high_water = depth;
+	}
+
+	sem_post(&ring->items);
+	return dropped;
+}
+
+size_t
+command_ring_pop(struct CommandRing* ring, struct Command* cmds, size_t max_count)
+{
+	unsigned int tail = ring->tail;
+	unsigned int floor;
+	size_t count = 0;
+	size_t i;
+
+	while (count < max_count)
+	{
+		floor = LOAD_ACQUIRE(&ring->floor);
+		if (INDEX_AFTER(floor, tail))
+		{
+			/* Skip commands the producer dropped */
+			tail = floor;
+		}
+		if (tail == LOAD_ACQUIRE(&ring->head))
+		{
+			break;
+		}
+
+		cmds[count] = ring->slots[tail & COMMAND_RING_MASK];
+		FULL_BARRIER();
+		if (INDEX_AFTER(LOAD_ACQUIRE(&ring->floor), tail))
+		{
+			/* Overwritten while it was being copied */
+			continue;
+		}
+
+		tail++;
+		count++;
+		STORE_RELEASE(&ring->tail, tail);
+	}
+
+	ring->popped += count;
+	if (ring->policy == OVERFLOW_BLOCK)
+	{
+		for (i = 0; i < count; i++)
+		{
+			sem_post(&ring->spaces);
+		}
+	}
+	return count;
+}
+
+unsigned int
+command_ring_depth(struct CommandRing* ring)
+{
+	unsigned int tail = ring->tail;
+	unsigned int floor = LOAD_ACQUIRE(&ring->floor);
+	unsigned int depth;
+
+	if (INDEX_AFTER(floor, tail))
+	{
+		tail = floor;
+	}
+	/* head may have moved on after floor was read */
+	depth = LOAD_ACQUIRE(&ring->head) - tail;
+	return depth < COMMAND_RING_SIZE ? depth : COMMAND_RING_SIZE;
+}
+
+void
+command_ring_wait(struct CommandRing* ring)
+{
+	while (sem_wait(&ring->items) == -1 && errno == EINTR)
+	{
+		/* Retry */
+	}
+
+	/* One wakeup covers every command pushed so far */
+	while (sem_trywait(&ring->items) == 0)
+	{
+		/* Drain */
+	}
+}
+
+void
+command_ring_wake(struct CommandRing* ring)
+{
+	sem_post(&ring->items);
+}
+
+void
+command_ring_stats(struct CommandRing* ring, struct CommandRingStats* stats)
+{
+	stats->pushed = ring->pushed;
+	stats->popped = ring->popped;
+	stats->dropped = ring->dropped;
+	stats->high_water = ring->high_water;
+}
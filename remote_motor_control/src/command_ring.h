@@ -0,0 +1,76 @@
+#ifndef RC_COMMAND_RING_H
+#define RC_COMMAND_RING_H
+#include "command.h"
+#include <semaphore.h>
+#include <stddef.h>
+
+/* Must be a power of two */
+#define COMMAND_RING_SIZE 64
+
+/* What to do when the producer finds the ring full */
+enum OverflowPolicy
+{
+	OVERFLOW_DROP_OLDEST,
+	OVERFLOW_BLOCK
+};
+
+struct CommandRingStats
+{
+	unsigned long pushed;
+	unsigned long popped;
+	unsigned long dropped;
+	unsigned int high_water; /* Deepest the ring has been */
+};
+
+/*
+ * Bounded single-producer/single-consumer queue of commands. Each index is
+ * written by only one side, so pushing and popping take no locks. The
+ * semaphores only put an idle side to sleep.
+ */
+struct CommandRing
+{
+	struct Command slots[COMMAND_RING_SIZE];
+	enum OverflowPolicy policy;
+
+	/* Written by the producer */
+	unsigned int head;
+	unsigned int floor; /* Oldest slot not yet dropped by the producer */
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned int high_water;
+
+	/* Written by the consumer */
+	unsigned int tail;
+	unsigned long popped;
+
+	sem_t items;
+	sem_t spaces; /* Only used with OVERFLOW_BLOCK */
+};
+
+int command_ring_init(struct CommandRing* ring, enum OverflowPolicy policy);
+void command_ring_destroy(struct CommandRing* ring);
+
+/*
+ * Producer side. Returns 1 if the oldest command was dropped to make room,
+ * otherwise 0.
+ */
+int command_ring_push(struct CommandRing* ring, const struct Command* cmd);
+
+/*
+ * Consumer side. Copies up to max_count of the oldest commands to cmds and
+ * returns how many were copied.
+ */
+size_t command_ring_pop(struct CommandRing* ring, struct Command* cmds, size_t max_count);
+
+/* Consumer side. How many commands are waiting, at most COMMAND_RING_SIZE. */
+unsigned int command_ring_depth(struct CommandRing* ring);
+
+/* Consumer side. Sleep until a command may be available. */
+void command_ring_wait(struct CommandRing* ring);
+
+/* Wake a consumer sleeping in command_ring_wait, e.g. to shut it down */
+void command_ring_wake(struct CommandRing* ring);
+
+void command_ring_stats(struct CommandRing* ring, struct CommandRingStats* stats);
+
+#endif /* RC_COMMAND_RING_H */
@@ -0,0 +1,377 @@
+/*
+ * Asynchronous logger. Producers take the lock only long enough to copy a
+ * record into a preallocated ring, so a slow console never stalls the
+ * command path. The writer thread formats whole batches and writes each
+ * with a single write(2).
+ */
+#include "log.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_RING_SIZE 256
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MAX_ARGS 6
+#define LOG_BATCH 32
+#define LOG_LINE_SIZE 256
+
+#if LOG_RING_SIZE & LOG_RING_MASK
+# error "LOG_RING_SIZE must be a power of two"
+#endif
+
+struct LogRecord
+{
+	const char* format;
+	unsigned long time_ms;
+	unsigned char level;
+	unsigned char arg_count;
+	long args[LOG_MAX_ARGS]; /* Integers, or offsets into strings for %s */
+	char strings[LOG_STRING_SIZE];
+};
+
+static struct LogRecord ring[LOG_RING_SIZE];
+static unsigned int head;
+static unsigned int tail;
+static unsigned long dropped;
+static bool running;
+static bool stopping;
+static pthread_t writer_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_records = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+
+static const char* const level_names[] = { "debug", "info", "warning", "error" };
+
+/* One printf conversion, as far as the logger understands them */
+struct Conversion
+{
+	const char* start; /* The '%' */
+	const char* end; /* Just past the conversion character */
+	bool is_long;
+	char type; /* 0 if unsupported */
+};
+
+static const char*
+next_conversion(const char* p, struct Conversion* conversion)
+{
+	p = strchr(p, '%');
+	if (!p)
+	{
+		return NULL;
+	}
+	conversion->start = p++;
+	while (*p == '-' || (*p >= '0' && *p <= '9'))
+	{
+		p++;
+	}
+	conversion->is_long = *p == 'l';
+	if (conversion->is_long)
+	{
+		p++;
+	}
+	conversion->type = strchr("diuxcs%", *p) && *p ? *p : 0;
+	conversion->end = *p ? p + 1 : p;
+	return conversion->end;
+}
+
+static void
+capture(struct LogRecord* record, enum LogLevel level, const char* format, va_list args)
+{
+	struct timespec now;
+	struct Conversion conversion;
+	const char* p = format;
+	const char* string;
+	size_t used = 0;
+	size_t length;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->format = format;
+	record->time_ms = now.tv_sec * 1000ul + now.tv_nsec / 1000000;
+	record->level = level;
+	record->arg_count = 0;
+
+	while (record->arg_count < LOG_MAX_ARGS && (p = next_conversion(p, &conversion)))
+	{
+		long* arg = &record->args[record->arg_count];
+
+		switch (conversion.type)
+		{
+		case 'd':
+		case 'i':
+			*arg = conversion.is_long ? va_arg(args, long) : va_arg(args, int);
+			break;
+		case 'u':
+		case 'x':
+			*arg = conversion.is_long ? (long)va_arg(args, unsigned long)
+				: (long)va_arg(args, unsigned int);
+			break;
+		case 'c':
+			*arg = va_arg(args, int);
+			break;
+		case 's':
+			string = va_arg(args, const char*);
+			if (!string)
+			{
+				string = "(null)";
+			}
+			*arg = used;
+			length = strlen(string);
+			if (length >= sizeof(record->strings) - used)
+			{
+				length = sizeof(record->strings) - used - 1;
+			}
+			memcpy(record->strings + used, string, length);
+			record->strings[used + length] = '\0';
+			if (used + length + 1 < sizeof(record->strings))
+			{
+				used += length + 1;
+			}
+			break;
+		case '%':
+			continue;
+		default:
+			/* Unsupported, so the rest of the format is written as is */
+			return;
+		}
+		record->arg_count++;
+	}
+}
+
+/* Format record as one line into line. Returns its length. */
+static size_t
+format_record(const struct LogRecord* record, char* line, size_t size)
+{
+	struct Conversion conversion;
+	const char* p = record->format;
+	const char* next;
+	char spec[16];
+	unsigned int arg = 0;
+	size_t length;
+	int ret;
+
+	/* Leave room for the newline */
+	size--;
+	ret = snprintf(line, size, "%5lu.%03lu %s: ", record->time_ms / 1000,
+		record->time_ms % 1000, level_names[record->level]);
+	length = ret < 0 ? 0 : (size_t)ret < size ? (size_t)ret : size - 1;
+
+	while ((next = next_conversion(p, &conversion)) && conversion.type
+		&& (conversion.type == '%' || arg < record->arg_count))
+	{
+		ret = snprintf(line + length, size - length, "%.*s", (int)(conversion.start - p), p);
+		length += ret < 0 ? 0 : (size_t)ret;
+		if (length >= size)
+		{
+			length = size - 1;
+			break;
+		}
+
+		if ((size_t)(conversion.end - conversion.start) >= sizeof(spec))
+		{
+			break;
+		}
+		memcpy(spec, conversion.start, conversion.end - conversion.start);
+		spec[conversion.end - conversion.start] = '\0';
+		switch (conversion.type)
+		{
+		case 'd':
+		case 'i':
+			ret = conversion.is_long ? snprintf(line + length, size - length, spec, record->args[arg])
+				: snprintf(line + length, size - length, spec, (int)record->args[arg]);
+			break;
+		case 'u':
+		case 'x':
+			ret = conversion.is_long
+				? snprintf(line + length, size - length, spec, (unsigned long)record->args[arg])
+				: snprintf(line + length, size - length, spec, (unsigned int)record->args[arg]);
+			break;
+		case 'c':
+			ret = snprintf(line + length, size - length, spec, (int)record->args[arg]);
+			break;
+		case 's':
+			ret = snprintf(line + length, size - length, spec, record->strings + record->args[arg]);
+			break;
+		default:
+			ret = snprintf(line + length, size - length, "%%");
+			break;
+		}
+		if (conversion.type != '%')
+		{
+			arg++;
+		}
+		length += ret < 0 ? 0 : (size_t)ret;
+		if (length >= size)
+		{
+			length = size - 1;
+			break;
+		}
+		p = next;
+	}
+
+	if (length < size - 1)
+	{
+		ret = snprintf(line + length, size - length, "%s", p);
+		length += ret < 0 ? 0 : (size_t)ret;
+		if (length >= size)
+		{
+			length = size - 1;
+		}
+	}
+	line[length++] = '\n';
+	return length;
+}
+
+static void
+write_all(const char* data, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0)
+	{
+		ret = write(STDERR_FILENO, data, size);
+		if (ret <= 0)
+		{
+			/* Nowhere left to report it */
+			return;
+		}
+		data += ret;
+		size -= ret;
+	}
+}
+
+static void*
+writer_main(void* arg)
+{
+	static struct LogRecord batch[LOG_BATCH];
+	static char output[LOG_BATCH * LOG_LINE_SIZE + LOG_LINE_SIZE];
+	unsigned long batch_dropped;
+	unsigned int count;
+	unsigned int i;
+	size_t length;
+
+	pthread_mutex_lock(&lock);
+	for (;;)
+	{
+		while (head == tail && !dropped && !stopping)
+		{
+			pthread_cond_wait(&has_records, &lock);
+		}
+		if (head == tail && !dropped)
+		{
+			break;
+		}
+
+		count = head - tail;
+		if (count > LOG_BATCH)
+		{
+			count = LOG_BATCH;
+		}
+		for (i = 0; i < count; i++)
+		{
+			batch[i] = ring[(tail + i) & LOG_RING_MASK];
+		}
+		tail += count;
+		batch_dropped = dropped;
+		dropped = 0;
+		pthread_mutex_unlock(&lock);
+
+		length = 0;
+		for (i = 0; i < count; i++)
+		{
+			length += format_record(&batch[i], output + length, LOG_LINE_SIZE);
+		}
+		if (batch_dropped)
+		{
+			length += snprintf(output + length, LOG_LINE_SIZE,
+				"%lu log record(s) dropped\n", batch_dropped);
+		}
+		write_all(output, length);
+
+		pthread_mutex_lock(&lock);
+		if (head == tail)
+		{
+			pthread_cond_broadcast(&drained);
+		}
+	}
+	pthread_cond_broadcast(&drained);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int
+log_start(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = false;
+	running = pthread_create(&writer_thread, NULL, writer_main, NULL) == 0;
+	pthread_mutex_unlock(&lock);
+	return running ? 0 : -1;
+}
+
+void
+log_stop(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!running)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_signal(&has_records);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(writer_thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+log_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	while (running && (head != tail || dropped))
+	{
+		pthread_cond_wait(&drained, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void
+log_message(enum LogLevel level, const char* format, ...)
+{
+	struct LogRecord record;
+	char line[LOG_LINE_SIZE];
+	va_list args;
+
+	pthread_mutex_lock(&lock);
+	if (running)
+	{
+		if (head - tail < LOG_RING_SIZE)
+		{
+			va_start(args, format);
+			capture(&ring[head & LOG_RING_MASK], level, format, args);
+			va_end(args);
+			head++;
+		}
+		else
+		{
+			dropped++;
+		}
+		pthread_cond_signal(&has_records);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	pthread_mutex_unlock(&lock);
+
+	va_start(args, format);
+	capture(&record, level, format, args);
+	va_end(args);
+	write_all(line, format_record(&record, line, sizeof(line)));
+}
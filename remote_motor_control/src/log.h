@@ -0,0 +1,51 @@
+#ifndef RC_LOG_H
+#define RC_LOG_H
+
+/*
+ * Leveled logging that keeps stdio off the command path. log_message only
+ * copies the format and its arguments into a preallocated ring; a
+ * background thread formats the records and writes them to stderr.
+ *
+ * Formats must be string literals, since only the pointer is kept. They may
+ * use %d %i %u %x %c %s and %%, with an optional width and the l length
+ * modifier on integers. Strings are copied, up to LOG_STRING_SIZE bytes
+ * for all of a record's strings together.
+ */
+#define LOG_STRING_SIZE 96
+
+enum LogLevel
+{
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_ERROR
+};
+
+/*
+ * Start the background thread. Until it starts, and once log_stop returns,
+ * every record is written straight away by the thread that logged it.
+ * Returns 0, or -1 if the thread could not be started.
+ */
+int log_start(void);
+
+/* Write out everything logged so far and stop the background thread */
+void log_stop(void);
+
+/* Wait until everything logged so far has been written */
+void log_flush(void);
+
+/* Never blocks on I/O. A record that finds the ring full is counted and dropped. */
+void log_message(enum LogLevel level, const char* format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Debug records are compiled out of release builds, arguments and all */
+#ifdef NDEBUG
+# define LOG_DEBUG(...) do { if (0) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#else
+# define LOG_DEBUG(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+#define LOG_INFO(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif /* RC_LOG_H */
@@ -1,37 +1,101 @@
 #include "bluetooth.h"
+#include "command_ring.h"
+#include "log.h"
+#include "record.h"
+#include "DMGturret.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #ifdef SELF_TEST
-# include <stdlib.h> /* mkstemp */
 # include <assert.h>
+# include <sys/eventfd.h>
+# include <sys/resource.h>
+# include <signal.h>
+#endif
+#ifdef BENCHMARK
+# include "benchmark.h"
+#endif
+#ifdef REPLAY
+# include "replay.h"
 #endif
 
 #define CONTROL_DEV_PATH "/dev/motor_control"
 #define INVALID_COMMAND (0xff)
-#define BUF_SIZE 32
+#define COMMAND_BATCH_SIZE COMMAND_RING_SIZE
 
 /*
  * Map from bluetooth command values to control device file command IDs.
  */
 static const unsigned char command_map[] =
 {
-	'F',
-	'P',
-	'U',
-	'D',
-	'L',
-	'R'
+	DMG_CMD_FIRE,
+	DMG_CMD_PRIME,
+	DMG_CMD_UP,
+	DMG_CMD_DOWN,
+	DMG_CMD_LEFT,
+	DMG_CMD_RIGHT,
+	DMG_CMD_AIM
 };
 
-struct Command
+/*
+ * The aim message's argument is the pan position in the high nibble and the
+ * tilt position in the low nibble, each 0 to DMG_AIM_STEPS.
+ */
+#define AIM_COMMAND_ID 6
+
+int control_fd = -1;
+int event_fd = -1; /* Reads turret events from the control device */
+/* Carries replies from the device thread to the bluetooth thread */
+int reply_pipe[2] = { -1, -1 };
+
+/*
+ * A notification for one client, on its way from the device thread to the
+ * bluetooth thread.
+ */
+struct Reply
 {
-	unsigned char command_type;
-	unsigned int magnitude; /* For commands that have a distance */
+	unsigned int client;
+	unsigned char frame[BLUETOOTH_MESSAGE_SIZE];
 };
 
-int control_fd = -1;
+/*
+ * At most a LOST run, a NACK, an ACK and a QUEUE per command in a batch.
+ * Small enough for one atomic pipe write.
+ */
+#define MAX_BATCH_REPLIES (5 * COMMAND_BATCH_SIZE)
+
+struct ReplyBatch
+{
+	struct Reply replies[MAX_BATCH_REPLIES];
+	size_t count;
+};
+
+/* The last message the device thread took from the ring, to spot drops */
+static int have_last_message = 0;
+static unsigned int last_client;
+static uint32_t last_seq;
+
+/* Parsed commands on their way from the bluetooth thread to the device thread */
+static struct CommandRing command_ring;
+static volatile int device_thread_stop = 0;
+
+/* Ask the module to trace every command's latency (-t) */
+static int trace_commands = 0;
+
+/*
+ * Merge relative moves before writing them (-c). -1 writes every move as
+ * it came; otherwise how many ms to wait for more moves after a batch that
+ * ends with one.
+ */
+static int coalesce_window_ms = -1;
+
+/* Where received messages are recorded (-r) */
+static struct Recorder recorder = { .fd = -1 };
 
 static struct Command
 parse_message(const unsigned char* message, size_t message_size)
@@ -54,44 +118,563 @@ parse_message(const unsigned char* message, size_t message_size)
 			cmd.command_type = command_map[message[0]];
 			cmd.magnitude = arg1;
 			break;
+		case AIM_COMMAND_ID:
+			cmd.command_type = command_map[message[0]];
+			cmd.magnitude = (message[1] >> 4) << 8 | (message[1] & 0xf);
+			break;
 		}
 	}
 
 	return cmd;
 }
 
+/*
+ * Write a batch of commands to the control device in as few writes as
+ * possible. The device stops at the first command it rejects, so the rest of
+ * the batch is resubmitted after it. Each command the device rejects has its
+ * entry in rejected set.
+ */
 static int
-recv_msg(const unsigned char* message, size_t message_size)
+write_commands(const struct dmg_command* commands, size_t command_count,
+               unsigned char* rejected)
 {
-	char buf[BUF_SIZE];
-	struct Command cmd = parse_message(message, message_size);
 	ssize_t write_count;
+	size_t applied;
+	size_t done = 0;
+	int ret = 0;
 
-	if (cmd.command_type == INVALID_COMMAND)
+	LOG_DEBUG("Writing %u command(s)", (unsigned)command_count);
+	while (command_count > 0)
 	{
-		return -1;
+		write_count = write(control_fd, commands, command_count * sizeof(*commands));
+		if (write_count == -1 && errno != EINVAL)
+		{
+			LOG_ERROR("write " CONTROL_DEV_PATH ": %s", strerror(errno));
+			return -1;
+		}
+
+		applied = write_count == -1 ? 0 : write_count / sizeof(*commands);
+		if (applied < command_count)
+		{
+			LOG_WARNING("Command rejected: %c%u",
+					commands[applied].type, (unsigned)commands[applied].value);
+			rejected[done + applied] = 1;
+			ret = -1;
+			applied++;
+		}
+		commands += applied;
+		command_count -= applied;
+		done += applied;
 	}
+	return ret;
+}
 
-	write_count = snprintf(buf, BUF_SIZE, "%c%u\n", cmd.command_type, cmd.magnitude);
-	if (write_count >= BUF_SIZE)
+/* The axis a relative move turns, 0 for pan or 1 for tilt, or -1 */
+static int
+move_axis(unsigned char command_type)
+{
+	switch (command_type)
 	{
-		fprintf(stderr, "Unable to format command for message %.*s\n",
-				(int)message_size, message);
-		return -1;
+	case DMG_CMD_LEFT:
+	case DMG_CMD_RIGHT:
+		return 0;
+	case DMG_CMD_UP:
+	case DMG_CMD_DOWN:
+		return 1;
+	}
+	return -1;
+}
+
+/*
+ * Replace the moves in cmds[start, end), which hold at most one per axis, with
+ * the net move on each axis given by net. Moves that net to nothing are
+ * dropped. The device rejects a move of more than DMG_AIM_STEPS, so a longer
+ * one is cut to that; the device stops it at the end of the range, as it
+ * would have stopped the moves one at a time. slot[axis] is moved along with
+ * the axis' move, or set to -1 if it was dropped. Returns the new end.
+ */
+static size_t
+settle_moves(struct Command* cmds, size_t start, size_t end, const long* net, long* slot)
+{
+	static const unsigned char forward[] = { DMG_CMD_LEFT, DMG_CMD_UP };
+	static const unsigned char backward[] = { DMG_CMD_RIGHT, DMG_CMD_DOWN };
+	size_t out = start;
+	size_t i;
+	int axis;
+
+	for (i = start; i < end; i++)
+	{
+		axis = move_axis(cmds[i].command_type);
+		if (net[axis] == 0)
+		{
+			slot[axis] = -1;
+			continue;
+		}
+		cmds[out] = cmds[i];
+		cmds[out].command_type = net[axis] > 0 ? forward[axis] : backward[axis];
+		cmds[out].magnitude = labs(net[axis]) < DMG_AIM_STEPS ? labs(net[axis]) : DMG_AIM_STEPS;
+		slot[axis] = out;
+		out++;
+	}
+	return out;
+}
+
+/*
+ * Merge each run of relative moves between fires and primes into at most one
+ * net move per axis, in the order each axis first moved, in place. A merged
+ * move keeps the receive time and number of the first move in it. merged_into
+ * gets the new index of the command each one ended up in, or -1 for moves
+ * that netted to nothing. Returns the new count.
+ */
+static size_t
+coalesce_moves(struct Command* cmds, size_t count, long* merged_into)
+{
+	long net[2] = { 0, 0 };
+	long slot[2] = { -1, -1 }; /* Where each axis' move is in the current run */
+	size_t run = 0; /* Start of the current run of moves */
+	size_t run_from = 0; /* The first command merged into it */
+	size_t out = 0;
+	size_t i;
+	size_t j;
+	int axis;
+
+	for (i = 0; i <= count; i++)
+	{
+		axis = i < count ? move_axis(cmds[i].command_type) : -1;
+		if (axis >= 0)
+		{
+			if (slot[axis] == -1)
+			{
+				slot[axis] = out;
+				cmds[out++] = cmds[i];
+			}
+			if (cmds[i].command_type == DMG_CMD_LEFT || cmds[i].command_type == DMG_CMD_UP)
+			{
+				net[axis] += cmds[i].magnitude;
+			}
+			else
+			{
+				net[axis] -= cmds[i].magnitude;
+			}
+			merged_into[i] = axis; /* Until the run is settled */
+			continue;
+		}
+
+		/* Fire, prime, or the end of the batch: the moves before it go first */
+		out = settle_moves(cmds, run, out, net, slot);
+		for (j = run_from; j < i; j++)
+		{
+			merged_into[j] = slot[merged_into[j]];
+		}
+		if (i < count)
+		{
+			merged_into[i] = out;
+			cmds[out++] = cmds[i];
+		}
+		run = out;
+		run_from = i + 1;
+		net[0] = net[1] = 0;
+		slot[0] = slot[1] = -1;
 	}
+	return out;
+}
+
+static void
+add_reply(struct ReplyBatch* batch, unsigned int client, unsigned char id, uint32_t arg)
+{
+	struct Reply* reply = &batch->replies[batch->count++];
+	reply->client = client;
+	reply->frame[0] = id;
+	reply->frame[1] = arg & 0xff;
+}
+
+/*
+ * Report the messages the ring dropped before each command, NACK the invalid
+ * commands and take them out of the batch. acks gets the last command from
+ * each client in the batch. Returns the new count.
+ */
+static size_t
+check_sequence(struct Command* cmds, size_t count, struct ReplyBatch* replies,
+               struct Command* acks, size_t* ack_count)
+{
+	size_t out = 0;
+	size_t i;
 
-	printf("Writing %d bytes: '%.*s'\n", (int)write_count, (int)write_count, buf);
-	write_count = write(control_fd, buf, write_count);
-	if (write_count == -1)
+	for (i = 0; i < count; i++)
 	{
-		perror("write " CONTROL_DEV_PATH);
+		if (have_last_message && cmds[i].client == last_client &&
+		    (int32_t)(cmds[i].seq - last_seq) > 1)
+		{
+			add_reply(replies, last_client, NOTIFY_LOST_FROM, last_seq + 1);
+			add_reply(replies, last_client, NOTIFY_LOST_TO, cmds[i].seq - 1);
+		}
+		have_last_message = 1;
+		last_client = cmds[i].client;
+		last_seq = cmds[i].seq;
+
+		if (*ack_count > 0 && acks[*ack_count - 1].client == cmds[i].client)
+		{
+			acks[*ack_count - 1].seq = cmds[i].seq;
+		}
+		else
+		{
+			acks[(*ack_count)++] = cmds[i];
+		}
+
+		if (cmds[i].command_type == INVALID_COMMAND)
+		{
+			add_reply(replies, cmds[i].client, NOTIFY_NACK, cmds[i].seq);
+			continue;
+		}
+		cmds[out++] = cmds[i];
+	}
+	return out;
+}
+
+/*
+ * Hand replies to the bluetooth thread. Never blocks, so a busy bluetooth
+ * thread can't hold up the device; replies that don't fit are lost.
+ */
+static void
+send_replies(const struct ReplyBatch* replies)
+{
+	if (reply_pipe[1] == -1 || replies->count == 0)
+	{
+		return;
+	}
+	if (write(reply_pipe[1], replies->replies, replies->count * sizeof(replies->replies[0])) == -1)
+	{
+		LOG_WARNING("Dropped %u repl(ies): %s", (unsigned)replies->count, strerror(errno));
+	}
+}
+
+/*
+ * Write every command waiting in the ring to the control device, then tell
+ * each client how far its messages got. Returns the number of commands
+ * taken from the ring.
+ */
+static size_t
+write_pending_commands(void)
+{
+	struct Command cmds[COMMAND_BATCH_SIZE];
+	struct Command acks[COMMAND_BATCH_SIZE];
+	struct Command received[COMMAND_BATCH_SIZE];
+	long merged_into[COMMAND_BATCH_SIZE]; /* Which of cmds each of received went into */
+	size_t received_count;
+	/* Room for a DMG_CMD_TRACE before every command */
+	struct dmg_command commands[2 * COMMAND_BATCH_SIZE];
+	unsigned char rejected[2 * COMMAND_BATCH_SIZE];
+	struct ReplyBatch replies;
+	unsigned int depth;
+	size_t ack_count;
+	size_t total = 0;
+	size_t count;
+	size_t n;
+	size_t i;
+	size_t j;
+
+	while ((count = command_ring_pop(&command_ring, cmds, COMMAND_BATCH_SIZE)) > 0)
+	{
+		total += count;
+		/* A move is likely followed by more while the joystick is held */
+		if (coalesce_window_ms > 0 && count < COMMAND_BATCH_SIZE &&
+		    move_axis(cmds[count - 1].command_type) >= 0)
+		{
+			usleep(coalesce_window_ms * 1000);
+			n = command_ring_pop(&command_ring, cmds + count, COMMAND_BATCH_SIZE - count);
+			total += n;
+			count += n;
+		}
+
+		replies.count = 0;
+		ack_count = 0;
+		count = check_sequence(cmds, count, &replies, acks, &ack_count);
+		/* Keep who sent each command, to NACK every message merged into a rejected one */
+		received_count = count;
+		memcpy(received, cmds, count * sizeof(cmds[0]));
+		if (coalesce_window_ms >= 0)
+		{
+			count = coalesce_moves(cmds, count, merged_into);
+		}
+		else
+		{
+			for (i = 0; i < count; i++)
+			{
+				merged_into[i] = i;
+			}
+		}
+
+		n = 0;
+		for (i = 0; i < count; i++)
+		{
+			if (trace_commands)
+			{
+				commands[n].version = DMG_COMMAND_VERSION;
+				commands[n].type = DMG_CMD_TRACE;
+				commands[n].axis = 0;
+				commands[n].reserved = 0;
+				commands[n].value = cmds[i].rx_us;
+				n++;
+			}
+			commands[n].version = DMG_COMMAND_VERSION;
+			commands[n].type = cmds[i].command_type;
+			commands[n].axis = 0;
+			commands[n].reserved = 0;
+			commands[n].value = cmds[i].magnitude;
+			n++;
+		}
+		if (n > 0)
+		{
+			memset(rejected, 0, n);
+			write_commands(commands, n, rejected);
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (!rejected[i])
+			{
+				continue;
+			}
+			for (j = 0; j < received_count; j++)
+			{
+				if (merged_into[j] == (long)(trace_commands ? i / 2 : i))
+				{
+					add_reply(&replies, received[j].client, NOTIFY_NACK, received[j].seq);
+				}
+			}
+		}
+		depth = command_ring_depth(&command_ring);
+		for (i = 0; i < ack_count; i++)
+		{
+			add_reply(&replies, acks[i].client, NOTIFY_ACK, acks[i].seq);
+			add_reply(&replies, acks[i].client, NOTIFY_QUEUE, depth);
+		}
+		send_replies(&replies);
+	}
+	return total;
+}
+
+#ifndef SELF_TEST
+/*
+ * Drain the command ring into the control device so a slow device write
+ * never holds up reading from bluetooth.
+ */
+static void*
+device_thread_main(void* arg)
+{
+	while (!device_thread_stop)
+	{
+		command_ring_wait(&command_ring);
+		write_pending_commands();
+	}
+	/* Whatever was queued before the stop, e.g. the end of a replay */
+	write_pending_commands();
+	return NULL;
+}
+
+/*
+ * Pass the device thread's replies on to the clients they are for. There is
+ * never anything to send to every client.
+ */
+static ssize_t
+read_replies(unsigned char* notification, size_t notification_size)
+{
+	struct Reply replies[MAX_BATCH_REPLIES];
+	ssize_t read_count;
+	size_t i;
+
+	read_count = read(reply_pipe[0], replies, sizeof(replies));
+	if (read_count == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("read replies: %s", strerror(errno));
+		}
 		return -1;
 	}
+
+	/* Every write to the pipe is whole replies, so every read is too */
+	for (i = 0; i < read_count / sizeof(replies[0]); i++)
+	{
+		bluetooth_reply(replies[i].client, replies[i].frame, sizeof(replies[i].frame));
+	}
 	return 0;
 }
+#endif
+
+/*
+ * Handle a batch of bluetooth messages. Every message from the controller is
+ * queued for the device thread, even invalid ones, so that it answers them
+ * in order. Messages from observers are refused.
+ */
+static int
+recv_msg(const unsigned char* message, size_t message_size, const struct MessageOrigin* origin)
+{
+	unsigned char nack[BLUETOOTH_MESSAGE_SIZE] = { NOTIFY_NACK, 0 };
+	uint32_t seq = origin->first_seq;
+	struct Command cmd;
+	size_t offset;
+	int ret = 0;
+
+	if (!origin->controller)
+	{
+		LOG_DEBUG("Ignoring %u message(s) from an observer",
+				(unsigned)(message_size / BLUETOOTH_MESSAGE_SIZE));
+	}
+
+	for (offset = 0; offset + BLUETOOTH_MESSAGE_SIZE <= message_size;
+	     offset += BLUETOOTH_MESSAGE_SIZE, seq++)
+	{
+		if (!origin->controller)
+		{
+			nack[1] = seq & 0xff;
+			bluetooth_reply(origin->client, nack, sizeof(nack));
+			continue;
+		}
+
+		cmd = parse_message(message + offset, BLUETOOTH_MESSAGE_SIZE);
+		if (cmd.command_type == INVALID_COMMAND)
+		{
+			ret = -1;
+		}
+		cmd.rx_us = origin->rx_us;
+		cmd.client = origin->client;
+		cmd.seq = seq;
+		command_ring_push(&command_ring, &cmd);
+	}
+
+	if (offset != message_size)
+	{
+		/* Trailing partial message */
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Record every batch before handling it. Recording stops at the first error
+ * rather than holding up the server.
+ */
+static int
+record_and_recv_msg(const unsigned char* message, size_t message_size,
+                    const struct MessageOrigin* origin)
+{
+	if (recorder.fd != -1 && record_frame(&recorder, message, message_size, origin) == -1)
+	{
+		LOG_ERROR("Recording stopped: %s", strerror(errno));
+		record_close(&recorder);
+	}
+	return recv_msg(message, message_size, origin);
+}
+
+#ifndef BENCHMARK
+/*
+ * Map a control device command back to the bluetooth command ID.
+ */
+static unsigned char
+bluetooth_command_id(unsigned char command_type)
+{
+	unsigned char id;
+	for (id = 0; id < sizeof(command_map); id++)
+	{
+		if (command_map[id] == command_type)
+		{
+			return id;
+		}
+	}
+	return INVALID_COMMAND;
+}
+
+/*
+ * Turn the turret events waiting on the control device into notification
+ * messages for the clients.
+ */
+static ssize_t
+read_device_events(unsigned char* notification, size_t notification_size)
+{
+	struct dmg_event events[BLUETOOTH_STREAM_BUFFER_SIZE / BLUETOOTH_MESSAGE_SIZE];
+	size_t max_events = notification_size / BLUETOOTH_MESSAGE_SIZE;
+	ssize_t read_count;
+	size_t size = 0;
+	size_t i;
+
+	if (max_events > sizeof(events) / sizeof(events[0]))
+	{
+		max_events = sizeof(events) / sizeof(events[0]);
+	}
+
+	read_count = read(event_fd, events, max_events * sizeof(events[0]));
+	if (read_count == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("read " CONTROL_DEV_PATH ": %s", strerror(errno));
+		}
+		return -1;
+	}
+
+	for (i = 0; i < read_count / sizeof(events[0]); i++)
+	{
+		if (events[i].lost)
+		{
+			LOG_WARNING("Missed %u turret event(s)", events[i].lost);
+		}
+		switch (events[i].type)
+		{
+		case DMG_EVENT_STATE:
+			notification[size++] = NOTIFY_STATE;
+			notification[size++] = events[i].detail;
+			break;
+		case DMG_EVENT_REJECTED:
+			notification[size++] = NOTIFY_REJECTED;
+			notification[size++] = bluetooth_command_id(events[i].detail);
+			break;
+		case DMG_EVENT_FEEDBACK:
+			notification[size++] = NOTIFY_FEEDBACK;
+			notification[size++] = 0;
+			break;
+		case DMG_EVENT_PROGRAM:
+			notification[size++] = NOTIFY_PROGRAM;
+			notification[size++] = events[i].detail;
+			break;
+		}
+	}
+	return size;
+}
+#endif
+
+#ifndef SELF_TEST
+static void
+print_command_stats(void)
+{
+	struct CommandRingStats stats;
+	command_ring_stats(&command_ring, &stats);
+	LOG_INFO("Commands: %lu queued, %lu written, %lu dropped, high water mark %u/%u",
+			stats.pushed, stats.popped, stats.dropped, stats.high_water, COMMAND_RING_SIZE);
+}
+#endif
 
 #ifdef SELF_TEST
 #define FAKE_DEV_FILE_BUF_SIZE 256
+static unsigned char captured_messages[FAKE_DEV_FILE_BUF_SIZE];
+static size_t captured_size;
+static int captured_calls;
+
+static uint32_t captured_first_seq;
+
+/* Messages from a connected controller */
+static struct MessageOrigin test_origin = { .client = 1, .controller = true };
+
+static int
+capture_msg(const unsigned char* message, size_t message_size, const struct MessageOrigin* origin)
+{
+	captured_first_seq = origin->first_seq;
+	memcpy(captured_messages + captured_size, message, message_size);
+	captured_size += message_size;
+	captured_calls++;
+	return 0;
+}
+
 static void
 run_tests(void)
 {
@@ -121,12 +704,16 @@ run_tests(void)
 		assert(cmd.command_type == 'R');
 		assert(cmd.magnitude == 4);
 
+		cmd = parse_message((unsigned char[]){6, 0xa3}, 2);
+		assert(cmd.command_type == 'G');
+		assert(cmd.magnitude == 0x0a03);
+
 		/* Too many args */
 		cmd = parse_message((unsigned char[]){2, 0, 0}, 3);
 		assert(cmd.command_type == INVALID_COMMAND);
 
 		/* Command type out of bounds */
-		cmd = parse_message((unsigned char[]){6, 3}, 2);
+		cmd = parse_message((unsigned char[]){7, 3}, 2);
 		assert(cmd.command_type == INVALID_COMMAND);
 
 		/* Command type out of bounds */
@@ -144,56 +731,686 @@ run_tests(void)
 
 	/* Message handling tests */
 	{
-		unsigned char fake_dev_file[FAKE_DEV_FILE_BUF_SIZE] = "";
+		struct dmg_command fake_dev_file[FAKE_DEV_FILE_BUF_SIZE / sizeof(struct dmg_command)];
 		ssize_t fake_dev_file_size;
+		int ret;
+		int i;
 		char fake_file_name[] = "/tmp/remotecontroltest.XXXXXX";
 		control_fd = mkstemp(fake_file_name);
 		assert(control_fd != -1);
 		unlink(fake_file_name);
 
 		// fire
-		recv_msg((unsigned char[]){0, 0}, 2);
+		recv_msg((unsigned char[]){0, 0}, 2, &test_origin);
+		write_pending_commands();
 		lseek(control_fd, 0, SEEK_SET);
-		fake_dev_file_size = read(control_fd, fake_dev_file, FAKE_DEV_FILE_BUF_SIZE);
-		assert(fake_dev_file_size == 3);
-		assert(fake_dev_file[0] == 'F');
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == sizeof(struct dmg_command));
+		assert(fake_dev_file[0].version == DMG_COMMAND_VERSION);
+		assert(fake_dev_file[0].type == 'F');
+		assert(fake_dev_file[0].reserved == 0);
 
 		// Left
 		ftruncate(control_fd, 0);
 		lseek(control_fd, 0, SEEK_SET);
-		recv_msg((unsigned char[]){4, 0x10}, 2);
+		recv_msg((unsigned char[]){4, 0x10}, 2, &test_origin);
+		write_pending_commands();
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == 'L');
+		assert(fake_dev_file[0].value == 16);
+
+		// Batch of fire and left is a single write
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		ret = recv_msg((unsigned char[]){0, 0, 4, 3}, 4, &test_origin);
+		write_pending_commands();
+		assert(ret == 0);
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == 2 * sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == 'F');
+		assert(fake_dev_file[1].type == 'L');
+		assert(fake_dev_file[1].value == 3);
+
+		// An invalid message in a batch does not stop the rest
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		ret = recv_msg((unsigned char[]){7, 0, 5, 2}, 4, &test_origin);
+		write_pending_commands();
+		assert(ret == -1);
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == 'R');
+		assert(fake_dev_file[0].value == 2);
+
+		// Moves between fires are merged into one net move per axis
+		coalesce_window_ms = 0;
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		recv_msg((unsigned char[]){4, 3, 2, 1, 5, 1, 2, 1, 0, 0, 5, 2, 3, 1, 2, 1}, 16, &test_origin);
+		write_pending_commands();
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == 4 * sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == 'L');
+		assert(fake_dev_file[0].value == 2);
+		assert(fake_dev_file[1].type == 'U');
+		assert(fake_dev_file[1].value == 2);
+		assert(fake_dev_file[2].type == 'F');
+		assert(fake_dev_file[3].type == 'R');
+		assert(fake_dev_file[3].value == 2);
+
+		// Holding past the edge merges into the longest move the device takes
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		for (i = 0; i < DMG_AIM_STEPS + 2; i++)
+		{
+			recv_msg((unsigned char[]){4, 1}, 2, &test_origin);
+		}
+		recv_msg((unsigned char[]){3, 3, 2, 1}, 4, &test_origin);
+		write_pending_commands();
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == 2 * sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == 'L');
+		assert(fake_dev_file[0].value == DMG_AIM_STEPS);
+		assert(fake_dev_file[1].type == 'D');
+		assert(fake_dev_file[1].value == 2);
+
+		// Moves that cancel out are not written
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		recv_msg((unsigned char[]){3, 2, 2, 2}, 4, &test_origin);
+		write_pending_commands();
+		fake_dev_file_size = lseek(control_fd, 0, SEEK_END);
+		assert(fake_dev_file_size == 0);
+		coalesce_window_ms = -1;
+
+		// Traced commands are preceded by their receive time
+		trace_commands = 1;
+		ftruncate(control_fd, 0);
+		lseek(control_fd, 0, SEEK_SET);
+		test_origin.rx_us = 12345;
+		recv_msg((unsigned char[]){2, 9}, 2, &test_origin);
+		test_origin.rx_us = 0;
+		write_pending_commands();
+		lseek(control_fd, 0, SEEK_SET);
+		fake_dev_file_size = read(control_fd, fake_dev_file, sizeof(fake_dev_file));
+		assert(fake_dev_file_size == 2 * sizeof(struct dmg_command));
+		assert(fake_dev_file[0].type == DMG_CMD_TRACE);
+		assert(fake_dev_file[0].value == 12345);
+		assert(fake_dev_file[1].type == 'U');
+		assert(fake_dev_file[1].value == 9);
+		trace_commands = 0;
+
+		// Messages from observers are not carried out
+		ftruncate(control_fd, 0);
 		lseek(control_fd, 0, SEEK_SET);
-		fake_dev_file_size = read(control_fd, fake_dev_file, FAKE_DEV_FILE_BUF_SIZE);
-		assert(fake_dev_file_size == 4);
-		assert(fake_dev_file[0] == 'L');
-		assert(fake_dev_file[1] == '1');
-		assert(fake_dev_file[2] == '6');
+		test_origin.controller = false;
+		recv_msg((unsigned char[]){0, 0}, 2, &test_origin);
+		test_origin.controller = true;
+		write_pending_commands();
+		fake_dev_file_size = lseek(control_fd, 0, SEEK_END);
+		assert(fake_dev_file_size == 0);
 
 		close(control_fd);
 		control_fd = -1;
 	}
+
+	/* Acknowledgement tests */
+	{
+		struct Reply replies[MAX_BATCH_REPLIES];
+		ssize_t size;
+		char fake_file_name[] = "/tmp/remotecontroltest.XXXXXX";
+		int ret = pipe(reply_pipe);
+		assert(ret == 0);
+		fcntl(reply_pipe[0], F_SETFL, O_NONBLOCK);
+		control_fd = mkstemp(fake_file_name);
+		assert(control_fd != -1);
+		unlink(fake_file_name);
+
+		// The invalid message is NACKed and the batch ACKed up to its last message
+		test_origin.client = 3;
+		test_origin.first_seq = 10;
+		recv_msg((unsigned char[]){0, 0, 7, 0, 4, 1}, 6, &test_origin);
+		write_pending_commands();
+		size = read(reply_pipe[0], replies, sizeof(replies));
+		assert(size == 3 * sizeof(replies[0]));
+		assert(replies[0].client == 3);
+		assert(replies[0].frame[0] == NOTIFY_NACK && replies[0].frame[1] == 11);
+		assert(replies[1].frame[0] == NOTIFY_ACK && replies[1].frame[1] == 12);
+		assert(replies[2].frame[0] == NOTIFY_QUEUE && replies[2].frame[1] == 0);
+
+		// Messages that never reached the device thread are reported lost
+		test_origin.first_seq = 20;
+		recv_msg((unsigned char[]){5, 1}, 2, &test_origin);
+		write_pending_commands();
+		size = read(reply_pipe[0], replies, sizeof(replies));
+		assert(size == 4 * sizeof(replies[0]));
+		assert(replies[0].frame[0] == NOTIFY_LOST_FROM && replies[0].frame[1] == 13);
+		assert(replies[1].frame[0] == NOTIFY_LOST_TO && replies[1].frame[1] == 19);
+		assert(replies[2].frame[0] == NOTIFY_ACK && replies[2].frame[1] == 20);
+
+		// Every message merged into a rejected command is NACKed. An eventfd
+		// takes only one command per write, standing in for a device that
+		// rejects the first of several.
+		close(control_fd);
+		control_fd = eventfd(0, 0);
+		assert(control_fd != -1);
+		coalesce_window_ms = 0;
+		test_origin.first_seq = 21;
+		recv_msg((unsigned char[]){4, 1, 4, 2, 0, 0}, 6, &test_origin);
+		write_pending_commands();
+		coalesce_window_ms = -1;
+		size = read(reply_pipe[0], replies, sizeof(replies));
+		assert(size == 4 * sizeof(replies[0]));
+		assert(replies[0].frame[0] == NOTIFY_NACK && replies[0].frame[1] == 21);
+		assert(replies[1].frame[0] == NOTIFY_NACK && replies[1].frame[1] == 22);
+		assert(replies[2].frame[0] == NOTIFY_ACK && replies[2].frame[1] == 23);
+		test_origin.client = 1;
+		test_origin.first_seq = 0;
+
+		close(reply_pipe[0]);
+		close(reply_pipe[1]);
+		reply_pipe[0] = reply_pipe[1] = -1;
+		close(control_fd);
+		control_fd = -1;
+	}
+
+	/* Command ring tests */
+	{
+		struct CommandRing ring;
+		struct CommandRingStats stats;
+		struct Command cmds[COMMAND_RING_SIZE];
+		struct Command cmd = { .command_type = 'L', .magnitude = 0 };
+		size_t count;
+		int ret;
+		unsigned int i;
+
+		ret = command_ring_init(&ring, OVERFLOW_DROP_OLDEST);
+		assert(ret == 0);
+
+		// Commands come out in order
+		for (i = 0; i < 3; i++)
+		{
+			cmd.magnitude = i;
+			ret = command_ring_push(&ring, &cmd);
+			assert(ret == 0);
+		}
+		count = command_ring_pop(&ring, cmds, 2);
+		assert(count == 2);
+		assert(cmds[0].magnitude == 0);
+		assert(cmds[1].magnitude == 1);
+		count = command_ring_pop(&ring, cmds, COMMAND_RING_SIZE);
+		assert(count == 1);
+		assert(cmds[0].magnitude == 2);
+		count = command_ring_pop(&ring, cmds, COMMAND_RING_SIZE);
+		assert(count == 0);
+
+		// A full ring drops the oldest commands
+		for (i = 0; i < COMMAND_RING_SIZE + 2; i++)
+		{
+			cmd.magnitude = i;
+			ret = command_ring_push(&ring, &cmd);
+			assert(ret == (i >= COMMAND_RING_SIZE));
+		}
+		count = command_ring_pop(&ring, cmds, COMMAND_RING_SIZE);
+		assert(count == COMMAND_RING_SIZE);
+		assert(cmds[0].magnitude == 2);
+		assert(cmds[COMMAND_RING_SIZE - 1].magnitude == COMMAND_RING_SIZE + 1);
+
+		command_ring_stats(&ring, &stats);
+		assert(stats.pushed == COMMAND_RING_SIZE + 5);
+		assert(stats.popped == COMMAND_RING_SIZE + 3);
+		assert(stats.dropped == 2);
+		assert(stats.high_water == COMMAND_RING_SIZE);
+		command_ring_destroy(&ring);
+	}
+
+	/* Recording tests */
+	{
+		char path[] = "/tmp/remotecontrolrecord.XXXXXX";
+		const unsigned char messages[] = { 2, 1, 3, 1, 0, 0 };
+		struct MessageOrigin origin = { .client = 7, .controller = true, .first_seq = 40, .rx_us = 123 };
+		struct Recording recording;
+		struct RecordFrame frame;
+		const unsigned char* message;
+		struct Command cmds[4];
+		unsigned char long_message[BLUETOOTH_STREAM_BUFFER_SIZE];
+		struct rlimit limit;
+		struct rlimit saved_limit;
+		void (*saved_xfsz)(int);
+		size_t count;
+		ssize_t written;
+		int ret;
+		int fd = mkstemp(path);
+		assert(fd != -1);
+		close(fd);
+
+		// Recorded batches are still handled
+		ret = record_open(&recorder, path);
+		assert(ret == 0);
+		ret = record_and_recv_msg(messages, 4, &origin);
+		assert(ret == 0);
+		ret = record_close(&recorder);
+		assert(ret == 0);
+		origin.first_seq = 42;
+		origin.rx_us = 456;
+		ret = record_open(&recorder, path);
+		assert(ret == 0);
+		ret = record_and_recv_msg(messages + 4, 2, &origin);
+		assert(ret == 0);
+		count = command_ring_pop(&command_ring, cmds, 4);
+		assert(count == 3);
+		assert(cmds[0].command_type == 'U' && cmds[0].seq == 40);
+		assert(cmds[2].command_type == 'F' && cmds[2].seq == 42 && cmds[2].client == 7);
+
+		// A recording in progress, or whose server died, ends at the last frame.
+		// Reopening appends after the one header.
+		ret = recording_map(&recording, path);
+		assert(ret == 0);
+		message = recording_next(&recording, &frame);
+		assert(message && frame.size == 4 && memcmp(message, messages, 4) == 0);
+		assert(frame.client == 7 && frame.controller && frame.first_seq == 40 && frame.rx_us == 123);
+		message = recording_next(&recording, &frame);
+		assert(message && frame.size == 2 && memcmp(message, messages + 4, 2) == 0);
+		assert(frame.first_seq == 42 && frame.rx_us == 456);
+		message = recording_next(&recording, &frame);
+		assert(message == NULL);
+		assert(recording.offset == recording.size);
+		recording_unmap(&recording);
+		ret = record_close(&recorder);
+		assert(ret == 0);
+
+		// A cut off frame ends the recording early
+		frame.size = 2;
+		fd = open(path, O_WRONLY | O_APPEND);
+		written = write(fd, &frame, sizeof(frame));
+		assert(written == sizeof(frame));
+		close(fd);
+		ret = recording_map(&recording, path);
+		assert(ret == 0);
+		message = recording_next(&recording, &frame);
+		assert(message);
+		message = recording_next(&recording, &frame);
+		assert(message);
+		message = recording_next(&recording, &frame);
+		assert(message == NULL);
+		assert(recording.offset != recording.size);
+		recording_unmap(&recording);
+
+		// Recording again writes over the cut off frame
+		ret = record_open(&recorder, path);
+		assert(ret == 0);
+		ret = record_and_recv_msg(messages, 2, &origin);
+		assert(ret == 0);
+		ret = record_close(&recorder);
+		assert(ret == 0);
+		count = command_ring_pop(&command_ring, cmds, 4);
+		assert(count == 1);
+		ret = recording_map(&recording, path);
+		assert(ret == 0);
+		message = recording_next(&recording, &frame);
+		assert(message);
+		message = recording_next(&recording, &frame);
+		assert(message);
+		message = recording_next(&recording, &frame);
+		assert(message && frame.size == 2 && memcmp(message, messages, 2) == 0);
+		message = recording_next(&recording, &frame);
+		assert(message == NULL);
+		assert(recording.offset == recording.size);
+		recording_unmap(&recording);
+
+		// Running out of room stops the recording with an error rather than
+		// SIGBUS. A file size limit stands in for a full disk.
+		ret = truncate(path, 0);
+		assert(ret == 0);
+		ret = getrlimit(RLIMIT_FSIZE, &saved_limit);
+		assert(ret == 0);
+		limit = saved_limit;
+		limit.rlim_cur = 96 * 1024;
+		ret = setrlimit(RLIMIT_FSIZE, &limit);
+		assert(ret == 0);
+		saved_xfsz = signal(SIGXFSZ, SIG_IGN);
+		memset(long_message, 1, sizeof(long_message));
+		ret = record_open(&recorder, path);
+		assert(ret == 0);
+		for (count = 0; count < 1000; count++)
+		{
+			ret = record_frame(&recorder, long_message, sizeof(long_message), &origin);
+			if (ret != 0)
+			{
+				break;
+			}
+		}
+		assert(ret == -1 && errno == EFBIG);
+		ret = record_close(&recorder);
+		assert(ret == 0);
+		signal(SIGXFSZ, saved_xfsz);
+		ret = setrlimit(RLIMIT_FSIZE, &saved_limit);
+		assert(ret == 0);
+		ret = recording_map(&recording, path);
+		assert(ret == 0);
+		while (recording_next(&recording, &frame))
+		{
+			count--;
+		}
+		assert(count == 0 && recording.offset == recording.size);
+		recording_unmap(&recording);
+
+		// Other files are refused
+		fd = open(path, O_WRONLY | O_TRUNC);
+		written = write(fd, "not a recording", 15);
+		assert(written == 15);
+		close(fd);
+		ret = record_open(&recorder, path);
+		assert(ret == -1 && errno == EINVAL);
+		ret = recording_map(&recording, path);
+		assert(ret == -1 && errno == EINVAL);
+		unlink(path);
+	}
+
+	/* Event notification tests */
+	{
+		unsigned char notification[FAKE_DEV_FILE_BUF_SIZE];
+		struct dmg_event events[4] = {
+			{ .type = DMG_EVENT_STATE, .detail = DMG_TURRET_READY },
+			{ .type = DMG_EVENT_REJECTED, .detail = 'L' },
+			{ .type = DMG_EVENT_FEEDBACK },
+			{ .type = DMG_EVENT_PROGRAM, .detail = DMG_PROGRAM_ABORTED },
+		};
+		ssize_t size;
+		int fds[2];
+		int ret = pipe(fds);
+		assert(ret == 0);
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		event_fd = fds[0];
+
+		write(fds[1], events, sizeof(events));
+		size = read_device_events(notification, sizeof(notification));
+		assert(size == 8);
+		assert(memcmp(notification, (unsigned char[]){
+				NOTIFY_STATE, DMG_TURRET_READY,
+				NOTIFY_REJECTED, 4,
+				NOTIFY_FEEDBACK, 0,
+				NOTIFY_PROGRAM, DMG_PROGRAM_ABORTED}, 8) == 0);
+
+		// Nothing left to read
+		size = read_device_events(notification, sizeof(notification));
+		assert(size == -1);
+
+		close(fds[0]);
+		close(fds[1]);
+		event_fd = -1;
+	}
+
+	/* Stream reassembly tests */
+	{
+		struct MessageStream stream;
+		int fds[2];
+		ssize_t bytes_read;
+		int ret = pipe(fds);
+		assert(ret == 0);
+		message_stream_init(&stream);
+
+		// Several messages in one read are dispatched together
+		write(fds[1], (unsigned char[]){2, 1, 3, 2, 4}, 5);
+		bytes_read = message_stream_read(&stream, fds[0], capture_msg, &test_origin);
+		assert(bytes_read == 5);
+		assert(captured_calls == 1);
+		assert(captured_first_seq == 0);
+		assert(captured_size == 4);
+		assert(memcmp(captured_messages, (unsigned char[]){2, 1, 3, 2}, 4) == 0);
+
+		// The partial message is completed by the next read
+		write(fds[1], (unsigned char[]){3}, 1);
+		bytes_read = message_stream_read(&stream, fds[0], capture_msg, &test_origin);
+		assert(bytes_read == 1);
+		assert(captured_calls == 2);
+		assert(captured_first_seq == 2);
+		assert(captured_size == 6);
+		assert(memcmp(captured_messages + 4, (unsigned char[]){4, 3}, 2) == 0);
+
+		// Nothing is dispatched until a message is whole
+		write(fds[1], (unsigned char[]){5}, 1);
+		bytes_read = message_stream_read(&stream, fds[0], capture_msg, &test_origin);
+		assert(bytes_read == 1);
+		assert(captured_calls == 2);
+		assert(stream.len == 1);
+
+		close(fds[1]);
+		bytes_read = message_stream_read(&stream, fds[0], capture_msg, &test_origin);
+		assert(bytes_read == 0);
+		close(fds[0]);
+	}
 }
 #endif
 
+static void
+usage(const char* name)
+{
+#ifndef REPLAY
+	fprintf(stderr, "Usage: %s [-c ms] [-l rfcomm|unix:PATH|tcp:PORT] [-o drop|block] [-r FILE] [-t]\n"
+			"  -c  Merge queued relative moves into one per axis, waiting up to ms for\n"
+			"      more after a move (0 to only merge moves that are already queued)\n"
+			"  -l  Listen for bluetooth clients (default), or on a Unix socket or\n"
+			"      loopback TCP port for testing without bluetooth\n"
+			"  -o  When the command queue is full, drop the oldest command (default)\n"
+			"      or block bluetooth reads until the device catches up\n"
+			"  -r  Record every message received to FILE, for replay\n"
+			"  -t  Trace command latency; see trace_stats\n", name);
+#else
+	fprintf(stderr, "Usage: %s [-c ms] [-f] [-o drop|block] [-r FILE] [-t] RECORDING\n"
+			"  -f  Replay as fast as possible instead of at the recorded pace\n"
+			"  Otherwise as for remote_motor_control, but blocks rather than drops\n"
+			"  by default\n", name);
+#endif
+}
+
+/*
+ * Parse a -l argument. Returns 0, or -1 if it names no transport.
+ */
+static int
+parse_transport(const char* arg, enum Transport* transport, const char** address)
+{
+	if (strcmp(arg, "rfcomm") == 0)
+	{
+		*transport = TRANSPORT_RFCOMM;
+		*address = NULL;
+	}
+	else if (strncmp(arg, "unix:", 5) == 0)
+	{
+		*transport = TRANSPORT_UNIX;
+		*address = arg + 5;
+	}
+	else if (strncmp(arg, "tcp:", 4) == 0)
+	{
+		*transport = TRANSPORT_TCP;
+		*address = arg + 4;
+	}
+	else
+	{
+		return -1;
+	}
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
+#if !defined(BENCHMARK) && !defined(REPLAY)
+	enum OverflowPolicy policy = OVERFLOW_DROP_OLDEST;
+#else
+	/* Flat-out benchmark clients and replays would otherwise lose commands */
+	enum OverflowPolicy policy = OVERFLOW_BLOCK;
+#endif
+	enum Transport transport = TRANSPORT_RFCOMM;
+	const char* address = NULL;
+	const char* record_path = NULL;
+#ifdef REPLAY
+	bool paced = true;
+#endif
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:fl:o:r:t")) != -1)
+	{
+		if (opt == 'c' && (coalesce_window_ms = atoi(optarg)) >= 0)
+		{
+			/* Parsed */
+		}
+		else if (opt == 'l' && parse_transport(optarg, &transport, &address) == 0)
+		{
+			/* Parsed */
+		}
+		else if (opt == 'o' && strcmp(optarg, "drop") == 0)
+		{
+			policy = OVERFLOW_DROP_OLDEST;
+		}
+		else if (opt == 'o' && strcmp(optarg, "block") == 0)
+		{
+			policy = OVERFLOW_BLOCK;
+		}
+		else if (opt == 'r')
+		{
+			record_path = optarg;
+		}
+		else if (opt == 't')
+		{
+			trace_commands = 1;
+		}
+#ifdef REPLAY
+		else if (opt == 'f')
+		{
+			paced = false;
+		}
+#endif
+		else
+		{
+			usage(argv[0]);
+			return -1;
+		}
+	}
+#ifdef REPLAY
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+#endif
+
+	if (record_path)
+	{
+		if (record_open(&recorder, record_path) == -1)
+		{
+			fprintf(stderr, "record %s: %s\n", record_path,
+					errno == EINVAL ? "not a recording" : strerror(errno));
+			return -1;
+		}
+	}
+
+	if (command_ring_init(&command_ring, policy) == -1)
+	{
+		perror("command ring");
+		return -1;
+	}
+
 #ifndef SELF_TEST
+	BluetoothMessageHandler message_handler = recorder.fd != -1 ? record_and_recv_msg : recv_msg;
+	pthread_t device_thread;
+	struct EventSource sources[2];
+	int ret;
+
+#ifndef BENCHMARK
 	control_fd = open(CONTROL_DEV_PATH, O_WRONLY);
 	if (control_fd == -1)
 	{
 		perror("open " CONTROL_DEV_PATH);
 		return -1;
 	}
+#else
+	control_fd = benchmark_device_open();
+	if (control_fd == -1)
+	{
+		perror("benchmark device");
+		return -1;
+	}
+#endif
+
+	if (pipe(reply_pipe) == -1 ||
+	    fcntl(reply_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(reply_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+	{
+		perror("reply pipe");
+		return -1;
+	}
+	sources[0].fd = reply_pipe[0];
+	sources[0].handler = read_replies;
+
+	if (log_start() == -1)
+	{
+		fprintf(stderr, "Unable to start logging thread, logging synchronously\n");
+	}
+
+	ret = pthread_create(&device_thread, NULL, device_thread_main, NULL);
+	if (ret != 0)
+	{
+		LOG_ERROR("Unable to start device thread: %s", strerror(ret));
+		log_stop();
+		close(control_fd);
+		return -1;
+	}
+
+#ifndef BENCHMARK
+	/* A separate descriptor so event reads never wait on device writes */
+	event_fd = open(CONTROL_DEV_PATH, O_RDONLY | O_NONBLOCK);
+	if (event_fd == -1)
+	{
+		LOG_ERROR("open " CONTROL_DEV_PATH " for events: %s", strerror(errno));
+	}
 
-	int ret = run_rfcomm_server(recv_msg);
+	sources[1].fd = event_fd;
+	sources[1].handler = read_device_events;
 
+#ifndef REPLAY
+	ret = run_server(transport, address, message_handler, sources, 2);
+#else
+	ret = run_replay(argv[optind], paced, message_handler, sources, 2);
+#endif
+#else
+	ret = run_benchmark(message_handler, sources, 1);
+#endif
+
+	device_thread_stop = 1;
+	command_ring_wake(&command_ring);
+	pthread_join(device_thread, NULL);
+	print_command_stats();
+	log_stop();
+
+	if (event_fd != -1)
+	{
+		close(event_fd);
+	}
+	if (record_close(&recorder) == -1)
+	{
+		fprintf(stderr, "record %s: %s\n", record_path, strerror(errno));
+	}
+	close(reply_pipe[0]);
+	close(reply_pipe[1]);
+#ifndef BENCHMARK
 	close(control_fd);
+#else
+	benchmark_device_close();
+#endif
+	command_ring_destroy(&command_ring);
 	return ret;
 #else
 	fprintf(stderr, "Running self tests...\n");
 	run_tests();
 	fprintf(stderr, "Self tests pass!\n");
+	command_ring_destroy(&command_ring);
 	return 0;
 #endif
 }
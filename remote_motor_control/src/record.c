@@ -0,0 +1,274 @@
+/*
+ * Recording and reading back the messages the server received. The
+ * recorder copies each frame into a shared mapping of the file, so the
+ * bluetooth thread makes no system call for it except when the mapping
+ * moves on, every RECORD_WINDOW_SIZE bytes. Replay maps the file and hands
+ * out pointers into it, so it copies nothing.
+ */
+#include "record.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Room for at least a page and the largest frame */
+#define RECORD_WINDOW_SIZE (64 * 1024)
+
+/* Keeps the compiler from moving stores to the mapping across it */
+#define COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/* Frames are padded to an even length, which keeps their sizes aligned */
+#define FRAME_LENGTH(size) (sizeof(struct RecordFrame) + (((size) + 1) & ~(size_t)1))
+
+static int
+header_valid(const struct RecordFileHeader* header)
+{
+	return memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) == 0 &&
+	       header->version == RECORD_VERSION;
+}
+
+/* Map RECORD_WINDOW_SIZE bytes of the file from the page holding used */
+static int
+record_map_window(struct Recorder* recorder)
+{
+	off_t offset = recorder->used & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	void* window;
+	int err;
+
+	if (recorder->window)
+	{
+		munmap(recorder->window, RECORD_WINDOW_SIZE);
+		recorder->window = NULL;
+	}
+	/*
+	 * The file grows with zeros, which read back as the end of the recording.
+	 * Reserve the disk space now: a store to a page the disk has no room for
+	 * would raise SIGBUS, where this fails and recording stops.
+	 */
+	err = posix_fallocate(recorder->fd, offset, RECORD_WINDOW_SIZE);
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	window = mmap(NULL, RECORD_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			recorder->fd, offset);
+	if (window == MAP_FAILED)
+	{
+		return -1;
+	}
+	recorder->window = window;
+	recorder->window_offset = offset;
+	return 0;
+}
+
+int
+record_open(struct Recorder* recorder, const char* path)
+{
+	struct RecordFileHeader header;
+	struct Recording recording;
+	struct RecordFrame frame;
+	struct stat st;
+	int saved_errno;
+
+	recorder->window = NULL;
+	recorder->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (recorder->fd == -1)
+	{
+		return -1;
+	}
+	if (fstat(recorder->fd, &st) == -1)
+	{
+		goto fail;
+	}
+
+	if (st.st_size == 0)
+	{
+		memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+		header.version = RECORD_VERSION;
+		if (pwrite(recorder->fd, &header, sizeof(header), 0) != sizeof(header))
+		{
+			goto fail;
+		}
+		recorder->used = sizeof(header);
+	}
+	else
+	{
+		/*
+		 * Append after the last whole frame. Whatever follows it, such as a
+		 * frame cut off when the server died, goes.
+		 */
+		if (recording_map(&recording, path) == -1)
+		{
+			goto fail;
+		}
+		while (recording_next(&recording, &frame))
+		{
+		}
+		recorder->used = recording.offset;
+		recording_unmap(&recording);
+		if (ftruncate(recorder->fd, recorder->used) == -1)
+		{
+			goto fail;
+		}
+	}
+
+	if (record_map_window(recorder) == -1)
+	{
+		goto fail;
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	close(recorder->fd);
+	recorder->fd = -1;
+	errno = saved_errno;
+	return -1;
+}
+
+int
+record_frame(struct Recorder* recorder, const unsigned char* message, size_t message_size,
+             const struct MessageOrigin* origin)
+{
+	struct RecordFrame frame;
+	unsigned char* dest;
+
+	if (message_size == 0)
+	{
+		return 0;
+	}
+	if (message_size > BLUETOOTH_STREAM_BUFFER_SIZE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	/* Leaving room for a zero size after the frame to end the recording */
+	if (recorder->used + FRAME_LENGTH(message_size) + sizeof(frame) >
+	    recorder->window_offset + RECORD_WINDOW_SIZE && record_map_window(recorder) == -1)
+	{
+		return -1;
+	}
+
+	frame.rx_us = origin->rx_us;
+	frame.client = origin->client;
+	frame.first_seq = origin->first_seq;
+	frame.size = 0;
+	frame.controller = origin->controller;
+	frame.reserved = 0;
+
+	dest = recorder->window + (recorder->used - recorder->window_offset);
+	memcpy(dest, &frame, sizeof(frame));
+	memcpy(dest + sizeof(frame), message, message_size);
+	/* The size goes in last, so a frame never ends the recording half written */
+	COMPILER_BARRIER();
+	*(volatile uint16_t*)(dest + offsetof(struct RecordFrame, size)) = message_size;
+	recorder->used += FRAME_LENGTH(message_size);
+	return 0;
+}
+
+int
+record_close(struct Recorder* recorder)
+{
+	int ret;
+
+	if (recorder->fd == -1)
+	{
+		return 0;
+	}
+	if (recorder->window)
+	{
+		munmap(recorder->window, RECORD_WINDOW_SIZE);
+		recorder->window = NULL;
+	}
+	/* Even if this fails, the zeros after the last frame read as the end */
+	ret = ftruncate(recorder->fd, recorder->used);
+	close(recorder->fd);
+	recorder->fd = -1;
+	return ret;
+}
+
+int
+recording_map(struct Recording* recording, const char* path)
+{
+	struct RecordFileHeader header;
+	struct stat st;
+	void* data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(header))
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if (!header_valid(&header))
+	{
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	recording->data = data;
+	recording->map_size = st.st_size;
+	recording->size = st.st_size;
+	recording->offset = sizeof(header);
+	return 0;
+}
+
+void
+recording_unmap(struct Recording* recording)
+{
+	if (recording->data)
+	{
+		munmap((void*)recording->data, recording->map_size);
+		recording->data = NULL;
+	}
+}
+
+const unsigned char*
+recording_next(struct Recording* recording, struct RecordFrame* frame)
+{
+	const unsigned char* message;
+
+	if (recording->size - recording->offset < sizeof(*frame))
+	{
+		return NULL;
+	}
+	/* Frames are only 2-byte aligned in the file */
+	memcpy(frame, recording->data + recording->offset, sizeof(*frame));
+	if (frame->size == 0)
+	{
+		/* The unused end of a file still being recorded, or whose server died */
+		recording->size = recording->offset;
+		return NULL;
+	}
+	if (recording->size - recording->offset < FRAME_LENGTH(frame->size))
+	{
+		return NULL;
+	}
+	message = recording->data + recording->offset + sizeof(*frame);
+	recording->offset += FRAME_LENGTH(frame->size);
+	return message;
+}
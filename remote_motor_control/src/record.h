@@ -0,0 +1,84 @@
+#ifndef RC_RECORD_H
+#define RC_RECORD_H
+#include "bluetooth.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Recordings of the messages the server received, for replay. A recording
+ * is a RecordFileHeader followed by frames, each a RecordFrame and then its
+ * size bytes of messages, in the host's byte order. A frame with a size of 0
+ * ends the recording; the rest of the file is unused. Recording again to the
+ * same file appends to it.
+ */
+#define RECORD_MAGIC "DMGR"
+#define RECORD_VERSION 1
+
+struct RecordFileHeader
+{
+	char magic[4];
+	uint32_t version;
+};
+
+/* One batch of messages, as passed to the message handler */
+struct RecordFrame
+{
+	uint32_t rx_us; /* MessageOrigin.rx_us */
+	uint32_t client;
+	uint32_t first_seq;
+	uint16_t size;
+	uint8_t controller;
+	uint8_t reserved;
+};
+
+/*
+ * Appends frames through a shared mapping of the end of the file, so
+ * recording a frame is a copy with no system call. Frames are complete in
+ * the file as soon as record_frame returns, even if the server then dies.
+ */
+struct Recorder
+{
+	int fd; /* -1 when not recording */
+	unsigned char* window; /* The mapped part of the file */
+	off_t window_offset;
+	size_t used; /* Bytes of the file holding the header and frames */
+};
+
+/*
+ * Open path for recording, creating it if need be. Returns 0, or -1 with
+ * errno set, to EINVAL if the file is not a recording.
+ */
+int record_open(struct Recorder* recorder, const char* path);
+
+/* Returns 0, or -1 with errno set if the file could not be extended, e.g. on a full disk */
+int record_frame(struct Recorder* recorder, const unsigned char* message, size_t message_size,
+                 const struct MessageOrigin* origin);
+
+/*
+ * Trim the file to the frames recorded and close it. Returns 0, or -1 with
+ * errno set if it could not be trimmed.
+ */
+int record_close(struct Recorder* recorder);
+
+/* A recording mapped into memory, read a frame at a time */
+struct Recording
+{
+	const unsigned char* data;
+	size_t map_size;
+	size_t size; /* Up to the end of the last frame, once it is found */
+	size_t offset; /* Of the next frame */
+};
+
+/* Returns 0, or -1 with errno set, to EINVAL if the file is not a recording */
+int recording_map(struct Recording* recording, const char* path);
+void recording_unmap(struct Recording* recording);
+
+/*
+ * Fill frame with the next frame and return its messages, which point into
+ * the mapping. Returns NULL at the end, which leaves recording->offset short
+ * of recording->size only if the last frame was cut off.
+ */
+const unsigned char* recording_next(struct Recording* recording, struct RecordFrame* frame);
+
+#endif /* RC_RECORD_H */
@@ -0,0 +1,123 @@
+/*
+ * Replay of a recording made with the server's -r option. The frames go to
+ * the message handler straight from the mapped file, so replaying costs the
+ * handler's time and little else; with the device thread writing to the
+ * control device, the module sees the commands as it did in the session.
+ */
+#include "replay.h"
+#include "record.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#define REPLAY_MAX_SOURCES 4
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Run the event sources' handlers until deadline_ns, or once over whatever
+ * they have ready if it has passed. poll only times out in whole
+ * milliseconds, so the last one is spent polling without waiting.
+ */
+static void
+drain_sources(const struct EventSource* sources, size_t source_count,
+              unsigned long long deadline_ns)
+{
+	unsigned char notification[BLUETOOTH_STREAM_BUFFER_SIZE];
+	struct pollfd fds[REPLAY_MAX_SOURCES];
+	const struct EventSource* polled[REPLAY_MAX_SOURCES];
+	unsigned long long now;
+	size_t count = 0;
+	size_t i;
+	int timeout_ms;
+
+	for (i = 0; i < source_count && count < REPLAY_MAX_SOURCES; i++)
+	{
+		if (sources[i].fd != -1)
+		{
+			fds[count].fd = sources[i].fd;
+			fds[count].events = POLLIN;
+			polled[count++] = &sources[i];
+		}
+	}
+
+	do
+	{
+		now = now_ns();
+		timeout_ms = deadline_ns > now ? (deadline_ns - now) / 1000000 : 0;
+		if (poll(fds, count, timeout_ms) > 0)
+		{
+			for (i = 0; i < count; i++)
+			{
+				if (fds[i].revents & POLLIN)
+				{
+					/* Nobody to send it to */
+					while (polled[i]->handler(notification, sizeof(notification)) > 0)
+					{
+					}
+				}
+			}
+		}
+	} while (now_ns() < deadline_ns);
+}
+
+int
+run_replay(const char* path, bool paced, BluetoothMessageHandler message_handler,
+           const struct EventSource* sources, size_t source_count)
+{
+	struct Recording recording;
+	struct RecordFrame frame;
+	struct MessageOrigin origin;
+	const unsigned char* message;
+	unsigned long long start_ns;
+	unsigned long long due_ns = 0;
+	unsigned long long elapsed_ns;
+	unsigned long frames = 0;
+	unsigned long messages = 0;
+	uint32_t last_rx_us = 0;
+
+	if (recording_map(&recording, path) == -1)
+	{
+		fprintf(stderr, "%s: %s\n", path,
+				errno == EINVAL ? "not a recording" : strerror(errno));
+		return -1;
+	}
+
+	start_ns = now_ns();
+	while ((message = recording_next(&recording, &frame)) != NULL)
+	{
+		/* Read times are 32 bits of microseconds, so only differences count */
+		if (paced && frames > 0)
+		{
+			due_ns += (uint32_t)(frame.rx_us - last_rx_us) * 1000ull;
+		}
+		last_rx_us = frame.rx_us;
+		drain_sources(sources, source_count, paced ? start_ns + due_ns : 0);
+
+		origin.client = frame.client;
+		origin.controller = frame.controller;
+		origin.first_seq = frame.first_seq;
+		origin.rx_us = monotonic_us();
+		message_handler(message, frame.size, &origin);
+		frames++;
+		messages += frame.size / BLUETOOTH_MESSAGE_SIZE;
+	}
+	elapsed_ns = now_ns() - start_ns;
+
+	if (recording.offset != recording.size)
+	{
+		fprintf(stderr, "%s: last frame cut off after %lu frames\n", path, frames);
+	}
+	printf("Replayed %lu messages in %lu frames in %.3fs (%.0f messages/s)\n", messages, frames,
+			elapsed_ns / 1e9, elapsed_ns ? messages * 1e9 / elapsed_ns : 0.0);
+	recording_unmap(&recording);
+	return 0;
+}
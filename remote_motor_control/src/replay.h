@@ -0,0 +1,18 @@
+#ifndef RC_REPLAY_H
+#define RC_REPLAY_H
+#include "bluetooth.h"
+#include <stdbool.h>
+
+/*
+ * Feed the frames recorded in path to message_handler, as the connection loop
+ * would have, with the recorded clients and message numbers. Paced, each
+ * frame is handed over as long after the first as it was read after the
+ * first; otherwise as fast as the handler takes them. The event sources are
+ * drained in between and what they would send is dropped, since no client is
+ * connected. Prints how long it took. Returns 0, or -1 if the recording could
+ * not be read.
+ */
+int run_replay(const char* path, bool paced, BluetoothMessageHandler message_handler,
+               const struct EventSource* sources, size_t source_count);
+
+#endif /* RC_REPLAY_H */
@@ -0,0 +1,169 @@
+/*
+ * Collect the command latency traces the module logs when remote_motor_control
+ * runs with -t, and print percentiles for each stage:
+ *   queue:  read from bluetooth -> written to the control device
+ *   device: written -> first PWM frame that applied it (fire/prime: applied)
+ *   total:  read from bluetooth -> applied
+ */
+#include "DMGturret.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#define CONTROL_DEV_PATH "/dev/motor_control"
+#define MAX_SAMPLES 65536
+#define POLL_INTERVAL_US 100000
+
+static uint32_t queue_us[MAX_SAMPLES];
+static uint32_t device_us[MAX_SAMPLES];
+static uint32_t total_us[MAX_SAMPLES];
+static size_t sample_count;
+static volatile sig_atomic_t stop = 0;
+
+static void
+handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static int
+compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint32_t
+percentile(const uint32_t* sorted, size_t count, unsigned int pct)
+{
+	size_t rank = (count * pct + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void
+print_stage(const char* name, uint32_t* samples, size_t count)
+{
+	qsort(samples, count, sizeof(*samples), compare_u32);
+	printf("%-8s %10u %10u %10u\n", name,
+			percentile(samples, count, 50), percentile(samples, count, 99),
+			samples[count - 1]);
+}
+
+/*
+ * Copy the traces logged since *next. Returns 0, or -1 if some were
+ * overwritten before they could be copied.
+ */
+static int
+collect_traces(const volatile struct dmg_trace_log* log, uint32_t* next)
+{
+	struct dmg_trace trace;
+	uint32_t head = log->head;
+	int ret = 0;
+
+	__asm__ __volatile__("" ::: "memory");
+	if (head - *next > DMG_TRACE_COUNT)
+	{
+		*next = head - DMG_TRACE_COUNT;
+		ret = -1;
+	}
+
+	for (; *next != head && sample_count < MAX_SAMPLES; (*next)++)
+	{
+		trace = *(const struct dmg_trace*)&log->traces[*next % DMG_TRACE_COUNT];
+		__asm__ __volatile__("" ::: "memory");
+		if (log->head - *next > DMG_TRACE_COUNT)
+		{
+			/* Overwritten while it was being copied */
+			ret = -1;
+			continue;
+		}
+		queue_us[sample_count] = trace.write_us - trace.rx_us;
+		device_us[sample_count] = trace.frame_us - trace.write_us;
+		total_us[sample_count] = trace.frame_us - trace.rx_us;
+		sample_count++;
+	}
+	return ret;
+}
+
+int
+main(int argc, char** argv)
+{
+	const volatile struct dmg_trace_log* log;
+	void* page;
+	unsigned long seconds = 0;
+	unsigned long polls = 0;
+	int overwritten = 0;
+	uint32_t dropped;
+	uint32_t next;
+	int fd;
+
+	if (argc > 2 || (argc == 2 && (seconds = strtoul(argv[1], NULL, 10)) == 0))
+	{
+		fprintf(stderr, "Usage: %s [seconds]\n"
+				"  Collect traces until interrupted, or for the given time\n", argv[0]);
+		return -1;
+	}
+
+	fd = open(CONTROL_DEV_PATH, O_RDONLY);
+	if (fd == -1)
+	{
+		perror("open " CONTROL_DEV_PATH);
+		return -1;
+	}
+	page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+	{
+		perror("mmap " CONTROL_DEV_PATH);
+		close(fd);
+		return -1;
+	}
+	log = (const volatile struct dmg_trace_log*)((char*)page + DMG_TRACE_LOG_OFFSET);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	/* Only traces logged from now on */
+	next = log->head;
+	dropped = log->dropped;
+	while (!stop && sample_count < MAX_SAMPLES &&
+	       (!seconds || polls < seconds * (1000000 / POLL_INTERVAL_US)))
+	{
+		usleep(POLL_INTERVAL_US);
+		polls++;
+		if (collect_traces(log, &next) != 0)
+		{
+			overwritten = 1;
+		}
+	}
+	dropped = log->dropped - dropped;
+
+	munmap(page, getpagesize());
+	close(fd);
+
+	if (overwritten)
+	{
+		fprintf(stderr, "Some traces were overwritten before they were collected\n");
+	}
+	if (dropped)
+	{
+		fprintf(stderr, "The module dropped %u trace(s)\n", dropped);
+	}
+	if (sample_count == 0)
+	{
+		fprintf(stderr, "No traces; is remote_motor_control running with -t?\n");
+		return -1;
+	}
+
+	printf("%u command(s), latency in us\n", (unsigned)sample_count);
+	printf("%-8s %10s %10s %10s\n", "stage", "p50", "p99", "max");
+	print_stage("queue", queue_us, sample_count);
+	print_stage("device", device_us, sample_count);
+	print_stage("total", total_us, sample_count);
+	return 0;
+}